@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "os_swap.h"
+#include "bch.h"
+#include "bch_cache.h"
+
+/* CRC32 (IEEE 802.3, reflected 0xedb88320) of every byte value */
+static const unsigned int crc32_table[256] = {
+	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
+	0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
+	0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec, 0x14015c4f, 0x63066cd9,
+	0xfa0f3d63, 0x8d080df5, 0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b, 0x35b5a8fa, 0x42b2986c,
+	0xdbbbc9d6, 0xacbcf940, 0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
+	0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d, 0x76dc4190, 0x01db7106,
+	0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
+	0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
+	0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
+	0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
+	0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
+	0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
+	0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
+	0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
+	0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
+	0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
+	0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
+	0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
+	0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
+	0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
+	0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
+	0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d,
+};
+
+static unsigned int crc32(unsigned int crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	crc = ~crc;
+	while (len--)
+		crc = crc32_table[(crc ^ *p++) & 0xff]^(crc >> 8);
+
+	return ~crc;
+}
+
+/*
+ * checksum a table file image, skipping its checksum field
+ */
+static unsigned int bch_cache_checksum(const unsigned char *file, size_t size)
+{
+	const size_t off = offsetof(struct bch_cache_header, checksum);
+	const unsigned int zero = 0;
+	unsigned int crc;
+
+	crc = crc32(0, file, off);
+	crc = crc32(crc, &zero, sizeof(zero));
+	return crc32(crc, file + off + sizeof(zero), size - off - sizeof(zero));
+}
+
+static void bch_cache_path(char *path, size_t size, const char *dir, int m,
+			   int t, unsigned int prim_poly, unsigned int encoder,
+			   unsigned int sector_size)
+{
+	snprintf(path, size, "%s/bch-m%d-t%d-p%x-%s-s%u.tab", dir, m, t,
+	         prim_poly, (encoder == BCH_ENCODER_MOD4) ? "mod4" : "mod8",
+	         sector_size);
+}
+
+/*
+ * map and validate a table file, and build a BCH control structure on it;
+ * returns NULL if the file is missing or stale
+ */
+static struct bch_control *bch_cache_map(const char *path, int m, int t,
+					 unsigned int prim_poly,
+					 unsigned int flags,
+					 unsigned int sector_size,
+					 unsigned char *erased_ecc,
+					 struct bch_cache *cache)
+{
+	int fd;
+	struct stat st;
+	unsigned char *map;
+	const struct bch_cache_header *hdr;
+	struct bch_control *bch = NULL;
+	const unsigned int encoder = flags & (BCH_ENCODER_MOD8|BCH_ENCODER_MOD4);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if ((fstat(fd, &st) < 0) || (st.st_size < sizeof(*hdr))) {
+		close(fd);
+		fprintf(stderr, "%s: Stale table cache %s, rebuilding.\n", __func__, path);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = (const struct bch_cache_header *)map;
+	if (memcmp(hdr->magic, BCH_CACHE_MAGIC, sizeof(BCH_CACHE_MAGIC)) ||
+	    (hdr->version != BCH_CACHE_VERSION) ||
+	    (hdr->header_size != sizeof(*hdr)) ||
+	    (hdr->byte_order != BCH_CACHE_ORDER) ||
+	    (hdr->m != m) || (hdr->t != t) || (hdr->prim_poly != prim_poly) ||
+	    (hdr->encoder != encoder) || (hdr->sector_size != sector_size) ||
+	    (hdr->tab_offset % BCH_CACHE_ALIGN) ||
+	    (sizeof(*hdr) + hdr->ecc_bytes > hdr->tab_offset) ||
+	    ((size_t)hdr->tab_offset + hdr->tab_size != st.st_size) ||
+	    (hdr->checksum != bch_cache_checksum(map, st.st_size)))
+		goto stale;
+
+	bch = init_bch_prebuilt(m, t, prim_poly, flags, hdr->ecc_bits,
+	                        (const uint32_t *)(map + hdr->tab_offset));
+	if ((bch == NULL) || (bch->ecc_bytes != hdr->ecc_bytes) ||
+	    (bch_encoder_tab_size(bch) != hdr->tab_size)) {
+		free_bch(bch);
+		goto stale;
+	}
+
+	memcpy(erased_ecc, map + sizeof(*hdr), hdr->ecc_bytes);
+	cache->map = map;
+	cache->map_size = st.st_size;
+	return bch;
+
+stale:
+	fprintf(stderr, "%s: Stale table cache %s, rebuilding.\n", __func__, path);
+	munmap(map, st.st_size);
+	return NULL;
+}
+
+/*
+ * write a table file atomically, so that concurrent readers only ever map a
+ * complete file
+ */
+static int bch_cache_store(const char *path, struct bch_control *bch,
+			   unsigned int prim_poly, unsigned int encoder,
+			   unsigned int sector_size,
+			   const unsigned char *erased_ecc)
+{
+	int fd, ret = -1;
+	char tmp[4096 + 16];
+	unsigned char *file;
+	struct bch_cache_header *hdr;
+	const size_t tab_size = bch_encoder_tab_size(bch);
+	const size_t tab_offset = ALIGN(sizeof(*hdr) + bch->ecc_bytes, BCH_CACHE_ALIGN);
+	const size_t size = tab_offset + tab_size;
+
+	file = calloc(1, size);
+	if (file == NULL)
+		return -1;
+
+	hdr = (struct bch_cache_header *)file;
+	memcpy(hdr->magic, BCH_CACHE_MAGIC, sizeof(BCH_CACHE_MAGIC));
+	hdr->version     = BCH_CACHE_VERSION;
+	hdr->header_size = sizeof(*hdr);
+	hdr->byte_order  = BCH_CACHE_ORDER;
+	hdr->m           = bch->m;
+	hdr->t           = bch->t;
+	hdr->prim_poly   = prim_poly;
+	hdr->encoder     = encoder;
+	hdr->ecc_bits    = bch->ecc_bits;
+	hdr->ecc_bytes   = bch->ecc_bytes;
+	hdr->sector_size = sector_size;
+	hdr->tab_offset  = tab_offset;
+	hdr->tab_size    = tab_size;
+	memcpy(file + sizeof(*hdr), erased_ecc, bch->ecc_bytes);
+	memcpy(file + tab_offset, bch->mod4_tab ? bch->mod4_tab : bch->mod8_tab, tab_size);
+	hdr->checksum    = bch_cache_checksum(file, size);
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (fd < 0)
+		goto OUT;
+
+	if (write(fd, file, size) == size)
+		ret = 0;
+	if (close(fd) < 0)
+		ret = -1;
+
+	if (!ret)
+		ret = rename(tmp, path);
+	if (ret)
+		unlink(tmp);
+OUT:
+	free(file);
+	return ret;
+}
+
+/**
+ * bch_cache_init - initialize a BCH encoder from a precomputed table file
+ * @dir:         table cache directory
+ * @m:           Galois field order
+ * @t:           error correction capability
+ * @prim_poly:   primitive polynomial, or 0 to use default
+ * @flags:       init_bch() flags
+ * @sector_size: ECC sector size, for computing @erased_ecc
+ * @erased_ecc:  output ecc of an erased (all 0xff) sector
+ * @cache:       output mapping, to release with bch_cache_free() after
+ *               free_bch()
+ *
+ * The table file for these parameters is mapped read-only and shared, so
+ * that concurrent processes use the same page cache pages. If it is missing
+ * or fails validation, tables are computed by init_bch() and the file is
+ * (re)written for the next run.
+ */
+struct bch_control *bch_cache_init(const char *dir, int m, int t,
+				   unsigned int prim_poly, unsigned int flags,
+				   unsigned int sector_size,
+				   unsigned char *erased_ecc,
+				   struct bch_cache *cache)
+{
+	char path[4096];
+	unsigned char *erased_page;
+	struct bch_control *bch;
+	const unsigned int encoder = bch_encoder_type(m, t, flags);
+
+	cache->map = NULL;
+	cache->map_size = 0;
+	flags |= encoder;
+
+	bch_cache_path(path, sizeof(path), dir, m, t, prim_poly, encoder, sector_size);
+	bch = bch_cache_map(path, m, t, prim_poly, flags, sector_size, erased_ecc, cache);
+	if (bch)
+		return bch;
+
+	bch = init_bch(m, t, prim_poly, flags);
+	if (bch == NULL)
+		return NULL;
+
+	erased_page = malloc(sector_size);
+	if (erased_page == NULL) {
+		free_bch(bch);
+		return NULL;
+	}
+	memset(erased_page, 0xff, sector_size);
+	memset(erased_ecc, 0, bch->ecc_bytes);
+	encode_bch(bch, erased_page, sector_size, erased_ecc);
+	free(erased_page);
+
+	mkdir(dir, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+	if (bch_cache_store(path, bch, prim_poly, encoder, sector_size, erased_ecc)) {
+		fprintf(stderr, "%s: Error when write table cache %s: ", __func__, path);
+		perror(NULL);
+	}
+
+	return bch;
+}
+
+/**
+ * bch_cache_free - release a table file mapping
+ * @cache:       mapping set by bch_cache_init()
+ */
+void bch_cache_free(struct bch_cache *cache)
+{
+	if (cache->map)
+		munmap(cache->map, cache->map_size);
+	cache->map = NULL;
+}
@@ -0,0 +1,67 @@
+#ifndef _BCH_CACHE_H
+#define _BCH_CACHE_H
+
+#define BCH_CACHE_MAGIC   "NANDBCH"
+#define BCH_CACHE_VERSION 1
+#define BCH_CACHE_ORDER   0x01020304 /* written in host byte order */
+#define BCH_CACHE_ALIGN   4096       /* tables offset, keeps them mmap aligned */
+
+/**
+ * struct bch_cache_header - header of a precomputed BCH table file
+ * @magic:       BCH_CACHE_MAGIC
+ * @version:     BCH_CACHE_VERSION
+ * @header_size: size of this header
+ * @byte_order:  BCH_CACHE_ORDER, tables are stored in host byte order
+ * @m:           Galois field order
+ * @t:           error correction capability
+ * @prim_poly:   primitive polynomial, 0 for the default one
+ * @encoder:     BCH_ENCODER_MOD8 or BCH_ENCODER_MOD4
+ * @ecc_bits:    generator polynomial degree
+ * @ecc_bytes:   ecc size in bytes
+ * @sector_size: size of the erased sector whose ecc is stored
+ * @tab_offset:  file offset of the remainder tables
+ * @tab_size:    size of the remainder tables
+ * @checksum:    CRC-32 of the whole file, computed with this field set to 0
+ *
+ * The header is followed by the @ecc_bytes ecc of an erased (all 0xff) sector
+ * of @sector_size bytes, then by the tables at @tab_offset.
+ *
+ * The file is keyed by (m, t, prim_poly, encoder, sector_size), which is
+ * encoded in its name as well.
+ */
+struct bch_cache_header {
+	char         magic[8];
+	unsigned int version;
+	unsigned int header_size;
+	unsigned int byte_order;
+	unsigned int m;
+	unsigned int t;
+	unsigned int prim_poly;
+	unsigned int encoder;
+	unsigned int ecc_bits;
+	unsigned int ecc_bytes;
+	unsigned int sector_size;
+	unsigned int tab_offset;
+	unsigned int tab_size;
+	unsigned int checksum;
+};
+
+/**
+ * struct bch_cache - read-only mapping of a table file
+ * @map:       mapping address
+ * @map_size:  mapping size
+ */
+struct bch_cache {
+	void   *map;
+	size_t  map_size;
+};
+
+struct bch_control *bch_cache_init(const char *dir, int m, int t,
+				   unsigned int prim_poly, unsigned int flags,
+				   unsigned int sector_size,
+				   unsigned char *erased_ecc,
+				   struct bch_cache *cache);
+
+void bch_cache_free(struct bch_cache *cache);
+
+#endif /* _BCH_CACHE_H */
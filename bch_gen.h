@@ -0,0 +1,27 @@
+#ifndef _BCH_GEN_H
+#define _BCH_GEN_H
+
+/*
+ * same prototype as encode_bch(); generated encoders require a non-NULL ecc
+ */
+typedef void (*bch_encode_fn)(struct bch_control *bch, const uint8_t *data,
+                              unsigned int len, uint8_t *ecc);
+
+/**
+ * struct bch_gen_encoder - encoder specialized at build time by tools/bchgen
+ * @m:         Galois field order
+ * @t:         error correction capability
+ * @prim_poly: primitive polynomial
+ * @encode:    encoder, with remainder held in registers and constant tables
+ */
+struct bch_gen_encoder {
+	unsigned int  m;
+	unsigned int  t;
+	unsigned int  prim_poly;
+	bch_encode_fn encode;
+};
+
+/* terminated by an entry with a NULL encode */
+extern const struct bch_gen_encoder bch_gen_encoders[];
+
+#endif /* _BCH_GEN_H */
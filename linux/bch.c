@@ -43,11 +43,13 @@
  * Algorithmic details:
  *
  * Encoding is performed by processing 32 input bits in parallel, using 4
- * remainder lookup tables.
+ * remainder lookup tables of 256 entries; for large values of t, 8 tables of
+ * 16 entries are used instead, to keep them small enough for L1 cache.
  *
  * The final stage of decoding involves the following internal steps:
  * a. Syndrome computation
  * b. Error locator polynomial computation using Berlekamp-Massey algorithm
+ *    (or its inversionless variant when decoding a batch of codewords)
  * c. Error locator root finding (by far the most expensive step)
  *
  * In this implementation, step c is not performed using the usual Chien search.
@@ -78,6 +80,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "os_swap.h"
 #include "bch.h"
@@ -95,6 +98,17 @@
 #define BCH_ECC_WORDS(_p)      DIV_ROUND_UP(GF_M(_p)*GF_T(_p), 32)
 #define BCH_ECC_BYTES(_p)      DIV_ROUND_UP(GF_M(_p)*GF_T(_p), 8)
 
+#define BCH_ARENA_ALIGN        64
+#define BCH_HUGE_PAGE_SIZE     (2UL << 20)
+
+/*
+ * largest 8-bit remainder tables, beyond which 4-bit tables are used; the
+ * default suits cores with a large L2, use a smaller value for small caches
+ */
+#ifndef BCH_MOD8_TAB_MAX
+#define BCH_MOD8_TAB_MAX       (64*1024)
+#endif
+
 #ifndef dbg
 #define dbg(_fmt, args...)     do {} while (0)
 #endif
@@ -116,6 +130,9 @@ struct gf_poly_deg1 {
 	unsigned int   c[2];
 };
 
+static int init_bch_decoder(struct bch_control *bch);
+static void free_bch_decoder(struct bch_control *bch);
+
 /*
  * same as encode_bch(), but process input data one byte at a time
  */
@@ -124,9 +141,26 @@ static void encode_bch_unaligned(struct bch_control *bch,
 				 uint32_t *ecc)
 {
 	int i;
-	const uint32_t *p;
+	unsigned int b;
+	const uint32_t *p, *p0, *p1;
 	const int l = BCH_ECC_WORDS(bch)-1;
 
+	if (bch->mod4_tab) {
+		/* split each byte into 2 nibbles, see encode_bch_mod4() */
+		while (len--) {
+			b = ((ecc[0] >> 24)^(*data++)) & 0xff;
+			p0 = bch->mod4_tab + (l+1)*(b & 0xf);
+			p1 = bch->mod4_tab + (l+1)*(16+(b >> 4));
+
+			for (i = 0; i < l; i++)
+				ecc[i] = ((ecc[i] << 8)|(ecc[i+1] >> 24))^
+					p0[i]^p1[i];
+
+			ecc[l] = (ecc[l] << 8)^p0[l]^p1[l];
+		}
+		return;
+	}
+
 	while (len--) {
 		p = bch->mod8_tab + (l+1)*(((ecc[0] >> 24)^(*data++)) & 0xff);
 
@@ -137,6 +171,44 @@ static void encode_bch_unaligned(struct bch_control *bch,
 	}
 }
 
+/*
+ * same as the aligned loop of encode_bch(), using 8 remainder tables of 16
+ * entries instead of 4 tables of 256 entries
+ *
+ * This doubles the number of table lookups per input word, but the tables are
+ * 8 times smaller: for large values of t, they still fit in L1 cache while
+ * the 8-bit tables thrash it.
+ */
+static void encode_bch_mod4(struct bch_control *bch, const uint32_t *pdata,
+			    unsigned int mlen, uint32_t *r)
+{
+	const unsigned int l = BCH_ECC_WORDS(bch)-1;
+	const unsigned int s = 16*(l+1);
+	const uint32_t * const tab = bch->mod4_tab;
+	const uint32_t *p0, *p1, *p2, *p3, *p4, *p5, *p6, *p7;
+	unsigned int i;
+	uint32_t w;
+
+	while (mlen--) {
+		/* input data is read in big-endian format */
+		w = r[0]^cpu_to_be32(*pdata++);
+		p0 = tab + 0*s + (l+1)*((w >>  0) & 0xf);
+		p1 = tab + 1*s + (l+1)*((w >>  4) & 0xf);
+		p2 = tab + 2*s + (l+1)*((w >>  8) & 0xf);
+		p3 = tab + 3*s + (l+1)*((w >> 12) & 0xf);
+		p4 = tab + 4*s + (l+1)*((w >> 16) & 0xf);
+		p5 = tab + 5*s + (l+1)*((w >> 20) & 0xf);
+		p6 = tab + 6*s + (l+1)*((w >> 24) & 0xf);
+		p7 = tab + 7*s + (l+1)*((w >> 28) & 0xf);
+
+		for (i = 0; i < l; i++)
+			r[i] = r[i+1]^p0[i]^p1[i]^p2[i]^p3[i]^
+				p4[i]^p5[i]^p6[i]^p7[i];
+
+		r[l] = p0[l]^p1[l]^p2[l]^p3[l]^p4[l]^p5[l]^p6[l]^p7[l];
+	}
+}
+
 /*
  * convert ecc bytes to aligned, zero-padded 32-bit ecc words
  */
@@ -202,18 +274,22 @@ void encode_bch(struct bch_control *bch, const uint8_t *data,
 	const uint32_t * const tab3 = tab2 + 256*(l+1);
 	const uint32_t *pdata, *p0, *p1, *p2, *p3;
 
+	/*
+	 * the remainder stays on the stack, not in bch->ecc_buf, so that threads
+	 * may encode with the same control structure when @ecc is given
+	 */
 	if (ecc) {
 		/* load ecc parity bytes into internal 32-bit buffer */
-		load_ecc8(bch, bch->ecc_buf, ecc);
+		load_ecc8(bch, r, ecc);
 	} else {
-		memset(bch->ecc_buf, 0, sizeof(r));
+		memset(r, 0, sizeof(r));
 	}
 
 	/* process first unaligned data bytes */
 	m = ((unsigned long)data) & 3;
 	if (m) {
 		mlen = (len < (4-m)) ? len : 4-m;
-		encode_bch_unaligned(bch, data, mlen, bch->ecc_buf);
+		encode_bch_unaligned(bch, data, mlen, r);
 		data += mlen;
 		len  -= mlen;
 	}
@@ -223,7 +299,6 @@ void encode_bch(struct bch_control *bch, const uint8_t *data,
 	mlen  = len/4;
 	data += 4*mlen;
 	len  -= 4*mlen;
-	memcpy(r, bch->ecc_buf, sizeof(r));
 
 	/*
 	 * split each 32-bit word into 4 polynomials of weight 8 as follows:
@@ -236,7 +311,9 @@ void encode_bch(struct bch_control *bch, const uint8_t *data,
 	 * xxxxxxxx  00000000  00000000  00000000  mod g = r3 (precomputed)
 	 * xxxxxxxx  yyyyyyyy  zzzzzzzz  tttttttt  mod g = r0^r1^r2^r3
 	 */
-	while (mlen--) {
+	if (bch->mod4_tab)
+		encode_bch_mod4(bch, pdata, mlen, r);
+	else while (mlen--) {
 		/* input data is read in big-endian format */
 		w = r[0]^cpu_to_be32(*pdata++);
 		p0 = tab0 + (l+1)*((w >>  0) & 0xff);
@@ -249,18 +326,235 @@ void encode_bch(struct bch_control *bch, const uint8_t *data,
 
 		r[l] = p0[l]^p1[l]^p2[l]^p3[l];
 	}
-	memcpy(bch->ecc_buf, r, sizeof(r));
 
 	/* process last unaligned bytes */
 	if (len)
-		encode_bch_unaligned(bch, data, len, bch->ecc_buf);
+		encode_bch_unaligned(bch, data, len, r);
 
 	/* store ecc parity bytes into original parity buffer */
 	if (ecc)
-		store_ecc8(bch, ecc, bch->ecc_buf);
+		store_ecc8(bch, ecc, r);
+	else
+		memcpy(bch->ecc_buf, r, sizeof(r)); /* for decode_bch() */
 }
 EXPORT_SYMBOL_GPL(encode_bch);
 
+/*
+ * a bit-sliced word: bit i of each 64-bit element belongs to a different
+ * sector, so that one XOR processes BCH_SLICE_LANES sectors
+ */
+typedef u64 bch_slice_t __attribute__((vector_size(BCH_SLICE_LANES/8)));
+
+#define BCH_SLICE_WORDS        (BCH_SLICE_LANES/64)
+
+/* data bits shifted into the bit-sliced LFSR per register update */
+#define BCH_SLICE_STEP         4
+
+/*
+ * transpose a 64x64 bit matrix in place: bit 63-j of a[i] is swapped with
+ * bit 63-i of a[j]
+ */
+static void transpose64(u64 *a)
+{
+	unsigned int j, k;
+	u64 m, t;
+
+	for (j = 32, m = 0x00000000ffffffffULL; j; j >>= 1, m ^= m << j) {
+		for (k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+			t = (a[k] ^ (a[k | j] >> j)) & m;
+			a[k] ^= t;
+			a[k | j] ^= t << j;
+		}
+	}
+}
+
+/*
+ * load the next 64 data bits of up to BCH_SLICE_LANES sectors in bit-sliced
+ * form: bit 63-s of element s/64 of @x[i] is data bit i of sector s; the first
+ * @lead bits are zero, so that a length which is not a multiple of 8 bytes
+ * is padded with leading zero bits, which do not change the remainder
+ */
+static void load_slice(bch_slice_t *x, const uint8_t *const *data,
+		       unsigned int nsec, unsigned int off, unsigned int lead)
+{
+	unsigned int i, s, w;
+	u64 a[64], v;
+
+	for (w = 0; w < BCH_SLICE_WORDS; w++) {
+		for (i = 0; i < 64; i++) {
+			s = 64*w+i;
+			v = 0;
+			if (s >= nsec)
+				;
+			else if (lead)
+				memcpy((uint8_t *)&v+lead, data[s]+off, 8-lead);
+			else
+				memcpy(&v, data[s]+off, 8);
+			a[i] = cpu_to_be64(v);
+		}
+		transpose64(a);
+		for (i = 0; i < 64; i++)
+			x[i][w] = a[i];
+	}
+}
+
+/**
+ * init_bch_bitslice - set up the bit-sliced encoder of a BCH control structure
+ * @bch:   BCH control structure
+ *
+ * Returns:
+ *  0 if successful, or -ENOMEM
+ *
+ * The LFSR taps of the generator polynomial are derived once and kept in @bch
+ * until free_bch(). encode_bch_bitslice() sets them up on its first call
+ * otherwise, which is not thread safe: call this before threads share @bch.
+ */
+int init_bch_bitslice(struct bch_control *bch)
+{
+	const unsigned int n = bch->ecc_bits;
+	unsigned int j, k, top;
+	uint8_t *g, *pat;
+
+	if (bch->slice_pat)
+		return 0;
+
+	g = kzalloc(bch->ecc_bytes, GFP_KERNEL);
+	pat = kzalloc(n, GFP_KERNEL);
+	if (!g || !pat) {
+		kfree(g);
+		kfree(pat);
+		return -ENOMEM;
+	}
+
+	/*
+	 * the remainder of X^ecc_bits is g(X) without its leading term: encode
+	 * a single bit to get the LFSR taps G[k], in ecc parity bit order
+	 */
+	encode_bch(bch, (const uint8_t *)"\x01", 1, g);
+#define G(_k) (((_k) < n) && (g[(_k)/8] & (0x80 >> ((_k) % 8))))
+
+	/*
+	 * after BCH_SLICE_STEP shifts with feedback bits f[0..STEP-1], state
+	 * bit k receives f[j]*G[k+STEP-1-j]: pat[k] is that set of j
+	 */
+	for (k = 0; k < n; k++)
+		for (j = 0; j < BCH_SLICE_STEP; j++)
+			if (G(k+BCH_SLICE_STEP-1-j))
+				pat[k] |= 1 << j;
+	for (j = 0, top = 0; j+1 < BCH_SLICE_STEP; j++)
+		if (G(j))
+			top |= 1 << j;
+#undef G
+
+	kfree(g);
+	bch->slice_pat = pat;
+	bch->slice_top = top;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(init_bch_bitslice);
+
+/**
+ * encode_bch_bitslice - calculate BCH ecc parity of many data sectors at once
+ * @bch:   BCH control structure
+ * @nsec:  number of sectors
+ * @data:  array of @nsec pointers to data to encode
+ * @len:   data length in bytes, the same for all sectors
+ * @ecc:   array of @nsec pointers to output ecc parity data
+ *
+ * Returns:
+ *  0 if successful, or -ENOMEM
+ *
+ * The result is the same as calling encode_bch() on each sector with a zeroed
+ * @ecc[i] array, but computations are bit-sliced: BCH_SLICE_LANES sectors are
+ * transposed so that each bit of a machine word belongs to a different sector,
+ * and the generator polynomial LFSR is run on all of them at once with XORs
+ * only. This trades latency for throughput, and only pays off when encoding
+ * hundreds of sectors.
+ *
+ * Once init_bch_bitslice() has run, threads may encode with the same @bch:
+ * the LFSR register stays on the stack, like the remainder of encode_bch().
+ */
+int encode_bch_bitslice(struct bch_control *bch, unsigned int nsec,
+			const uint8_t *const *data, unsigned int len,
+			uint8_t *const *ecc)
+{
+	const unsigned int n = bch->ecc_bits;
+	const unsigned int lead = (8-len % 8) % 8;
+	const unsigned int chunks = DIV_ROUND_UP(len, 8);
+	unsigned int i, j, k, b, c, h, s, w, lanes, top;
+	const uint8_t *pat;
+	bch_slice_t ring[ALIGN(n, 64)], x[64], f[BCH_SLICE_STEP];
+	bch_slice_t comb[1 << BCH_SLICE_STEP];
+	u64 a[64];
+
+	if (init_bch_bitslice(bch))
+		return -ENOMEM;
+	pat = bch->slice_pat;
+	top = bch->slice_top;
+
+	comb[0] = (bch_slice_t){0};
+	for (s = 0; s < nsec; s += BCH_SLICE_LANES, data += BCH_SLICE_LANES,
+		     ecc += BCH_SLICE_LANES) {
+		lanes = (nsec-s < BCH_SLICE_LANES) ? nsec-s : BCH_SLICE_LANES;
+		memset(ring, 0, sizeof(ring));
+		h = 0;
+
+		for (c = 0; c < chunks; c++) {
+			load_slice(x, data, lanes, c ? 8*c-lead : 0,
+				   c ? 0 : lead);
+
+			for (b = 0; b < 64; b += BCH_SLICE_STEP) {
+				/*
+				 * state bit k (coefficient of X^(n-1-k)) is
+				 * ring[(h+k) % n]: shifting the register only
+				 * moves h, and the bits shifted out are reused
+				 * for the new low order bits
+				 */
+				for (j = 0; j < BCH_SLICE_STEP; j++) {
+					f[j] = ring[(h+j) % n]^x[b+j];
+					ring[(h+j) % n] = comb[0];
+					for (i = 0; i < j; i++)
+						if (top & (1 << (j-1-i)))
+							f[j] ^= f[i];
+				}
+				for (i = 1; i < ARRAY_SIZE(comb); i++)
+					comb[i] = comb[i & (i-1)]^
+						f[__builtin_ctz(i)];
+
+				h = (h+BCH_SLICE_STEP) % n;
+				for (k = 0; k < n-h; k++)
+					ring[h+k] ^= comb[pat[k]];
+				for (; k < n; k++)
+					ring[h+k-n] ^= comb[pat[k]];
+			}
+		}
+
+		/*
+		 * transpose the register back into per sector ecc bytes; when
+		 * the generator degree is lower than m*t, the trailing bytes
+		 * are zeroed like those of encode_bch()
+		 */
+		for (k = 0; k < 8*bch->ecc_bytes; k += 64) {
+			for (w = 0; w*64 < lanes; w++) {
+				for (i = 0; i < 64; i++) {
+					j = (h+k+i) % n;
+					a[i] = (k+i < n) ? ring[j][w] : 0;
+				}
+				transpose64(a);
+				for (i = 0; (i < 64) && (64*w+i < lanes); i++) {
+					a[i] = cpu_to_be64(a[i]);
+					j = bch->ecc_bytes-k/8;
+					memcpy(ecc[64*w+i]+k/8, &a[i],
+					       (j < 8) ? j : 8);
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(encode_bch_bitslice);
+
 static inline int modulo(struct bch_control *bch, unsigned int v)
 {
 	const unsigned int n = GF_N(bch);
@@ -433,6 +727,76 @@ static int compute_error_locator_polynomial(struct bch_control *bch,
 	return (elp->deg > t) ? -1 : (int)elp->deg;
 }
 
+/*
+ * inversionless Berlekamp-Massey algorithm, simplified for binary codes, run
+ * on up to BCH_BATCH_LANES syndrome sets side by side
+ *
+ * Each lane computes the same error locator polynomial as
+ * compute_error_locator_polynomial(), up to a nonzero scaling factor. There is
+ * no field division, and the control flow does not depend on the syndromes:
+ * the per-lane choice between the two register updates is made with masks, so
+ * that the lane loops can be vectorized or interleaved by the compiler.
+ *
+ * Syndromes of lane i are read from syn[2t*i]; polynomial coefficients are
+ * stored coefficient-major, i.e. coefficient j of lane i is lambda[j*L+i].
+ */
+static void compute_elp_batch(struct bch_control *bch, unsigned int nlanes,
+			      const unsigned int *syn, unsigned int *lambda)
+{
+	const unsigned int t = GF_T(bch);
+	const unsigned int w = 2*t+1;
+	const unsigned int L = BCH_BATCH_LANES;
+	unsigned int *b = lambda+w*L;
+	unsigned int i, j, r, top, nd, l1, b1, b2;
+	unsigned int gamma[BCH_BATCH_LANES], delta[BCH_BATCH_LANES];
+	unsigned int swap[BCH_BATCH_LANES];
+	int k[BCH_BATCH_LANES];
+
+	memset(lambda, 0, 2*w*L*sizeof(*lambda));
+	for (i = 0; i < L; i++) {
+		lambda[i] = 1;
+		b[i] = 1;
+		gamma[i] = 1;
+		k[i] = 0;
+	}
+
+	for (r = 0; r < t; r++) {
+		/* d(r) = sum(lambda.j*S(2r+1-j)), lambda has degree <= 2r */
+		nd = (2*r < w) ? 2*r+1 : w;
+		memset(delta, 0, sizeof(delta));
+		for (j = 0; j < nd; j++)
+			for (i = 0; i < nlanes; i++)
+				delta[i] ^= gf_mul(bch, lambda[j*L+i],
+						   syn[2*t*i+2*r-j]);
+
+		for (i = 0; i < L; i++)
+			swap[i] = -(unsigned int)((delta[i] != 0) & (k[i] >= 0));
+
+		/*
+		 * lambda(X) <- gamma.lambda(X)+d.X.B(X)
+		 * B(X)      <- X.lambda(X) if swapping, X^2.B(X) otherwise
+		 * updated in place from the highest possible degree downwards
+		 */
+		top = (2*r+2 < w) ? 2*r+2 : w-1;
+		for (j = top+1; j-- > 0;) {
+			for (i = 0; i < nlanes; i++) {
+				l1 = j ? lambda[(j-1)*L+i] : 0;
+				b1 = j ? b[(j-1)*L+i] : 0;
+				b2 = (j > 1) ? b[(j-2)*L+i] : 0;
+				lambda[j*L+i] = gf_mul(bch, gamma[i],
+						       lambda[j*L+i])^
+					gf_mul(bch, delta[i], b1);
+				b[j*L+i] = (l1 & swap[i])|(b2 & ~swap[i]);
+			}
+		}
+
+		for (i = 0; i < L; i++) {
+			gamma[i] = (delta[i] & swap[i])|(gamma[i] & ~swap[i]);
+			k[i] = swap[i] ? -k[i] : k[i]+1;
+		}
+	}
+}
+
 /*
  * solve a m x m linear system in GF(2) with an expected number of solutions,
  * and return the number of found solutions
@@ -791,6 +1155,10 @@ static struct gf_poly *gf_poly_gcd(struct bch_control *bch, struct gf_poly *a,
 		a = tmp;
 	}
 
+	/* a nonzero constant remainder: a and b are coprime */
+	if (b->c[0])
+		a = b;
+
 	dbg("%s\n", gf_poly_str(a));
 
 	return a;
@@ -864,7 +1232,7 @@ static void factor_polynomial(struct bch_control *bch, int k, struct gf_poly *f,
 		/* compute g = gcd(f, tk) (destructive operation) */
 		gf_poly_copy(f2, f);
 		gcd = gf_poly_gcd(bch, f2, tk);
-		if (gcd->deg < f->deg) {
+		if (gcd->deg && (gcd->deg < f->deg)) {
 			/* compute h=f/gcd(f,tk); this will modify f and q */
 			gf_poly_div(bch, f, gcd, q);
 			/* store g and h in-place (clobbering f) */
@@ -914,7 +1282,7 @@ static int find_poly_roots(struct bch_control *bch, unsigned int k,
 	return cnt;
 }
 
-#if defined(USE_CHIEN_SEARCH)
+#if defined(USE_CHIEN_SEARCH) || defined(CONFIG_BCH_STAGE_API)
 /*
  * exhaustive root search (Chien) implementation - not used, included only for
  * reference/comparison tests
@@ -946,9 +1314,54 @@ static int chien_search(struct bch_control *bch, unsigned int len,
 	}
 	return (count == p->deg) ? count : 0;
 }
+#endif
+
+#if defined(USE_CHIEN_SEARCH)
 #define find_poly_roots(_p, _k, _elp, _loc) chien_search(_p, len, _elp, _loc)
 #endif /* USE_CHIEN_SEARCH */
 
+/*
+ * convert @err raw roots in @errloc to bit error locations, as returned by
+ * decode_bch(); a negative @err means that root finding failed
+ */
+static int convert_error_locations(struct bch_control *bch, unsigned int len,
+				   int err, unsigned int *errloc)
+{
+	unsigned int nbits;
+	int i;
+
+	if (err > 0) {
+		/* post-process raw error locations for easier correction */
+		nbits = (len*8)+bch->ecc_bits;
+		for (i = 0; i < err; i++) {
+			if (errloc[i] >= nbits) {
+				err = -1;
+				break;
+			}
+			errloc[i] = nbits-1-errloc[i];
+			errloc[i] = (errloc[i] & ~7)|(7-(errloc[i] & 7));
+		}
+	}
+	return (err >= 0) ? err : -EBADMSG;
+}
+
+/*
+ * find the roots of the error locator polynomial in bch->elp, of degree @err
+ * (or -1 if its computation failed), and convert them to bit error locations
+ */
+static int locate_errors(struct bch_control *bch, unsigned int len, int err,
+			 unsigned int *errloc)
+{
+	int nroots;
+
+	if (err > 0) {
+		nroots = find_poly_roots(bch, 1, bch->elp, errloc);
+		if (err != nroots)
+			err = -1;
+	}
+	return convert_error_locations(bch, len, err, errloc);
+}
+
 /**
  * decode_bch - decode received codeword and find bit error locations
  * @bch:      BCH control structure
@@ -996,14 +1409,17 @@ int decode_bch(struct bch_control *bch, const uint8_t *data, unsigned int len,
 	       const unsigned int *syn, unsigned int *errloc)
 {
 	const unsigned int ecc_words = BCH_ECC_WORDS(bch);
-	unsigned int nbits;
-	int i, err, nroots;
+	int i, err;
 	uint32_t sum;
 
 	/* sanity check: make sure data length can be handled */
 	if (8*len > (bch->n-bch->ecc_bits))
 		return -EINVAL;
 
+	/* build decoder tables if bch was initialized for encoding only */
+	if (!bch->syn && init_bch_decoder(bch))
+		return -ENOMEM;
+
 	/* if caller does not provide syndromes, compute them */
 	if (!syn) {
 		if (!calc_ecc) {
@@ -1032,26 +1448,179 @@ int decode_bch(struct bch_control *bch, const uint8_t *data, unsigned int len,
 	}
 
 	err = compute_error_locator_polynomial(bch, syn);
+
+	return locate_errors(bch, len, err, errloc);
+}
+EXPORT_SYMBOL_GPL(decode_bch);
+
+#if defined(CONFIG_BCH_STAGE_API)
+/*
+ * decode_bch() split into its stages, for benchmarks and tests; the stages
+ * must be called in order, and each one works on the results of the previous
+ * one kept in @bch
+ */
+
+/**
+ * bch_stage_ecc - compute received data ecc and XOR it with received ecc
+ * @bch:      BCH control structure
+ * @data:     received data
+ * @len:      data length in bytes
+ * @recv_ecc: received ecc
+ *
+ * Returns 0 if the codeword has no error, 1 if it has, or a negative error
+ */
+int bch_stage_ecc(struct bch_control *bch, const uint8_t *data,
+		  unsigned int len, const uint8_t *recv_ecc)
+{
+	const unsigned int ecc_words = BCH_ECC_WORDS(bch);
+	unsigned int i;
+	uint32_t sum;
+
+	if (8*len > (bch->n-bch->ecc_bits))
+		return -EINVAL;
+
+	if (!bch->syn && init_bch_decoder(bch))
+		return -ENOMEM;
+
+	encode_bch(bch, data, len, NULL);
+	load_ecc8(bch, bch->ecc_buf2, recv_ecc);
+	for (i = 0, sum = 0; i < ecc_words; i++) {
+		bch->ecc_buf[i] ^= bch->ecc_buf2[i];
+		sum |= bch->ecc_buf[i];
+	}
+	return sum ? 1 : 0;
+}
+EXPORT_SYMBOL_GPL(bch_stage_ecc);
+
+/**
+ * bch_stage_syndromes - compute syndromes after bch_stage_ecc()
+ * @bch:      BCH control structure
+ */
+void bch_stage_syndromes(struct bch_control *bch)
+{
+	compute_syndromes(bch, bch->ecc_buf, bch->syn);
+}
+EXPORT_SYMBOL_GPL(bch_stage_syndromes);
+
+/**
+ * bch_stage_elp - compute the error locator polynomial from the syndromes
+ * @bch:      BCH control structure
+ *
+ * Returns the polynomial degree, or -1 if there are more than t errors
+ */
+int bch_stage_elp(struct bch_control *bch)
+{
+	return compute_error_locator_polynomial(bch, bch->syn);
+}
+EXPORT_SYMBOL_GPL(bch_stage_elp);
+
+/**
+ * bch_stage_roots - find error locations from the error locator polynomial
+ * @bch:      BCH control structure
+ * @len:      data length in bytes
+ * @err:      value returned by bch_stage_elp()
+ * @errloc:   output array of error locations
+ * @chien:    use an exhaustive Chien search instead of the BTZ algorithm
+ *
+ * Returns the same as decode_bch()
+ */
+int bch_stage_roots(struct bch_control *bch, unsigned int len, int err,
+		    unsigned int *errloc, int chien)
+{
+	int nroots;
+
+	if (!chien)
+		return locate_errors(bch, len, err, errloc);
+
 	if (err > 0) {
-		nroots = find_poly_roots(bch, 1, bch->elp, errloc);
+		nroots = chien_search(bch, len, bch->elp, errloc);
 		if (err != nroots)
 			err = -1;
 	}
-	if (err > 0) {
-		/* post-process raw error locations for easier correction */
-		nbits = (len*8)+bch->ecc_bits;
-		for (i = 0; i < err; i++) {
-			if (errloc[i] >= nbits) {
-				err = -1;
-				break;
+	return convert_error_locations(bch, len, err, errloc);
+}
+EXPORT_SYMBOL_GPL(bch_stage_roots);
+#endif /* CONFIG_BCH_STAGE_API */
+
+/**
+ * decode_bch_batch - decode several received codewords of the same length
+ * @bch:      BCH control structure
+ * @nsec:     number of codewords
+ * @data:     array of @nsec pointers to received data
+ * @len:      data length in bytes of each codeword
+ * @recv_ecc: array of @nsec pointers to received ecc
+ * @errloc:   output array of error locations, @t entries per codeword
+ * @nerr:     output array of @nsec results
+ *
+ * Returns:
+ *  0 if successful, or -EINVAL if invalid parameters were provided
+ *
+ * This is equivalent to calling decode_bch(@bch, @data[i], @len, @recv_ecc[i],
+ * NULL, NULL, @errloc+i*@t) for each codeword, and storing the result in
+ * @nerr[i]. Codewords with a nonzero syndrome are grouped by BCH_BATCH_LANES,
+ * and their error locator polynomials are computed side by side with an
+ * inversionless Berlekamp-Massey algorithm. nandbch-bench-decode times it
+ * against decode_bch().
+ */
+int decode_bch_batch(struct bch_control *bch, unsigned int nsec,
+		     const uint8_t *const *data, unsigned int len,
+		     const uint8_t *const *recv_ecc, unsigned int *errloc,
+		     int *nerr)
+{
+	const unsigned int ecc_words = BCH_ECC_WORDS(bch);
+	const unsigned int t = GF_T(bch);
+	unsigned int *syn, *lambda;
+	unsigned int lane[BCH_BATCH_LANES];
+	unsigned int i, j, s, n = 0;
+	uint32_t sum;
+	int d;
+
+	if (8*len > (bch->n-bch->ecc_bits))
+		return -EINVAL;
+
+	if (!bch->syn && init_bch_decoder(bch))
+		return -ENOMEM;
+
+	syn = bch->ibm_buf;
+	lambda = syn+2*t*BCH_BATCH_LANES;
+
+	for (s = 0; s < nsec; s++) {
+		encode_bch(bch, data[s], len, NULL);
+		load_ecc8(bch, bch->ecc_buf2, recv_ecc[s]);
+		for (i = 0, sum = 0; i < ecc_words; i++) {
+			bch->ecc_buf[i] ^= bch->ecc_buf2[i];
+			sum |= bch->ecc_buf[i];
+		}
+		nerr[s] = 0;
+		if (sum) {
+			compute_syndromes(bch, bch->ecc_buf, syn+2*t*n);
+			lane[n++] = s;
+		}
+		if ((n == BCH_BATCH_LANES) || (n && (s == nsec-1))) {
+			compute_elp_batch(bch, n, syn, lambda);
+			for (i = 0; i < n; i++) {
+				/* extract polynomial of lane i */
+				for (j = 2*t, d = -1; j > 0 && d < 0; j--)
+					if (lambda[j*BCH_BATCH_LANES+i])
+						d = j;
+				if (d > (int)t) {
+					nerr[lane[i]] = -EBADMSG;
+					continue;
+				}
+				bch->elp->deg = (d < 0) ? 0 : d;
+				for (j = 0; j <= bch->elp->deg; j++)
+					bch->elp->c[j] =
+						lambda[j*BCH_BATCH_LANES+i];
+				nerr[lane[i]] = locate_errors(bch, len,
+						bch->elp->deg,
+						errloc+t*lane[i]);
 			}
-			errloc[i] = nbits-1-errloc[i];
-			errloc[i] = (errloc[i] & ~7)|(7-(errloc[i] & 7));
+			n = 0;
 		}
 	}
-	return (err >= 0) ? err : -EBADMSG;
+	return 0;
 }
-EXPORT_SYMBOL_GPL(decode_bch);
+EXPORT_SYMBOL_GPL(decode_bch_batch);
 
 /*
  * generate Galois field lookup tables
@@ -1082,27 +1651,30 @@ static int build_gf_tables(struct bch_control *bch, unsigned int poly)
 }
 
 /*
- * compute generator polynomial remainder tables for fast encoding
+ * compute generator polynomial remainder tables for fast encoding, splitting
+ * 32-bit input words into 32/@bits polynomials of weight <= @bits
  */
-static void build_mod8_tables(struct bch_control *bch, const uint32_t *g)
+static void build_mod_tables(struct bch_control *bch, const uint32_t *g,
+			     uint32_t *mod_tab, int bits)
 {
 	int i, j, b, d;
 	uint32_t data, hi, lo, *tab;
 	const int l = BCH_ECC_WORDS(bch);
 	const int plen = DIV_ROUND_UP(bch->ecc_bits+1, 32);
 	const int ecclen = DIV_ROUND_UP(bch->ecc_bits, 32);
+	const int size = 1 << bits;
 
-	memset(bch->mod8_tab, 0, 4*256*l*sizeof(*bch->mod8_tab));
+	memset(mod_tab, 0, 32*size*l*sizeof(*mod_tab)/bits);
 
-	for (i = 0; i < 256; i++) {
-		/* p(X)=i is a small polynomial of weight <= 8 */
-		for (b = 0; b < 4; b++) {
-			/* we want to compute (p(X).X^(8*b+deg(g))) mod g(X) */
-			tab = bch->mod8_tab + (b*256+i)*l;
-			data = i << (8*b);
+	for (i = 0; i < size; i++) {
+		/* p(X)=i is a small polynomial of weight <= bits */
+		for (b = 0; b < 32/bits; b++) {
+			/* we want to compute (p(X).X^(bits*b+deg(g))) mod g(X) */
+			tab = mod_tab + (b*size+i)*l;
+			data = i << (bits*b);
 			while (data) {
 				d = deg(data);
-				/* subtract X^d.g(X) from p(X).X^(8*b+deg(g)) */
+				/* subtract X^d.g(X) from p(X).X^(bits*b+deg(g)) */
 				data ^= g[0] >> (31-d);
 				for (j = 0; j < ecclen; j++) {
 					hi = (d < 31) ? g[j] << (d+1) : 0;
@@ -1233,33 +1805,171 @@ finish:
 	return genpoly;
 }
 
-/**
- * init_bch - initialize a BCH encoder/decoder
- * @m:          Galois field order, should be in the range 5-15
- * @t:          maximum error correction capability, in bits
- * @prim_poly:  user-provided primitive polynomial (or 0 to use default)
- *
- * Returns:
- *  a newly allocated BCH control structure if successful, NULL otherwise
- *
- * This initialization can take some time, as lookup tables are built for fast
- * encoding/decoding; make sure not to call this function from a time critical
- * path. Usually, init_bch() should be called on module/driver init and
- * free_bch() should be called to release memory on exit.
- *
- * You may provide your own primitive polynomial of degree @m in argument
- * @prim_poly, or let init_bch() use its default polynomial.
- *
- * Once init_bch() has successfully returned a pointer to a newly allocated
- * BCH control structure, ecc length in bytes is given by member @ecc_bytes of
- * the structure.
+/*
+ * carve a chunk of @size bytes at offset *@off of an arena, keeping chunks
+ * cache line aligned; with a NULL @base, only advance *@off
  */
-struct bch_control *init_bch(int m, int t, unsigned int prim_poly)
+static void *bch_carve(char *base, size_t *off, size_t size)
 {
-	int err = 0;
-	unsigned int i, words;
-	uint32_t *genpoly;
-	struct bch_control *bch = NULL;
+	void *ptr = base ? base+*off : NULL;
+
+	*off += ALIGN(size, BCH_ARENA_ALIGN);
+	return ptr;
+}
+
+/*
+ * select nibble remainder tables when byte tables would not fit in L1 cache
+ */
+static int bch_use_mod4(struct bch_control *bch)
+{
+	if (bch->flags & BCH_ENCODER_MOD8)
+		return 0;
+	if (bch->flags & BCH_ENCODER_MOD4)
+		return 1;
+	return (BCH_ECC_WORDS(bch)*1024*sizeof(uint32_t) > BCH_MOD8_TAB_MAX);
+}
+
+/*
+ * lay out the control structure and the encoder data at the beginning of an
+ * arena, hot path first; returns the size used
+ */
+static size_t bch_layout_encoder(struct bch_control *bch, char *base)
+{
+	const unsigned int words = BCH_ECC_WORDS(bch);
+	size_t off = ALIGN(sizeof(*bch), BCH_ARENA_ALIGN);
+
+	bch->ecc_buf  = bch_carve(base, &off, words*sizeof(*bch->ecc_buf));
+	bch->ecc_buf2 = bch_carve(base, &off, words*sizeof(*bch->ecc_buf2));
+	if (bch->flags & BCH_PREBUILT)
+		/* tables are provided by init_bch_prebuilt() */
+		return off;
+	if (bch_use_mod4(bch))
+		bch->mod4_tab = bch_carve(base, &off,
+					  words*128*sizeof(*bch->mod4_tab));
+	else
+		bch->mod8_tab = bch_carve(base, &off,
+					  words*1024*sizeof(*bch->mod8_tab));
+	return off;
+}
+
+/*
+ * lay out the decoder tables and buffers at offset @off of an arena; returns
+ * the size used
+ */
+static size_t bch_layout_decoder(struct bch_control *bch, char *base,
+				 size_t off)
+{
+	unsigned int i;
+	const unsigned int m = GF_M(bch);
+	const unsigned int t = GF_T(bch);
+
+	bch->a_pow_tab = bch_carve(base, &off,
+				   (1+GF_N(bch))*sizeof(*bch->a_pow_tab));
+	bch->a_log_tab = bch_carve(base, &off,
+				   (1+GF_N(bch))*sizeof(*bch->a_log_tab));
+	bch->xi_tab    = bch_carve(base, &off, m*sizeof(*bch->xi_tab));
+	bch->syn       = bch_carve(base, &off, 2*t*sizeof(*bch->syn));
+	bch->cache     = bch_carve(base, &off, 2*t*sizeof(*bch->cache));
+	bch->elp       = bch_carve(base, &off,
+				   (t+1)*sizeof(struct gf_poly_deg1));
+
+	for (i = 0; i < ARRAY_SIZE(bch->poly_2t); i++)
+		bch->poly_2t[i] = bch_carve(base, &off, GF_POLY_SZ(2*t));
+
+	bch->ibm_buf   = bch_carve(base, &off, (2*t+2*(2*t+1))*
+				   BCH_BATCH_LANES*sizeof(*bch->ibm_buf));
+	return off;
+}
+
+/*
+ * allocate a zeroed, cache line aligned arena of *@size bytes, optionally
+ * backed by huge pages (in which case *@size is rounded up)
+ */
+static void *bch_arena_alloc(size_t *size, unsigned int flags)
+{
+	void *ptr;
+
+	if (flags & BCH_HUGE_PAGES) {
+		*size = ALIGN(*size, BCH_HUGE_PAGE_SIZE);
+#ifdef MAP_HUGETLB
+		ptr = mmap(NULL, *size, PROT_READ|PROT_WRITE,
+			   MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if (ptr != MAP_FAILED)
+			return ptr;
+#endif
+		/* no reserved huge pages, fall back to transparent ones */
+		ptr = mmap(NULL, *size, PROT_READ|PROT_WRITE,
+			   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		madvise(ptr, *size, MADV_HUGEPAGE);
+#endif
+		return ptr;
+	}
+
+	if (posix_memalign(&ptr, BCH_ARENA_ALIGN, *size))
+		return NULL;
+
+	memset(ptr, 0, *size);
+	return ptr;
+}
+
+static void bch_arena_free(void *ptr, size_t size, unsigned int flags)
+{
+	if (ptr == NULL)
+		return;
+
+	if (flags & BCH_HUGE_PAGES)
+		munmap(ptr, size);
+	else
+		free(ptr);
+}
+
+/*
+ * allocate and build the tables and buffers only needed by decode_bch(), for
+ * a bch initialized with BCH_ENCODE_ONLY
+ */
+static int init_bch_decoder(struct bch_control *bch)
+{
+	size_t size = bch_layout_decoder(bch, NULL, 0);
+	char *arena;
+
+	arena = bch_arena_alloc(&size, bch->flags);
+	if (arena == NULL)
+		return -ENOMEM;
+
+	bch->dec_arena = arena;
+	bch->dec_arena_size = size;
+	bch_layout_decoder(bch, arena, 0);
+
+	if (build_gf_tables(bch, bch->prim_poly) || build_deg2_base(bch)) {
+		free_bch_decoder(bch);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * release decoder tables and buffers built by init_bch_decoder()
+ */
+static void free_bch_decoder(struct bch_control *bch)
+{
+	bch_arena_free(bch->dec_arena, bch->dec_arena_size, bch->flags);
+	bch->dec_arena = NULL;
+	bch_layout_decoder(bch, NULL, 0);
+}
+
+/*
+ * check parameters, then allocate and lay out the arena of a new BCH control
+ * structure; tables are left for the caller to build
+ */
+static struct bch_control *bch_create(int m, int t, unsigned int prim_poly,
+				      unsigned int flags)
+{
+	size_t size;
+	char *arena;
+	struct bch_control tmp, *bch;
 
 	const int min_m = 5;
 	const int max_m = 15;
@@ -1275,7 +1985,7 @@ struct bch_control *init_bch(int m, int t, unsigned int prim_poly)
 		printk(KERN_ERR "bch encoder/decoder was configured to support "
 		       "parameters m=%d, t=%d only!\n",
 		       CONFIG_BCH_CONST_M, CONFIG_BCH_CONST_T);
-		goto fail;
+		return NULL;
 	}
 #endif
 	if ((m < min_m) || (m > max_m))
@@ -1284,43 +1994,100 @@ struct bch_control *init_bch(int m, int t, unsigned int prim_poly)
 		 * supporting m > 15 would require changing table base type
 		 * (uint16_t) and a small patch in matrix transposition
 		 */
-		goto fail;
+		return NULL;
 
 	/* sanity checks */
 	if ((t < 1) || (m*t >= ((1 << m)-1)))
 		/* invalid t value */
-		goto fail;
+		return NULL;
 
 	/* select a primitive polynomial for generating GF(2^m) */
 	if (prim_poly == 0)
 		prim_poly = prim_poly_tab[m-min_m];
 
-	bch = kzalloc(sizeof(*bch), GFP_KERNEL);
-	if (bch == NULL)
-		goto fail;
-
+	/* size the arena holding the control structure, tables and buffers */
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.m = m;
+	tmp.t = t;
+	tmp.n = (1 << m)-1;
+	tmp.flags = flags;
+	size = bch_layout_encoder(&tmp, NULL);
+	if (!(flags & BCH_ENCODE_ONLY))
+		size = bch_layout_decoder(&tmp, NULL, size);
+
+	arena = bch_arena_alloc(&size, flags);
+	if (arena == NULL)
+		return NULL;
+
+	bch = (struct bch_control *)arena;
 	bch->m = m;
 	bch->t = t;
 	bch->n = (1 << m)-1;
-	words  = DIV_ROUND_UP(m*t, 32);
+	bch->prim_poly = prim_poly;
+	bch->flags = flags;
+	bch->arena = arena;
+	bch->arena_size = size;
 	bch->ecc_bytes = DIV_ROUND_UP(m*t, 8);
-	bch->a_pow_tab = bch_alloc((1+bch->n)*sizeof(*bch->a_pow_tab), &err);
-	bch->a_log_tab = bch_alloc((1+bch->n)*sizeof(*bch->a_log_tab), &err);
-	bch->mod8_tab  = bch_alloc(words*1024*sizeof(*bch->mod8_tab), &err);
-	bch->ecc_buf   = bch_alloc(words*sizeof(*bch->ecc_buf), &err);
-	bch->ecc_buf2  = bch_alloc(words*sizeof(*bch->ecc_buf2), &err);
-	bch->xi_tab    = bch_alloc(m*sizeof(*bch->xi_tab), &err);
-	bch->syn       = bch_alloc(2*t*sizeof(*bch->syn), &err);
-	bch->cache     = bch_alloc(2*t*sizeof(*bch->cache), &err);
-	bch->elp       = bch_alloc((t+1)*sizeof(struct gf_poly_deg1), &err);
 
-	for (i = 0; i < ARRAY_SIZE(bch->poly_2t); i++)
-		bch->poly_2t[i] = bch_alloc(GF_POLY_SZ(2*t), &err);
+	size = bch_layout_encoder(bch, arena);
+	if (!(flags & BCH_ENCODE_ONLY))
+		bch_layout_decoder(bch, arena, size);
 
-	if (err)
-		goto fail;
+	return bch;
+}
+
+/**
+ * init_bch - initialize a BCH encoder/decoder
+ * @m:          Galois field order, should be in the range 5-15
+ * @t:          maximum error correction capability, in bits
+ * @prim_poly:  user-provided primitive polynomial (or 0 to use default)
+ * @flags:      BCH_* init flags, or 0
+ *
+ * Returns:
+ *  a newly allocated BCH control structure if successful, NULL otherwise
+ *
+ * This initialization can take some time, as lookup tables are built for fast
+ * encoding/decoding; make sure not to call this function from a time critical
+ * path. Usually, init_bch() should be called on module/driver init and
+ * free_bch() should be called to release memory on exit.
+ *
+ * You may provide your own primitive polynomial of degree @m in argument
+ * @prim_poly, or let init_bch() use its default polynomial.
+ *
+ * With flag BCH_ENCODE_ONLY, only the generator polynomial remainder tables
+ * used by encode_bch() are kept; Galois field tables and decoder buffers are
+ * built on the first call to decode_bch() or decode_bch_batch() instead.
+ *
+ * The control structure, tables and buffers are carved from a single cache
+ * line aligned arena, encoder data first. With flag BCH_HUGE_PAGES, the arena
+ * is backed by huge pages when available.
+ *
+ * Once init_bch() has successfully returned a pointer to a newly allocated
+ * BCH control structure, ecc length in bytes is given by member @ecc_bytes of
+ * the structure.
+ */
+struct bch_control *init_bch(int m, int t, unsigned int prim_poly,
+			     unsigned int flags)
+{
+	int err = 0;
+	uint32_t *genpoly;
+	struct bch_control *bch;
 
-	err = build_gf_tables(bch, prim_poly);
+	bch = bch_create(m, t, prim_poly, flags & ~BCH_PREBUILT);
+	if (bch == NULL)
+		return NULL;
+
+	if (flags & BCH_ENCODE_ONLY) {
+		/* Galois field tables are only needed to build the encoder */
+		bch->a_pow_tab = bch_alloc((1+bch->n)*sizeof(*bch->a_pow_tab),
+					   &err);
+		bch->a_log_tab = bch_alloc((1+bch->n)*sizeof(*bch->a_log_tab),
+					   &err);
+		if (err)
+			goto fail;
+	}
+
+	err = build_gf_tables(bch, bch->prim_poly);
 	if (err)
 		goto fail;
 
@@ -1329,44 +2096,130 @@ struct bch_control *init_bch(int m, int t, unsigned int prim_poly)
 	if (genpoly == NULL)
 		goto fail;
 
-	build_mod8_tables(bch, genpoly);
+	if (bch->mod4_tab)
+		build_mod_tables(bch, genpoly, bch->mod4_tab, 4);
+	else
+		build_mod_tables(bch, genpoly, bch->mod8_tab, 8);
 	kfree(genpoly);
 
-	err = build_deg2_base(bch);
-	if (err)
-		goto fail;
+	if (flags & BCH_ENCODE_ONLY) {
+		kfree(bch->a_pow_tab);
+		kfree(bch->a_log_tab);
+		bch->a_pow_tab = NULL;
+		bch->a_log_tab = NULL;
+	} else {
+		err = build_deg2_base(bch);
+		if (err)
+			goto fail;
+	}
 
 	return bch;
 
 fail:
+	if (flags & BCH_ENCODE_ONLY) {
+		kfree(bch->a_pow_tab);
+		kfree(bch->a_log_tab);
+	}
 	free_bch(bch);
 	return NULL;
 }
 EXPORT_SYMBOL_GPL(init_bch);
 
+/**
+ * init_bch_prebuilt - initialize a BCH encoder/decoder from existing tables
+ * @m:          Galois field order, should be in the range 5-15
+ * @t:          maximum error correction capability, in bits
+ * @prim_poly:  user-provided primitive polynomial (or 0 to use default)
+ * @flags:      BCH_* init flags, including BCH_ENCODER_MOD8 or BCH_ENCODER_MOD4
+ * @ecc_bits:   generator polynomial degree, as found in member @ecc_bits
+ * @tab:        remainder tables, as built by init_bch() with the same
+ *              parameters and encoder flag
+ *
+ * Returns:
+ *  a newly allocated BCH control structure if successful, NULL otherwise
+ *
+ * This skips the generator polynomial computation and the remainder tables
+ * construction, e.g. when tables are read or mapped from a file. @tab is not
+ * copied, and must remain valid until free_bch() is called; it is never
+ * written to.
+ */
+struct bch_control *init_bch_prebuilt(int m, int t, unsigned int prim_poly,
+				      unsigned int flags, unsigned int ecc_bits,
+				      const uint32_t *tab)
+{
+	struct bch_control *bch;
+
+	if (!(flags & (BCH_ENCODER_MOD8|BCH_ENCODER_MOD4)) || (tab == NULL))
+		return NULL;
+
+	bch = bch_create(m, t, prim_poly, flags|BCH_PREBUILT);
+	if (bch == NULL)
+		return NULL;
+
+	bch->ecc_bits = ecc_bits;
+	if (flags & BCH_ENCODER_MOD4)
+		bch->mod4_tab = (uint32_t *)tab;
+	else
+		bch->mod8_tab = (uint32_t *)tab;
+
+	if (!(flags & BCH_ENCODE_ONLY) &&
+	    (build_gf_tables(bch, bch->prim_poly) || build_deg2_base(bch))) {
+		free_bch(bch);
+		return NULL;
+	}
+	return bch;
+}
+EXPORT_SYMBOL_GPL(init_bch_prebuilt);
+
+/**
+ * bch_encoder_tab_size - size of the remainder tables used by encode_bch()
+ * @bch:        BCH control structure
+ *
+ * Returns:
+ *  the size in bytes of the @mod8_tab or @mod4_tab member of @bch
+ */
+size_t bch_encoder_tab_size(const struct bch_control *bch)
+{
+	const size_t words = BCH_ECC_WORDS(bch);
+
+	return (bch->mod4_tab ? words*128 : words*1024)*sizeof(uint32_t);
+}
+EXPORT_SYMBOL_GPL(bch_encoder_tab_size);
+
+/**
+ * bch_encoder_type - remainder tables selected by init_bch()
+ * @m:          Galois field order
+ * @t:          maximum error correction capability, in bits
+ * @flags:      BCH_* init flags
+ *
+ * Returns:
+ *  BCH_ENCODER_MOD8 or BCH_ENCODER_MOD4
+ */
+unsigned int bch_encoder_type(int m, int t, unsigned int flags)
+{
+	struct bch_control tmp;
+
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.m = m;
+	tmp.t = t;
+	tmp.flags = flags;
+
+	return bch_use_mod4(&tmp) ? BCH_ENCODER_MOD4 : BCH_ENCODER_MOD8;
+}
+EXPORT_SYMBOL_GPL(bch_encoder_type);
+
 /**
  *  free_bch - free the BCH control structure
  *  @bch:    BCH control structure to release
  */
 void free_bch(struct bch_control *bch)
 {
-	unsigned int i;
-
 	if (bch) {
-		kfree(bch->a_pow_tab);
-		kfree(bch->a_log_tab);
-		kfree(bch->mod8_tab);
-		kfree(bch->ecc_buf);
-		kfree(bch->ecc_buf2);
-		kfree(bch->xi_tab);
-		kfree(bch->syn);
-		kfree(bch->cache);
-		kfree(bch->elp);
-
-		for (i = 0; i < ARRAY_SIZE(bch->poly_2t); i++)
-			kfree(bch->poly_2t[i]);
-
-		kfree(bch);
+		kfree(bch->slice_pat);
+		bch_arena_free(bch->dec_arena, bch->dec_arena_size,
+			       bch->flags);
+		/* the control structure itself lives in its arena */
+		bch_arena_free(bch->arena, bch->arena_size, bch->flags);
 	}
 }
 EXPORT_SYMBOL_GPL(free_bch);
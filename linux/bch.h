@@ -35,9 +35,13 @@
  * @t:          error correction capability in bits
  * @ecc_bits:   ecc exact size in bits, i.e. generator polynomial degree (<=m*t)
  * @ecc_bytes:  ecc max size (m*t bits) in bytes
+ * @prim_poly:  primitive polynomial used for generating GF(2^m)
+ * @flags:      init_bch() flags
  * @a_pow_tab:  Galois field GF(2^m) exponentiation lookup table
  * @a_log_tab:  Galois field GF(2^m) log lookup table
- * @mod8_tab:   remainder generator polynomial lookup tables
+ * @mod8_tab:   remainder generator polynomial lookup tables (8-bit)
+ * @mod4_tab:   remainder generator polynomial lookup tables (4-bit), used
+ *              instead of @mod8_tab for large values of t
  * @ecc_buf:    ecc parity words buffer
  * @ecc_buf2:   ecc parity words buffer
  * @xi_tab:     GF(2^m) base for solving degree 2 polynomial roots
@@ -45,6 +49,12 @@
  * @cache:      log-based polynomial representation buffer
  * @elp:        error locator polynomial
  * @poly_2t:    temporary polynomials of degree 2t
+ * @ibm_buf:    batched syndromes and inversionless Berlekamp-Massey lanes
+ * @slice_pat:  LFSR taps of the bit-sliced encoder, see init_bch_bitslice()
+ * @slice_top:  feedback taps between the bits of one bit-sliced step
+ * @arena:      single allocation holding this structure, encoder data and,
+ *              unless BCH_ENCODE_ONLY was given, decoder data
+ * @dec_arena:  decoder data allocated on first decode with BCH_ENCODE_ONLY
  */
 struct bch_control {
 	unsigned int    m;
@@ -52,10 +62,13 @@ struct bch_control {
 	unsigned int    t;
 	unsigned int    ecc_bits;
 	unsigned int    ecc_bytes;
+	unsigned int    prim_poly;
+	unsigned int    flags;
 /* private: */
 	uint16_t       *a_pow_tab;
 	uint16_t       *a_log_tab;
 	uint32_t       *mod8_tab;
+	uint32_t       *mod4_tab;
 	uint32_t       *ecc_buf;
 	uint32_t       *ecc_buf2;
 	unsigned int   *xi_tab;
@@ -63,17 +76,71 @@ struct bch_control {
 	int            *cache;
 	struct gf_poly *elp;
 	struct gf_poly *poly_2t[4];
+	unsigned int   *ibm_buf;
+	uint8_t        *slice_pat;
+	unsigned int    slice_top;
+	void           *arena;
+	size_t          arena_size;
+	void           *dec_arena;
+	size_t          dec_arena_size;
 };
 
-struct bch_control *init_bch(int m, int t, unsigned int prim_poly);
+/* number of sectors processed side by side by decode_bch_batch() */
+#define BCH_BATCH_LANES 8
+
+/* number of sectors encoded side by side by encode_bch_bitslice() */
+#ifndef BCH_SLICE_LANES
+#define BCH_SLICE_LANES 256
+#endif
+
+/* init_bch() flags */
+#define BCH_ENCODE_ONLY  0x01 /* build decoder tables on first decode */
+#define BCH_HUGE_PAGES   0x02 /* back tables and buffers with huge pages */
+#define BCH_ENCODER_MOD8 0x04 /* force 8-bit remainder tables */
+#define BCH_ENCODER_MOD4 0x08 /* force 4-bit remainder tables */
+#define BCH_PREBUILT     0x80 /* tables borrowed by init_bch_prebuilt() */
+
+struct bch_control *init_bch(int m, int t, unsigned int prim_poly,
+			     unsigned int flags);
+
+struct bch_control *init_bch_prebuilt(int m, int t, unsigned int prim_poly,
+				      unsigned int flags, unsigned int ecc_bits,
+				      const uint32_t *tab);
+
+size_t bch_encoder_tab_size(const struct bch_control *bch);
+
+unsigned int bch_encoder_type(int m, int t, unsigned int flags);
 
 void free_bch(struct bch_control *bch);
 
 void encode_bch(struct bch_control *bch, const uint8_t *data,
 		unsigned int len, uint8_t *ecc);
 
+int init_bch_bitslice(struct bch_control *bch);
+
+int encode_bch_bitslice(struct bch_control *bch, unsigned int nsec,
+			const uint8_t *const *data, unsigned int len,
+			uint8_t *const *ecc);
+
 int decode_bch(struct bch_control *bch, const uint8_t *data, unsigned int len,
 	       const uint8_t *recv_ecc, const uint8_t *calc_ecc,
 	       const unsigned int *syn, unsigned int *errloc);
 
+int decode_bch_batch(struct bch_control *bch, unsigned int nsec,
+		     const uint8_t *const *data, unsigned int len,
+		     const uint8_t *const *recv_ecc, unsigned int *errloc,
+		     int *nerr);
+
+#if defined(CONFIG_BCH_STAGE_API)
+int bch_stage_ecc(struct bch_control *bch, const uint8_t *data,
+		  unsigned int len, const uint8_t *recv_ecc);
+
+void bch_stage_syndromes(struct bch_control *bch);
+
+int bch_stage_elp(struct bch_control *bch);
+
+int bch_stage_roots(struct bch_control *bch, unsigned int len, int err,
+		    unsigned int *errloc, int chien);
+#endif
+
 #endif /* _BCH_H */
@@ -34,9 +34,12 @@
 
 #define DIV_ROUND_UP(n,d) (((n) + (d) - 1) / (d))
 
+#define ALIGN(x,a)        (((x) + (a) - 1) & ~((__typeof__(x))(a) - 1))
+
 typedef unsigned char  uint8_t;
 typedef unsigned short uint16_t;
 typedef unsigned int   uint32_t;
+typedef unsigned long long u64;
 
 typedef enum {
 	GFP_KERNEL,
@@ -9,45 +9,16 @@
 
 #include "os_swap.h"
 #include "nand_bch.h"
-
-static struct nand_chip chips[] = {
-	{
-		.name = "MT29F4G08ABADAWP, MT29F2G08ABAEAWP",
-		.page_size   = 2048,
-		.spare_size  = 64,
-		.ecc_sector  = 512,
-		.ecc_bytes   = 7,
-		.ecc_offset  = -1,
-		.free_offset = 2,
-		.boot_header = 0xc0902405
-	},
-	{
-		.name = "MX30LF1G28AD-TI, TC58NVG1S3HBAI4",
-		.page_size   = 2048,
-		.spare_size  = 128,
-		.ecc_sector  = 512,
-		.ecc_bytes   = 13,
-		.ecc_offset  = -1,
-		.free_offset = 2,
-		.boot_header = 0xc1304805
-	},
-	{
-		.name = "MT29F4G08ABAEAWP",
-		.page_size   = 4096,
-		.spare_size  = 224,
-		.ecc_sector  = 512,
-		.ecc_bytes   = 13,
-		.ecc_offset  = -1,
-		.free_offset = 2,
-		.boot_header = 0xc1e04e07
-	}
-};
-#define CHIP_COUNT (sizeof(chips)/sizeof(struct nand_chip))
+#include "nand_chips.h"
 
 static void usage()
 {
 	fprintf(stderr,
 		"Usage: nandbch [OPTION] <INFILE> <OUTFILE>\n"
+		"       nandbch [OPTION] --patch=OFFSET:HEX... <IMAGE>\n"
+		"       nandbch [OPTION] --batch=LIST\n"
+		"       nandbch [OPTION] --verify-sample=FRACTION|COUNT <DUMP>\n"
+		"       nandbch [OPTION] --extract <DUMP> <OUTFILE>\n"
 		"Generate OOB data which include BCH code for NAND Flash production image\n"
 		"\n"
 		"Options:\n"
@@ -60,16 +31,94 @@ static void usage()
 		"      --ecc-offset  ECC code offset address in spare area\n"
 		"      --free-offset Free region offset address in spare area\n"
 		"      --boot-header NAND Flash boot header, check SAMA5Dx datasheet\n"
+		"      --layout=oob|interleaved\n"
+		"                    Raw page layout: data area then OOB area (default), or data\n"
+		"                    and ECC code of each sector in turn, then other OOB bytes\n"
+		"      --ecc-regions=OFFSET:LENGTH[,OFFSET:LENGTH...]\n"
+		"                    Spread ECC codes over these OOB regions instead of ecc-offset\n"
+		"      --ecc=bch|hamming|hamming-smc\n"
+		"                    ECC scheme: BCH (default), or 1-bit Hamming with 3 bytes per\n"
+		"                    256 or 512 byte sector, in Linux or SmartMedia byte order\n"
+		"      --partition=PAGES:ECC:SECTOR:BYTES[:OFFSET]\n"
+		"                    Use another ECC scheme for the next PAGES pages, from page 0\n"
+		"                    on, e.g. 64:hamming:512:3 for a boot partition; OFFSET is the\n"
+		"                    ECC code offset in spare area, right-aligned by default\n"
 		"  -p, --pmecc       Generate SAMA5Dx PMECC format BCH code\n"
 		"  -n, --no-mask     Don't mask ECC code to all 0xFF for empty page\n"
 		"  -b, --boot        Add boot header for AT91 Bootstrap\n"
 		"  -y, --yaffs       Input file is made by mkyaffs2image tool (contains OOB data)\n"
+		"      --huge-pages  Back BCH tables with huge pages when available\n"
+		"      --bitslice    Encode many sectors at once with a bit-sliced encoder\n"
+		"      --table-cache=DIR\n"
+		"                    Load precomputed BCH tables from DIR, or store them there\n"
+		"      --previous=OLDIN,OLDOUT\n"
+		"                    Copy pages whose input did not change since a previous run\n"
+		"                    with the same options from its output instead of encoding them\n"
+		"      --dedup[=N]   Cache the ECC codes of up to N (default 16384) sectors by\n"
+		"                    content, for images with many identical sectors\n"
+		"      --randomizer=TAPS:SEED[:PERIOD]\n"
+		"                    Scramble page data with a Galois LFSR of these taps before\n"
+		"                    computing ECC, page p seeded with SEED + p %% PERIOD\n"
+		"      --keep-erased Leave erased pages unscrambled\n"
+		"      --bad-blocks=N[,N...]\n"
+		"                    Bad blocks of the target chip, whose pages get a bad block\n"
+		"                    marker: OOB bytes before free-offset set to 0\n"
+		"      --bad-block-file=FILE\n"
+		"                    Read bad block numbers from FILE, one per line\n"
+		"      --block-pages=N\n"
+		"                    Erase block size in pages, default 64\n"
+		"      --skip-bad    Shift data past bad blocks, which are written erased and marked\n"
+		"      --digest[=FILE]\n"
+		"                    Print the CRC32C and SHA-256 of each output, taken as it is\n"
+		"                    written, write the SHA-256 to manifest FILE for sha256sum -c\n"
+		"                    and the sizes and CRC32C to FILE.crc32c\n"
+		"      --self-check  Check every ECC code written again from the raw page, with\n"
+		"                    another encoder on another thread, and fail on a mismatch\n"
+		"      --stats[=json]\n"
+		"                    Print time and bytes spent in each stage, and the sector\n"
+		"                    cache hits and misses with --dedup, as text or JSON\n"
+		"      --patch=OFFSET:HEX\n"
+		"                    Write HEX bytes at NAND data address OFFSET of an image made\n"
+		"                    by nandbch, and update the ECC codes in place\n"
+		"      --patch-file=FILE\n"
+		"                    Read OFFSET:HEX patches from FILE, one per line\n"
+		"      --batch=LIST  Generate the images listed in LIST, one INFILE OUTFILE\n"
+		"                    [pmecc,no-mask,boot,yaffs] per line, with the same chip\n"
+		"      --threads=N   Worker threads of a batch, one per CPU by default\n"
+		"      --verify-sample=FRACTION|COUNT\n"
+		"                    Decode a random sample of the pages of DUMP, read back from\n"
+		"                    a chip, e.g. 0.01, 1%% or 5000 pages, and estimate its bitflip\n"
+		"                    rate; exits with 1 if a sampled sector is uncorrectable\n"
+		"      --sample-seed=N\n"
+		"                    Seed of the page sampler, default 1\n"
+		"      --extract     Correct every sector of DUMP, read back from a chip, and\n"
+		"                    write its data, as mkyaffs2image records with -y, without\n"
+		"                    the boot header with -b, on --threads workers; exits with 1\n"
+		"                    if a sector is uncorrectable\n"
 		"  -l, --list        List predefined NAND Flash models\n");
 }
 
+static const char *const ecc_modes[] = {
+	[NAND_ECC_BCH]         = "bch",
+	[NAND_ECC_HAMMING]     = "hamming",
+	[NAND_ECC_HAMMING_SMC] = "hamming-smc",
+};
+
+static int parse_ecc_mode(const char *name, int len)
+{
+	int i;
+
+	for (i=0; i<sizeof(ecc_modes)/sizeof(ecc_modes[0]); i++)
+		if ((strlen(ecc_modes[i]) == len) && !strncmp(name, ecc_modes[i], len))
+			return i;
+	return -1;
+}
+
 static void dump_chips(struct nand_chip (*chips)[], int count, int index)
 {
 	int i;
+	const struct nand_oob_region *region;
+	const struct nand_partition *part;
 
 	for (i=0; i<count; i++) {
 		if (index)
@@ -90,17 +139,388 @@ static void dump_chips(struct nand_chip (*chips)[], int count, int index)
 			(*chips)[i].ecc_offset,
 			(*chips)[i].free_offset,
 			(*chips)[i].boot_header);
+		fprintf(stderr, "  layout     : %s\n",
+			((*chips)[i].layout == NAND_LAYOUT_INTERLEAVED) ? "interleaved" : "oob");
+		if ((*chips)[i].ecc_regions) {
+			fprintf(stderr, "  ecc_regions:");
+			for (region=(*chips)[i].ecc_regions; region->length; region++)
+				fprintf(stderr, " %d:%d", region->offset, region->length);
+			fprintf(stderr, "\n");
+		}
+		fprintf(stderr, "  ecc        : %s\n", ecc_modes[(*chips)[i].ecc_mode]);
+		for (part=(*chips)[i].partitions; part && part->pages; part++)
+			fprintf(stderr, "  partition  : %lu pages, %s, %d+%d bytes at %d\n", part->pages,
+				ecc_modes[part->ecc_mode], part->ecc_sector, part->ecc_bytes, part->ecc_offset);
 	}
 }
 
+/*
+ * parse OOB regions given as OFFSET:LENGTH[,OFFSET:LENGTH...], the returned
+ * list ends with a zero length region
+ */
+static struct nand_oob_region *parse_regions(const char *spec)
+{
+	int count = 0;
+	char *end;
+	struct nand_oob_region *regions = NULL, *r;
+
+	do {
+		r = realloc(regions, (count + 2)*sizeof(*regions));
+		if (r == NULL)
+			goto FAIL;
+		regions = r;
+		r += count;
+
+		r->offset = strtol(spec, &end, 0);
+		if ((end == spec) || (*end != ':'))
+			goto FAIL;
+		spec = end + 1;
+		r->length = strtol(spec, &end, 0);
+		if ((end == spec) || (r->length <= 0) || (*end && (*end != ',')))
+			goto FAIL;
+		spec = end + 1;
+		count++;
+	} while (*end);
+
+	regions[count].offset = 0;
+	regions[count].length = 0;
+	return regions;
+FAIL:
+	free(regions);
+	return NULL;
+}
+
+/*
+ * parse a partition given as PAGES:ECC:SECTOR:BYTES[:OFFSET] and append it to
+ * the partition list, which ends with a zero size partition
+ */
+static int add_partition(struct nand_partition **parts, int *count, const char *spec)
+{
+	char *end;
+	struct nand_partition *p;
+
+	p = realloc(*parts, (*count + 2)*sizeof(**parts));
+	if (p == NULL)
+		return -1;
+	*parts = p;
+	p += *count;
+	memset(p, 0, 2*sizeof(*p));
+
+	p->pages = strtoul(spec, &end, 0);
+	if ((end == spec) || !p->pages || (*end != ':'))
+		return -1;
+	spec = end + 1;
+
+	p->ecc_mode = parse_ecc_mode(spec, strcspn(spec, ":"));
+	if (p->ecc_mode < 0)
+		return -1;
+	spec += strcspn(spec, ":");
+	if (*spec++ != ':')
+		return -1;
+
+	p->ecc_sector = strtol(spec, &end, 0);
+	if ((end == spec) || (p->ecc_sector <= 0) || (*end != ':'))
+		return -1;
+	spec = end + 1;
+	p->ecc_bytes = strtol(spec, &end, 0);
+	if ((end == spec) || (p->ecc_bytes <= 0))
+		return -1;
+
+	p->ecc_offset = -1;
+	if (*end == ':') {
+		spec = end + 1;
+		p->ecc_offset = strtol(spec, &end, 0);
+		if (end == spec)
+			return -1;
+	}
+	if (*end)
+		return -1;
+
+	(*count)++;
+	return 0;
+}
+
+/*
+ * parse bad block numbers separated by commas or white space, and append
+ * them to the bad block list
+ */
+static int add_bad_blocks(struct nand_bad_block_params *bad, const char *spec)
+{
+	char *end;
+	unsigned long *blocks;
+
+	while (*(spec += strspn(spec, ", \t\r\n"))) {
+		blocks = realloc((unsigned long *)bad->blocks, (bad->count + 1)*sizeof(*blocks));
+		if (blocks == NULL)
+			return -1;
+		bad->blocks = blocks;
+
+		blocks[bad->count] = strtoul(spec, &end, 0);
+		if ((end == spec) || (*end && !strchr(", \t\r\n", *end)))
+			return -1;
+		bad->count++;
+		spec = end;
+	}
+
+	return 0;
+}
+
+static int add_bad_block_file(struct nand_bad_block_params *bad, const char *file)
+{
+	int ret = 0;
+	char *line = NULL;
+	size_t size = 0;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (fp == NULL)
+		return -1;
+
+	while (!ret && (getline(&line, &size, fp) > 0)) {
+		if (line[0] == '#')
+			continue;
+		ret = add_bad_blocks(bad, line);
+	}
+
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+static const char *const job_flags[] = { "pmecc", "no-mask", "boot", "yaffs" };
+static const unsigned int job_flag_bits[] = { FLAG_PMECC, FLAG_NO_MASK, FLAG_HEADER, FLAG_YAFFS };
+
+/*
+ * parse a batch list, one "INFILE OUTFILE [FLAG,...]" image per line
+ */
+static int add_batch_file(struct nandbch_job **jobs, int *count, const char *file)
+{
+	int i, n, ret = 0;
+	char *line = NULL, *in, *out, *flags, *save;
+	size_t size = 0;
+	struct nandbch_job *job;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (fp == NULL)
+		return -1;
+
+	while (!ret && (getline(&line, &size, fp) > 0)) {
+		if ((line[0] == '#') || (line[strspn(line, " \t\r\n")] == '\0'))
+			continue;
+
+		in = strtok_r(line, " \t\r\n", &save);
+		out = strtok_r(NULL, " \t\r\n", &save);
+		flags = strtok_r(NULL, " \t\r\n", &save);
+		job = realloc(*jobs, (*count + 1)*sizeof(**jobs));
+		if (!out || !job) {
+			ret = -1;
+			break;
+		}
+		*jobs = job;
+		job += *count;
+		job->flag = 0;
+		job->file_in = strdup(in);
+		job->file_out = strdup(out);
+		(*count)++;
+
+		for (; flags && *flags; flags += n + (flags[n] == ',')) {
+			n = strcspn(flags, ",");
+			for (i=0; i<sizeof(job_flags)/sizeof(job_flags[0]); i++)
+				if ((strlen(job_flags[i]) == n) && !strncmp(flags, job_flags[i], n))
+					break;
+			if (i == sizeof(job_flags)/sizeof(job_flags[0])) {
+				ret = -1;
+				break;
+			}
+			job->flag |= job_flag_bits[i];
+		}
+	}
+
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+/*
+ * print the digests of the outputs, and write their SHA-256 to a manifest in
+ * the tagged format of sha256sum --tag, which sha256sum -c can check, and
+ * their size and CRC32C to the same name with .crc32c appended
+ */
+static int print_digests(const struct nand_digest *digests, const char *const *files, int count,
+                         const char *manifest)
+{
+	FILE *fp = NULL, *fp_crc = NULL;
+	char sha[2*NAND_SHA256_BYTES + 1];
+	char *name = NULL;
+	int i, j, ret = -1;
+
+	if (manifest) {
+		name = malloc(strlen(manifest) + sizeof(".crc32c"));
+		if (name == NULL)
+			return -1;
+		sprintf(name, "%s.crc32c", manifest);
+		fp = fopen(manifest, "w");
+		fp_crc = fopen(name, "w");
+		if (!fp || !fp_crc)
+			goto OUT;
+	}
+
+	for (i=0; i<count; i++) {
+		for (j=0; j<NAND_SHA256_BYTES; j++)
+			sprintf(sha + 2*j, "%02x", digests[i].sha256[j]);
+		fprintf(stderr, "Digest: %s %llu bytes, CRC32C %08x", files[i], digests[i].size,
+		        digests[i].crc32c);
+		if (digests[i].has_sha256)
+			fprintf(stderr, ", SHA-256 %s", sha);
+		fprintf(stderr, "\n");
+
+		if (fp == NULL)
+			continue;
+		if (digests[i].has_sha256)
+			fprintf(fp, "SHA256 (%s) = %s\n", files[i], sha);
+		fprintf(fp_crc, "SIZE (%s) = %llu\n", files[i], digests[i].size);
+		fprintf(fp_crc, "CRC32C (%s) = %08x\n", files[i], digests[i].crc32c);
+	}
+	ret = 0;
+
+OUT:
+	if (fp && fclose(fp))
+		ret = -1;
+	if (fp_crc && fclose(fp_crc))
+		ret = -1;
+	free(name);
+	return ret;
+}
+
+/*
+ * parse a sample size: a fraction of the pages, as 0.01 or 1%, or a number of
+ * pages
+ */
+static int parse_sample(struct nandbch_sample *sample, const char *spec)
+{
+	char *end;
+
+	if (strpbrk(spec, ".%")) {
+		sample->fraction = strtod(spec, &end);
+		if (*end == '%') {
+			sample->fraction /= 100;
+			end++;
+		}
+		sample->count = 0;
+		return (*end || (sample->fraction <= 0) || (sample->fraction > 1)) ? -1 : 0;
+	}
+
+	sample->count = strtoul(spec, &end, 0);
+	return (*end || (end == spec) || !sample->count) ? -1 : 0;
+}
+
+/*
+ * print the counts of a sampled verification and their estimates
+ */
+static void print_sample(const struct nandbch_sample *sample)
+{
+	fprintf(stderr, "Sample: %lu of %lu pages (seed %lu), %lu sectors, %lu bitflips, "
+	        "at most %d in a sector, %lu uncorrectable sectors\n", sample->sampled, sample->pages,
+	        sample->seed, sample->sectors, sample->bitflips, sample->max_bitflips,
+	        sample->uncorrectable);
+	fprintf(stderr, "Bitflip rate: %.3g per bit, %.3g to %.3g with 95%% confidence\n",
+	        sample->rate, sample->rate_low, sample->rate_high);
+	fprintf(stderr, "Uncorrectable pages: %lu, %.3g%% to %.3g%% of the pages with 95%% confidence\n",
+	        sample->bad_pages, 100*sample->bad_low, 100*sample->bad_high);
+}
+
+/*
+ * parse a patch given as OFFSET:HEX and append it to the patch list
+ */
+static int add_patch(struct nandbch_patch **patches, int *count, const char *spec)
+{
+	int i, len;
+	char *end;
+	unsigned int byte;
+	unsigned char *data;
+	struct nandbch_patch *p;
+
+	p = realloc(*patches, (*count + 1)*sizeof(**patches));
+	if (p == NULL)
+		return -1;
+	*patches = p;
+	p += *count;
+
+	p->offset = strtoul(spec, &end, 0);
+	if ((end == spec) || (*end != ':'))
+		return -1;
+	spec = end + 1;
+
+	len = strcspn(spec, " \t\r\n");
+	if (!len || (len % 2))
+		return -1;
+
+	data = malloc(len/2);
+	if (data == NULL)
+		return -1;
+	for (i=0; i<len/2; i++) {
+		if (sscanf(spec + 2*i, "%2x", &byte) != 1) {
+			free(data);
+			return -1;
+		}
+		data[i] = byte;
+	}
+
+	p->len = len/2;
+	p->data = data;
+	(*count)++;
+	return 0;
+}
+
+static int add_patch_file(struct nandbch_patch **patches, int *count, const char *file)
+{
+	int ret = 0;
+	char *line = NULL;
+	size_t size = 0;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (fp == NULL)
+		return -1;
+
+	while (!ret && (getline(&line, &size, fp) > 0)) {
+		if ((line[0] == '#') || (line[strspn(line, " \t\r\n")] == '\0'))
+			continue;
+		ret = add_patch(patches, count, line);
+	}
+
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
 int main(int argc, char **argv) {
-	int ret;
+	int i, ret;
 	int chip_no   = 0;
 	int use_input = 0;
 	int use_model = 0;
 	unsigned int flag = 0;
 	static int lopt;
 	struct nand_chip chip = {"NAND Flash parameter"};
+	struct nandbch_options opts = {0};
+	struct nand_randomizer_params randomizer = {0};
+	struct nand_bad_block_params bad_blocks = { NAND_BAD_MARK, 64 };
+	char *end;
+	struct nandbch_patch *patches = NULL;
+	int patch_count = 0;
+	struct nandbch_job *jobs = NULL;
+	int job_count = -1;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int use_digest = 0;
+	const char *manifest = NULL;
+	const char **outputs = NULL;
+	char *previous_in = NULL, *previous_out = NULL;
+	struct nand_partition *partitions = NULL;
+	int partition_count = 0;
+	struct nandbch_sample sample = { .seed = 1 };
+	int use_sample = 0;
+	int use_extract = 0;
 
 	static struct option options[] = {
 		{"model"      , required_argument, NULL , 'm'},
@@ -112,6 +532,31 @@ int main(int argc, char **argv) {
 		{"ecc-offset" , required_argument, &lopt,  5 },
 		{"free-offset", required_argument, &lopt,  6 },
 		{"boot-header", required_argument, &lopt,  7 },
+		{"huge-pages" , no_argument      , &lopt,  8 },
+		{"table-cache", required_argument, &lopt,  9 },
+		{"bitslice"   , no_argument      , &lopt, 10 },
+		{"patch"      , required_argument, &lopt, 11 },
+		{"patch-file" , required_argument, &lopt, 12 },
+		{"previous"   , required_argument, &lopt, 13 },
+		{"dedup"      , optional_argument, &lopt, 14 },
+		{"stats"      , optional_argument, &lopt, 15 },
+		{"layout"     , required_argument, &lopt, 16 },
+		{"ecc-regions", required_argument, &lopt, 17 },
+		{"randomizer" , required_argument, &lopt, 18 },
+		{"keep-erased", no_argument      , &lopt, 19 },
+		{"ecc"        , required_argument, &lopt, 20 },
+		{"partition"  , required_argument, &lopt, 21 },
+		{"bad-blocks" , required_argument, &lopt, 22 },
+		{"bad-block-file", required_argument, &lopt, 23 },
+		{"block-pages", required_argument, &lopt, 24 },
+		{"skip-bad"   , no_argument      , &lopt, 25 },
+		{"batch"      , required_argument, &lopt, 26 },
+		{"threads"    , required_argument, &lopt, 27 },
+		{"digest"     , optional_argument, &lopt, 28 },
+		{"self-check" , no_argument      , &lopt, 29 },
+		{"verify-sample", required_argument, &lopt, 30 },
+		{"sample-seed", required_argument, &lopt, 31 },
+		{"extract"    , no_argument      , &lopt, 32 },
 		{"pmecc"      , no_argument      , NULL , 'p'},
 		{"no-mask"    , no_argument      , NULL , 'n'},
 		{"boot"       , no_argument      , NULL , 'b'},
@@ -186,6 +631,157 @@ int main(int argc, char **argv) {
 					case 7:
 						chip.boot_header = strtol(optarg, NULL, 16);
 						break;
+					case 8:
+						flag |= FLAG_HUGE_PAGES;
+						break;
+					case 9:
+						opts.table_cache = optarg;
+						break;
+					case 10:
+						flag |= FLAG_BITSLICE;
+						break;
+					case 11:
+						if (add_patch(&patches, &patch_count, optarg)) {
+							fprintf(stderr, "%s: Error in patch %s, Use -h for help.\n", argv[0], optarg);
+							return -1;
+						}
+						break;
+					case 12:
+						if (add_patch_file(&patches, &patch_count, optarg)) {
+							fprintf(stderr, "%s: Error in patch file %s.\n", argv[0], optarg);
+							return -1;
+						}
+						break;
+					case 13:
+						end = strchr(optarg, ',');
+						if (end == NULL) {
+							fprintf(stderr, "%s: Error in previous run files %s, Use -h for help.\n", argv[0], optarg);
+							return -1;
+						}
+						free(previous_in);
+						free(previous_out);
+						previous_in = strndup(optarg, end - optarg);
+						previous_out = strdup(end + 1);
+						if (!previous_in || !previous_out) {
+							fprintf(stderr, "%s: Error when malloc previous run files.\n", argv[0]);
+							return -1;
+						}
+						opts.previous_in = previous_in;
+						opts.previous_out = previous_out;
+						break;
+					case 14:
+						opts.dedup_entries = optarg ? strtoul(optarg, NULL, 0) : 16384;
+						break;
+					case 15:
+						if (!optarg || !strcmp(optarg, "text")) {
+							opts.stats = NANDBCH_STATS_TEXT;
+						} else if (!strcmp(optarg, "json")) {
+							opts.stats = NANDBCH_STATS_JSON;
+						} else {
+							fprintf(stderr, "%s: Error stats format %s, Use -h for help.\n", argv[0], optarg);
+							return -1;
+						}
+						break;
+					case 16:
+						if (!strcmp(optarg, "oob")) {
+							chip.layout = NAND_LAYOUT_OOB;
+						} else if (!strcmp(optarg, "interleaved")) {
+							chip.layout = NAND_LAYOUT_INTERLEAVED;
+						} else {
+							fprintf(stderr, "%s: Error page layout %s, Use -h for help.\n", argv[0], optarg);
+							return -1;
+						}
+						break;
+					case 17:
+						chip.ecc_regions = parse_regions(optarg);
+						if (chip.ecc_regions == NULL) {
+							fprintf(stderr, "%s: Error in ECC regions %s, Use -h for help.\n", argv[0], optarg);
+							return -1;
+						}
+						break;
+					case 18:
+						randomizer.taps = strtoul(optarg, &end, 0);
+						if (*end == ':')
+							randomizer.seed = strtoul(end + 1, &end, 0);
+						if (*end == ':')
+							randomizer.period = strtoul(end + 1, &end, 0);
+						if (*end || !randomizer.taps || !randomizer.seed) {
+							fprintf(stderr, "%s: Error in randomizer %s, Use -h for help.\n", argv[0], optarg);
+							return -1;
+						}
+						opts.randomizer = &randomizer;
+						break;
+					case 19:
+						randomizer.keep_erased = 1;
+						break;
+					case 20:
+						chip.ecc_mode = parse_ecc_mode(optarg, strlen(optarg));
+						if (chip.ecc_mode < 0) {
+							fprintf(stderr, "%s: Error ECC scheme %s, Use -h for help.\n", argv[0], optarg);
+							return -1;
+						}
+						break;
+					case 21:
+						if (add_partition(&partitions, &partition_count, optarg)) {
+							fprintf(stderr, "%s: Error in partition %s, Use -h for help.\n", argv[0], optarg);
+							return -1;
+						}
+						chip.partitions = partitions;
+						break;
+					case 22:
+						if (add_bad_blocks(&bad_blocks, optarg)) {
+							fprintf(stderr, "%s: Error in bad blocks %s, Use -h for help.\n", argv[0], optarg);
+							return -1;
+						}
+						opts.bad_blocks = &bad_blocks;
+						break;
+					case 23:
+						if (add_bad_block_file(&bad_blocks, optarg)) {
+							fprintf(stderr, "%s: Error when read bad blocks from %s.\n", argv[0], optarg);
+							return -1;
+						}
+						opts.bad_blocks = &bad_blocks;
+						break;
+					case 24:
+						bad_blocks.block_pages = strtol(optarg, NULL, 0);
+						break;
+					case 25:
+						bad_blocks.mode = NAND_BAD_SKIP;
+						break;
+					case 26:
+						job_count = 0;
+						if (add_batch_file(&jobs, &job_count, optarg) || !job_count) {
+							fprintf(stderr, "%s: Error batch list %s.\n", argv[0], optarg);
+							exit(EXIT_FAILURE);
+						}
+						break;
+					case 27:
+						threads = strtol(optarg, NULL, 10);
+						if (threads <= 0) {
+							fprintf(stderr, "%s: Error thread count %s.\n", argv[0], optarg);
+							exit(EXIT_FAILURE);
+						}
+						break;
+					case 28:
+						use_digest = 1;
+						manifest = optarg;
+						break;
+					case 29:
+						opts.self_check = 1;
+						break;
+					case 30:
+						if (parse_sample(&sample, optarg)) {
+							fprintf(stderr, "%s: Error sample size %s, Use -h for help.\n", argv[0], optarg);
+							return -1;
+						}
+						use_sample = 1;
+						break;
+					case 31:
+						sample.seed = strtoul(optarg, NULL, 0);
+						break;
+					case 32:
+						use_extract = 1;
+						break;
 					default:
 						return -1;
 				}
@@ -195,7 +791,30 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	if (argc < (optind+2)) {
+	if (threads <= 0)
+		threads = 1;
+
+	if (use_sample || use_extract) {
+		if (patch_count || (job_count >= 0) || use_digest || (use_sample && use_extract)) {
+			fprintf(stderr, "%s: Error --verify-sample or --extract couldn't be used with --patch, --batch, --digest or each other\n", argv[0]);
+			return -1;
+		}
+		if (argc < (optind + 1 + use_extract)) {
+			fprintf(stderr, "%s: Error dump or output file name missed, Use -h for help.\n", argv[0]);
+			return -1;
+		}
+	} else if (job_count >= 0) {
+		if (patch_count) {
+			fprintf(stderr, "%s: Error --batch and --patch couldn't be used in the same time\n", argv[0]);
+			return -1;
+		}
+	} else if (patch_count && use_digest) {
+		fprintf(stderr, "%s: Error --digest of an image patched in place isn't supported\n", argv[0]);
+		return -1;
+	} else if (patch_count && (argc < (optind+1))) {
+		fprintf(stderr, "%s: Error image file name missed, Use -h for help.\n", argv[0]);
+		return -1;
+	} else if (!patch_count && (argc < (optind+2))) {
 		fprintf(stderr, "%s: Error in/out file name missed, Use -h for help.\n", argv[0]);
 		return -1;
 	}
@@ -209,6 +828,7 @@ int main(int argc, char **argv) {
 	} else if (use_model) {
 		fprintf(stderr, "Use predefined NAND Flash model %d:\n", chip_no);
 		chip = chips[--chip_no];
+		chip.partitions = partitions; // Partitions are a property of the image
 	} else if (use_input) {
 		fprintf(stderr, "Use input NAND Flash parameter:\n");
 	}
@@ -219,9 +839,46 @@ int main(int argc, char **argv) {
 
 	dump_chips((struct nand_chip (*)[])&chip, 1, 0);
 
-	ret = nandbch(&chip, argv[optind], argv[optind + 1], flag);
+	if (use_digest) {
+		i = (job_count > 0) ? job_count : 1;
+		opts.digest = calloc(i, sizeof(*opts.digest));
+		outputs = calloc(i, sizeof(*outputs));
+		if (!opts.digest || !outputs)
+			return -1;
+		for (i=0; i<job_count; i++)
+			outputs[i] = jobs[i].file_out;
+		if (job_count < 0)
+			outputs[0] = argv[optind + 1];
+	}
+
+	if (use_sample) {
+		ret = nandbch_verify_sample(&chip, argv[optind], flag, &opts, &sample);
+		if (!ret) {
+			print_sample(&sample);
+			if (sample.uncorrectable)
+				return 1;
+		}
+	} else if (use_extract) {
+		ret = nandbch_extract(&chip, argv[optind], argv[optind + 1], flag, &opts, threads);
+		if (ret > 0) {
+			fprintf(stderr, "%s: Error uncorrectable sectors in %s.\n", argv[0], argv[optind]);
+			return ret;
+		}
+	} else if (job_count >= 0)
+		ret = nandbch_batch(&chip, jobs, job_count, flag, &opts, threads);
+	else if (patch_count)
+		ret = nandbch_patch(&chip, argv[optind], flag, patches, patch_count, &opts);
+	else
+		ret = nandbch(&chip, argv[optind], argv[optind + 1], flag, &opts);
+	if (!ret && use_digest &&
+	    print_digests(opts.digest, outputs, (job_count >= 0) ? job_count : 1, manifest)) {
+		fprintf(stderr, "%s: Error when write manifest %s.\n", argv[0], manifest);
+		ret = -1;
+	}
 	if (!ret)
 		fprintf(stderr, "Done.\n");
 
+	free(previous_in);
+	free(previous_out);
 	return ret;
 }
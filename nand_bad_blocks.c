@@ -0,0 +1,183 @@
+/*
+ * Bad block aware images
+ *
+ * Production programmers take either an image with a bad block marker in
+ * the pages of the bad blocks of the target chip, or a skip-block image
+ * whose data is shifted past them. Both are written by nandbch() in its
+ * single pass: pages are marked as they are laid out, and in skip mode the
+ * output gets a block of marked erased pages whenever it reaches a bad
+ * block, one page buffer at a time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "os_swap.h"
+#include "nand_bch.h"
+
+static int nand_bad_blocks_cmp(const void *a, const void *b)
+{
+	const unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * nand_bad_blocks_init - sort the bad block list of a chip
+ * @params:    bad blocks and erase block size
+ * @nand:      NAND Flash parameters
+ *
+ * Returns the bad block map, or NULL on error.
+ */
+struct nand_bad_blocks *nand_bad_blocks_init(const struct nand_bad_block_params *params,
+                                             const struct nand_chip *nand)
+{
+	struct nand_bad_blocks *bad;
+	int i, n;
+
+	if ((params->block_pages <= 0) ||
+	    ((params->mode != NAND_BAD_MARK) && (params->mode != NAND_BAD_SKIP))) {
+		fprintf(stderr, "%s: Error erase block of %d pages or bad block mode %d.\n", __func__,
+		        params->block_pages, params->mode);
+		return NULL;
+	}
+
+	bad = calloc(1, sizeof(*bad));
+	if (bad == NULL)
+		return NULL;
+	bad->mode = params->mode;
+	bad->block_pages = params->block_pages;
+	bad->page_size = nand->page_size;
+	bad->raw_size = nand->page_size + nand->spare_size;
+	bad->marker = nand->free_offset ? nand->free_offset : 1;
+
+	bad->blocks = malloc((params->count + 1)*sizeof(*bad->blocks));
+	bad->filler = malloc(bad->raw_size);
+	if (!bad->blocks || !bad->filler) {
+		fprintf(stderr, "%s: Error when malloc bad block list.\n", __func__);
+		nand_bad_blocks_free(bad);
+		return NULL;
+	}
+
+	memcpy(bad->blocks, params->blocks, params->count*sizeof(*bad->blocks));
+	qsort(bad->blocks, params->count, sizeof(*bad->blocks), nand_bad_blocks_cmp);
+	for (i=0, n=0; i<params->count; i++)
+		if (!n || (bad->blocks[i] != bad->blocks[n - 1]))
+			bad->blocks[n++] = bad->blocks[i];
+	bad->count = n;
+
+	memset(bad->filler, 0xff, bad->raw_size);
+	memset(bad->filler + bad->page_size, 0, bad->marker);
+	return bad;
+}
+
+void nand_bad_blocks_free(struct nand_bad_blocks *bad)
+{
+	if (bad) {
+		free(bad->blocks);
+		free(bad->filler);
+		free(bad);
+	}
+}
+
+int nand_bad_blocks_is_bad(const struct nand_bad_blocks *bad, unsigned long block)
+{
+	return bsearch(&block, bad->blocks, bad->count, sizeof(*bad->blocks),
+	               nand_bad_blocks_cmp) != NULL;
+}
+
+/**
+ * nand_bad_blocks_phys - page of the chip where a page of data goes
+ * @bad:       bad block map
+ * @page:      page number in the data
+ *
+ * In skip mode, every bad block up to the block of the page shifts it by one
+ * block; in mark mode, data pages are chip pages.
+ */
+unsigned long nand_bad_blocks_phys(const struct nand_bad_blocks *bad, unsigned long page)
+{
+	unsigned long block = page/bad->block_pages;
+	int i;
+
+	if (bad->mode != NAND_BAD_SKIP)
+		return page;
+
+	for (i=0; (i<bad->count) && (bad->blocks[i] <= block); i++)
+		block++;
+	return block*bad->block_pages + page%bad->block_pages;
+}
+
+/**
+ * nand_bad_blocks_data - page of data at a page of the chip, the inverse of
+ * nand_bad_blocks_phys()
+ * @bad:       bad block map
+ * @page:      page number in the chip, not in a bad block
+ */
+unsigned long nand_bad_blocks_data(const struct nand_bad_blocks *bad, unsigned long page)
+{
+	const unsigned long block = page/bad->block_pages;
+	int i;
+
+	if (bad->mode != NAND_BAD_SKIP)
+		return page;
+
+	for (i=0; (i<bad->count) && (bad->blocks[i] < block); i++)
+		page -= bad->block_pages;
+	return page;
+}
+
+/**
+ * nand_bad_blocks_reserve - make room for the next pages of the output
+ * @bad:       bad block map
+ * @fd:        output file, written in order
+ * @npages:    number of pages to write
+ *
+ * In skip mode, write the bad blocks the output has reached as marked erased
+ * pages, and stop at the end of the good block the output is then in.
+ *
+ * Returns the number of pages, up to @npages, to write next in a row, or -1
+ * on write error.
+ */
+int nand_bad_blocks_reserve(struct nand_bad_blocks *bad, int fd, int npages)
+{
+	unsigned long left;
+	int i;
+
+	if (bad->mode == NAND_BAD_SKIP) {
+		while (nand_bad_blocks_is_bad(bad, bad->pos/bad->block_pages)) {
+			for (i=0; i<bad->block_pages; i++)
+				if (write(fd, bad->filler, bad->raw_size) != bad->raw_size)
+					return -1;
+			bad->pos += bad->block_pages;
+			bad->skipped++;
+		}
+
+		left = bad->block_pages - bad->pos%bad->block_pages;
+		if (left < npages)
+			npages = left;
+	}
+
+	bad->pos += npages;
+	return npages;
+}
+
+/**
+ * nand_bad_blocks_mark - mark the raw pages of bad blocks, in mark mode
+ * @bad:       bad block map
+ * @raw:       @npages consecutive raw pages
+ * @page:      page number of the first one
+ * @npages:    number of pages
+ */
+void nand_bad_blocks_mark(const struct nand_bad_blocks *bad, unsigned char *raw,
+                          unsigned long page, int npages)
+{
+	int p;
+
+	if (bad->mode != NAND_BAD_MARK)
+		return;
+
+	for (p=0; p<npages; p++, raw += bad->raw_size)
+		if (nand_bad_blocks_is_bad(bad, (page + p)/bad->block_pages))
+			memset(raw + bad->page_size, 0, bad->marker);
+}
@@ -0,0 +1,71 @@
+#ifndef _NAND_BAD_BLOCKS_H
+#define _NAND_BAD_BLOCKS_H
+
+struct nand_chip;
+
+/* handling of bad blocks */
+#define NAND_BAD_MARK 0 /* data stays in place, pages of bad blocks are marked */
+#define NAND_BAD_SKIP 1 /* data is shifted past bad blocks, left erased and marked */
+
+/**
+ * struct nand_bad_block_params - bad blocks of the chip an image is made for
+ * @mode:      NAND_BAD_MARK or NAND_BAD_SKIP
+ * @block_pages: erase block size in pages
+ * @blocks:    bad block numbers, in any order
+ * @count:     number of bad blocks
+ *
+ * A bad block marker is the reserved bytes of the OOB area, before
+ * free_offset, set to 0 in every page of the block. It is written at the
+ * start of the OOB area of the raw page, whatever the layout, as the marker
+ * of a factory bad block.
+ */
+struct nand_bad_block_params {
+	int                 mode;
+	int                 block_pages;
+	const unsigned long *blocks;
+	int                 count;
+};
+
+/**
+ * struct nand_bad_blocks - bad blocks of an image being written
+ * @mode:      NAND_BAD_MARK or NAND_BAD_SKIP
+ * @block_pages: erase block size in pages
+ * @blocks:    bad block numbers, sorted, without duplicates
+ * @count:     number of bad blocks
+ * @page_size: data area size
+ * @raw_size:  raw page size
+ * @marker:    bad block marker size
+ * @filler:    erased raw page with a bad block marker
+ * @pos:       next page of the output
+ * @skipped:   bad blocks skipped in the output
+ */
+struct nand_bad_blocks {
+	int           mode;
+	int           block_pages;
+	unsigned long *blocks;
+	int           count;
+	int           page_size;
+	int           raw_size;
+	int           marker;
+	unsigned char *filler;
+	unsigned long pos;
+	unsigned long skipped;
+};
+
+struct nand_bad_blocks *nand_bad_blocks_init(const struct nand_bad_block_params *params,
+                                             const struct nand_chip *nand);
+
+void nand_bad_blocks_free(struct nand_bad_blocks *bad);
+
+int nand_bad_blocks_is_bad(const struct nand_bad_blocks *bad, unsigned long block);
+
+unsigned long nand_bad_blocks_phys(const struct nand_bad_blocks *bad, unsigned long page);
+
+unsigned long nand_bad_blocks_data(const struct nand_bad_blocks *bad, unsigned long page);
+
+int nand_bad_blocks_reserve(struct nand_bad_blocks *bad, int fd, int npages);
+
+void nand_bad_blocks_mark(const struct nand_bad_blocks *bad, unsigned char *raw,
+                          unsigned long page, int npages);
+
+#endif /* _NAND_BAD_BLOCKS_H */
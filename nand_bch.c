@@ -1,23 +1,37 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <getopt.h>
+#include <limits.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "os_swap.h"
 #include "bch.h"
 #include "nand_bch.h"
+#include "work_pool.h"
+
+#define NAND_VERIFY_SLOTS 4 /* chunks queued for the self-check thread */
 
 #define REV_TABLE_SIZE 256
 #define REPEAT_TIMES	52
 
+/* state of a page in a chunk */
+#define PAGE_UNCHANGED	0 /* same as in the previous run, copied from its output */
+#define PAGE_CHANGED	1
+#define PAGE_ERASED	2 /* erased data area, ecc codes stored without encoding */
+
 static unsigned char bit_reverse(unsigned char b);
-static int nand_bch_calculate_ecc(struct nand_bch_control *nand, const u_char *buf, int len, u_char *code, int no_mask);
-static struct nand_bch_control *nand_bch_init(struct nand_chip *nand);
-static void nand_bch_free(struct nand_bch_control *nbc);
+static bch_encode_fn nand_bch_encoder(struct bch_control *bch);
+static int nand_bch_calculate_ecc_bulk(struct nand_bch_control *nbc, int nsec, const u_char *const *buf,
+                                       int len, u_char *const *code, int no_mask);
 
 static unsigned char bit_reverse(unsigned char b)
 {
@@ -47,12 +61,28 @@ static void dump(char *name, void *buf, int size)
 }
 #endif
 
-static int nand_bch_calculate_ecc(struct nand_bch_control *nbc, const u_char *buf, int len, u_char *code, int no_mask)
+int nand_bch_calculate_ecc(struct nand_bch_control *nbc, const u_char *buf, int len, u_char *code, int no_mask)
 {
 	unsigned int i;
+	struct sector_key key;
+
+	if (nbc->ecc_mode != NAND_ECC_BCH) {
+		/* parity accumulation only, the code of an erased sector needs no mask */
+		nand_hamming_calculate(buf, len, code, nbc->ecc_mode == NAND_ECC_HAMMING_SMC);
+		return 0;
+	}
 
-	memset(code, 0, nbc->bch->ecc_bytes);
-	encode_bch(nbc->bch, buf, len, code);
+	if ((len == nbc->ecc_sector) && (buf[0] == 0xff) && !memcmp(buf, buf + 1, len - 1)) {
+		/* erased sector, its ecc is the inverted mask */
+		for (i = 0; i < nbc->bch->ecc_bytes; i++)
+			code[i] = ~nbc->eccmask[i];
+		nbc->erased++;
+	} else if (!nbc->dedup || !sector_cache_get(nbc->dedup, buf, len, &key, code)) {
+		memset(code, 0, nbc->bch->ecc_bytes);
+		nbc->encode(nbc->bch, buf, len, code);
+		if (nbc->dedup)
+			sector_cache_put(nbc->dedup, &key, code);
+	}
 
 	/* apply mask so that an erased page is a valid codeword */
 	if (!no_mask) {
@@ -63,81 +93,864 @@ static int nand_bch_calculate_ecc(struct nand_bch_control *nbc, const u_char *bu
 	return 0;
 }
 
-static struct nand_bch_control *nand_bch_init(struct nand_chip *nand)
+/*
+ * bit-sliced variant of nand_bch_calculate_ecc() for many sectors at once
+ */
+static int nand_bch_calculate_ecc_bulk(struct nand_bch_control *nbc, int nsec, const u_char *const *buf,
+                                       int len, u_char *const *code, int no_mask)
 {
-	unsigned int m, t, i;
-	struct nand_bch_control *nbc = NULL;
-	unsigned char *erased_page;
+	int i, j;
 
-	if (nand == NULL)
-		return NULL;
+	if (encode_bch_bitslice(nbc->bch, nsec, buf, len, code))
+		return -1;
 
-	nbc = malloc(sizeof(*nbc));
-	if (nbc == NULL)
-		return NULL;
-	memset(nbc, 0, sizeof(*nbc));
+	/* apply mask so that an erased page is a valid codeword */
+	if (!no_mask) {
+		for (i = 0; i < nsec; i++)
+			for (j = 0; j < nbc->bch->ecc_bytes; j++)
+				code[i][j] ^= nbc->eccmask[j];
+	}
+
+	return 0;
+}
+
+/*
+ * pick the encoder specialized at build time for these BCH parameters, if any
+ */
+static bch_encode_fn nand_bch_encoder(struct bch_control *bch)
+{
+	const struct bch_gen_encoder *gen;
+
+	for (gen = bch_gen_encoders; gen->encode; gen++) {
+		if ((gen->m == bch->m) && (gen->t == bch->t) && (gen->prim_poly == bch->prim_poly))
+			return gen->encode;
+	}
+
+	return encode_bch;
+}
+
+/*
+ * BCH control structure, encoder and erased sector mask of a chip
+ */
+static int nand_bch_init_code(struct nand_bch_control *nbc, struct nand_chip *nand,
+                              unsigned int flag, const struct nandbch_options *opts)
+{
+	unsigned int m, t, i, bch_flags;
+	unsigned char *erased_page;
+	const int steps = nand->page_size/nand->ecc_sector;
 
 	m = fls(1+8*nand->ecc_sector);
 	t = (nand->ecc_bytes*8)/m;
 
-	nbc->bch = init_bch(m, t, 0);
+	bch_flags = BCH_ENCODE_ONLY;
+	if (flag & FLAG_HUGE_PAGES)
+		bch_flags |= BCH_HUGE_PAGES;
+
+	nbc->eccmask = malloc(DIV_ROUND_UP(m*t, 8));
+	nbc->errloc = malloc(steps*t*sizeof(*nbc->errloc));
+	nbc->dec_data = malloc(steps*sizeof(*nbc->dec_data));
+	nbc->dec_ecc = malloc(steps*sizeof(*nbc->dec_ecc));
+	nbc->dec_nerr = malloc(steps*sizeof(*nbc->dec_nerr));
+	if (!nbc->eccmask || !nbc->errloc || !nbc->dec_data || !nbc->dec_ecc || !nbc->dec_nerr)
+		return -1;
+
+	if (flag & FLAG_BITSLICE) {
+		i = DIV_ROUND_UP(BCH_SLICE_LANES, nand->page_size/nand->ecc_sector)*
+		    (nand->page_size/nand->ecc_sector);
+		nbc->slice_data = malloc(i*sizeof(*nbc->slice_data));
+		nbc->slice_ecc = malloc(i*sizeof(*nbc->slice_ecc));
+		if (!nbc->slice_data || !nbc->slice_ecc)
+			return -1;
+	}
+
+	if (opts && opts->table_cache) {
+		/* tables and erased sector ecc come from the table file */
+		nbc->bch = bch_cache_init(opts->table_cache, m, t, 0, bch_flags,
+		                          nand->ecc_sector, nbc->eccmask, &nbc->cache);
+	} else {
+		nbc->bch = init_bch(m, t, 0, bch_flags);
+	}
 	if (nbc->bch == NULL)
-		goto FAIL;
+		return -1;
 
 	if (nbc->bch->ecc_bytes != nand->ecc_bytes) {
 		printk(KERN_WARNING "invalid eccbytes %u, should be %u\n",
 			nand->ecc_bytes, nbc->bch->ecc_bytes);
-		goto FAIL;
+		return -1;
 	}
 
-	nbc->eccmask = malloc(nand->ecc_bytes);
-	nbc->errloc = malloc(t*sizeof(*nbc->errloc));
-	if (!nbc->eccmask || !nbc->errloc)
-		goto FAIL;
+	nbc->encode = nand_bch_encoder(nbc->bch);
 
-	/*
-	 * compute and store the inverted ecc of an erased ecc block
-	 */
-	erased_page = kmalloc(nand->ecc_sector, GFP_KERNEL);
-	if (!erased_page)
-		goto FAIL;
+	/* the bit-sliced encoder taps, built before batch workers share them */
+	if ((flag & FLAG_BITSLICE) && init_bch_bitslice(nbc->bch))
+		return -1;
 
-	memset(erased_page, 0xff, nand->ecc_sector);
-	memset(nbc->eccmask, 0, nand->ecc_bytes);
-	encode_bch(nbc->bch, erased_page, nand->ecc_sector, nbc->eccmask);
-	kfree(erased_page);
+	if (!(opts && opts->table_cache)) {
+		/*
+		 * compute and store the inverted ecc of an erased ecc block
+		 */
+		erased_page = kmalloc(nand->ecc_sector, GFP_KERNEL);
+		if (!erased_page)
+			return -1;
+
+		memset(erased_page, 0xff, nand->ecc_sector);
+		memset(nbc->eccmask, 0, nand->ecc_bytes);
+		encode_bch(nbc->bch, erased_page, nand->ecc_sector, nbc->eccmask);
+		kfree(erased_page);
+	}
 
 	for (i = 0; i < nand->ecc_bytes; i++)
 		nbc->eccmask[i] ^= 0xff;
 
+	return 0;
+}
+
+/*
+ * the Hamming code of an erased sector is all 0xff already, there is no mask
+ */
+static int nand_bch_init_hamming(struct nand_bch_control *nbc, struct nand_chip *nand)
+{
+	if (((nand->ecc_sector != 256) && (nand->ecc_sector != 512)) ||
+	    (nand->ecc_bytes != NAND_HAMMING_BYTES)) {
+		fprintf(stderr, "%s: Error Hamming ECC needs %d bytes per 256 or 512 byte sector.\n",
+		        __func__, NAND_HAMMING_BYTES);
+		return -1;
+	}
+
+	nbc->eccmask = calloc(NAND_HAMMING_BYTES, 1);
+	return nbc->eccmask ? 0 : -1;
+}
+
+struct nand_bch_control *nand_bch_init(struct nand_chip *nand, unsigned int flag,
+                                       const struct nandbch_options *opts)
+{
+	struct nand_bch_control *nbc = NULL;
+	int ret;
+
+	if (nand == NULL)
+		return NULL;
+
+	nbc = malloc(sizeof(*nbc));
+	if (nbc == NULL)
+		return NULL;
+	memset(nbc, 0, sizeof(*nbc));
+
+	if (nand->ecc_mode == NAND_ECC_BCH)
+		ret = nand_bch_init_code(nbc, nand, flag, opts);
+	else
+		ret = nand_bch_init_hamming(nbc, nand);
+	if (ret)
+		goto FAIL;
+	nbc->ecc_sector = nand->ecc_sector;
+	nbc->ecc_mode = nand->ecc_mode;
+
+	if (opts && opts->dedup_entries) {
+		nbc->dedup = sector_cache_init(opts->dedup_entries, nand->ecc_bytes);
+		if (nbc->dedup == NULL)
+			goto FAIL;
+	}
+
+	nbc->layout = nand_layout_init(nand);
+	if (nbc->layout == NULL)
+		goto FAIL;
+
+	if (opts && opts->randomizer) {
+		nbc->randomizer = nand_randomizer_init(opts->randomizer, nand->page_size);
+		if (nbc->randomizer == NULL)
+			goto FAIL;
+	}
+
 	return nbc;
 FAIL:
 	nand_bch_free(nbc);
 	return NULL;
 }
 
-static void nand_bch_free(struct nand_bch_control *nbc)
+/**
+ * nand_bch_share - control structure for another thread
+ * @nbc:       control structure made by nand_bch_init()
+ * @nand:      NAND Flash parameters it was made for
+ *
+ * The new control structure uses the tables, erased sector mask, layout and
+ * randomizer of @nbc, which are read only once built, and must be freed
+ * before it. Only its bit-sliced encoder buffers are its own, and it has no
+ * sector cache.
+ */
+struct nand_bch_control *nand_bch_share(const struct nand_bch_control *nbc,
+                                        const struct nand_chip *nand)
+{
+	struct nand_bch_control *share;
+	unsigned int n;
+
+	share = malloc(sizeof(*share));
+	if (share == NULL)
+		return NULL;
+	*share = *nbc;
+	share->owner = nbc;
+	share->dedup = NULL;
+	share->erased = 0;
+
+	if (nbc->slice_data) {
+		n = DIV_ROUND_UP(BCH_SLICE_LANES, nand->page_size/nand->ecc_sector)*
+		    (nand->page_size/nand->ecc_sector);
+		share->slice_data = malloc(n*sizeof(*share->slice_data));
+		share->slice_ecc = malloc(n*sizeof(*share->slice_ecc));
+		if (!share->slice_data || !share->slice_ecc) {
+			nand_bch_free(share);
+			return NULL;
+		}
+	}
+
+	return share;
+}
+
+void nand_bch_free(struct nand_bch_control *nbc)
 {
-	if (nbc) {
+	if (nbc && nbc->owner) {
+		free(nbc->slice_data);
+		free(nbc->slice_ecc);
+		free(nbc);
+	} else if (nbc) {
 		free_bch(nbc->bch);
+		bch_cache_free(&nbc->cache);
 		free(nbc->errloc);
+		free(nbc->dec_data);
+		free(nbc->dec_ecc);
+		free(nbc->dec_nerr);
 		free(nbc->eccmask);
+		free(nbc->slice_data);
+		free(nbc->slice_ecc);
+		sector_cache_free(nbc->dedup);
+		nand_layout_free(nbc->layout);
+		nand_randomizer_free(nbc->randomizer);
 		free(nbc);
 	}
 }
 
-int nandbch(struct nand_chip *nand, const char *file_in, const char *file_out, unsigned int flag)
+/*
+ * time and bytes spent in one stage of nandbch()
+ */
+struct nand_stage {
+	const char         *name;
+	double             time;
+	unsigned long long bytes;
+};
+
+/*
+ * statistics of a nandbch() run; stage times are only measured when enabled,
+ * once per stage and chunk of pages
+ */
+struct nand_stats {
+	int               enabled;
+	double            start;
+	double            lap;      /* end of the last measured stage */
+	struct nand_stage init;     /* open files, BCH tables and buffers */
+	struct nand_stage read;     /* input read, and previous input read */
+	struct nand_stage header;   /* boot header prep */
+	struct nand_stage scramble; /* data randomizer */
+	struct nand_stage reverse;  /* PMECC bit order reversal */
+	struct nand_stage encode;   /* ECC encode */
+	struct nand_stage erased;   /* erased page detection and shortcut */
+	struct nand_stage layout;   /* raw page layout copy plan */
+	struct nand_stage write;    /* output write, and copy from a previous output */
+	struct nand_stage digest;   /* output CRC32C and SHA-256 */
+	struct nand_stage verify;   /* hand-off to the self-check thread, and waits for it */
+	unsigned long     pages;
+	unsigned long     syscalls; /* read, lseek, write and copy system calls */
+	int               dedup;    /* the sector cache is on */
+	unsigned long     hits;     /* sectors whose ECC code the sector cache had */
+	unsigned long     misses;   /* sectors encoded and added to the sector cache */
+	unsigned long     erased_sectors; /* erased sectors, stored without encoding */
+};
+
+static double nand_stats_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/*
+ * account the time since the last lap to @stage
+ */
+static void nand_stats_lap(struct nand_stats *stats, struct nand_stage *stage)
+{
+	double now;
+
+	if (stats->enabled) {
+		now = nand_stats_clock();
+		stage->time += now - stats->lap;
+		stats->lap = now;
+	}
+}
+
+static void nand_stats_print(const struct nand_stats *stats, int format)
+{
+	const struct nand_stage *stages[] = {
+		&stats->init, &stats->read, &stats->header, &stats->scramble, &stats->reverse,
+		&stats->encode, &stats->erased, &stats->layout, &stats->write, &stats->digest,
+		&stats->verify,
+	};
+	const double total = stats->lap - stats->start;
+	const double mb = stats->write.bytes*1e-6;
+	unsigned int i;
+
+	if (format == NANDBCH_STATS_JSON) {
+		fprintf(stderr, "{\"pages\": %lu, \"bytes\": %llu, \"time_s\": %.6f, "
+		        "\"pages_per_s\": %.0f, \"mb_per_s\": %.2f, \"syscalls\": %lu, \"stages\": {",
+		        stats->pages, stats->write.bytes, total, total > 0 ? stats->pages/total : 0,
+		        total > 0 ? mb/total : 0, stats->syscalls);
+		for (i=0; i<ARRAY_SIZE(stages); i++)
+			fprintf(stderr, "%s\"%s\": {\"time_s\": %.6f, \"bytes\": %llu}", i ? ", " : "",
+			        stages[i]->name, stages[i]->time, stages[i]->bytes);
+		fprintf(stderr, "}");
+		if (stats->dedup)
+			fprintf(stderr, ", \"sector_cache\": {\"hits\": %lu, \"misses\": %lu, "
+			        "\"erased\": %lu}", stats->hits, stats->misses, stats->erased_sectors);
+		fprintf(stderr, "}\n");
+		return;
+	}
+
+	fprintf(stderr, "Stats: %lu pages, %llu bytes in %.6f s, %.0f pages/s, %.2f MB/s, %lu syscalls\n",
+	        stats->pages, stats->write.bytes, total, total > 0 ? stats->pages/total : 0,
+	        total > 0 ? mb/total : 0, stats->syscalls);
+	for (i=0; i<ARRAY_SIZE(stages); i++)
+		fprintf(stderr, "  %-8s %10.6f s %5.1f%% %14llu bytes\n", stages[i]->name, stages[i]->time,
+		        total > 0 ? 100*stages[i]->time/total : 0, stages[i]->bytes);
+	if (stats->dedup)
+		fprintf(stderr, "  Sector cache: %lu hits, %lu misses, %lu erased sectors\n",
+		        stats->hits, stats->misses, stats->erased_sectors);
+}
+
+/*
+ * read the data area of one page, and its free OOB region for YAFFS images;
+ * returns the number of data bytes read, 0 at end of file, or -1 on error
+ */
+static int nand_read_page(struct nand_chip *nand, int fd_in, const char *file_in,
+                          unsigned char *buf_page, unsigned int *flag,
+                          struct nand_stats *stats)
+{
+	int i, ret;
+	unsigned char *buf_spare = buf_page + nand->page_size;
+
+	if (*flag & FLAG_HEADER) {
+		*flag &= ~FLAG_HEADER;
+		nand_stats_lap(stats, &stats->read);
+		for (i=0; i<REPEAT_TIMES; i++)
+			((unsigned int *)buf_page)[i] = nand->boot_header;
+		stats->header.bytes += REPEAT_TIMES*sizeof(unsigned int);
+		nand_stats_lap(stats, &stats->header);
+
+		ret = read(fd_in, buf_page + REPEAT_TIMES*sizeof(unsigned int),
+								nand->page_size - REPEAT_TIMES*sizeof(unsigned int));
+		stats->syscalls++;
+		if (ret > 0) {
+			stats->read.bytes += ret;
+			ret += REPEAT_TIMES*sizeof(unsigned int);
+		}
+	} else {
+		ret = read(fd_in, buf_page, nand->page_size);
+		stats->syscalls++;
+		if (ret > 0)
+			stats->read.bytes += ret;
+	}
+
+	if (ret < 0) { // Error occur
+		fprintf(stderr, "%s: Error when read %s.\n", __func__, file_in);
+		perror("read()");
+		return -1;
+	} else if (ret == 0) // End of file
+		return 0;
+
+	if (ret < nand->page_size) { // Padding 0xff, page size aligned
+		memset(buf_page + ret, 0xff, nand->page_size - ret);
+	}
+
+	memset(buf_spare, 0xff, nand->spare_size);
+	if (*flag & FLAG_YAFFS) { // For YAFFS image, read free region data from input file
+		ret = read(fd_in, buf_spare + nand->free_offset, nand->ecc_offset - nand->free_offset);
+		stats->syscalls++;
+		if (ret > 0)
+			stats->read.bytes += ret;
+		if (ret != (nand->ecc_offset - nand->free_offset)) {
+			fprintf(stderr, "%s: Error read free region from %s.\n", __func__, file_in);
+			perror("read()");
+			return -1;
+		}
+
+		ret = lseek(fd_in, nand->spare_size - nand->ecc_offset + nand->free_offset, SEEK_CUR);
+		stats->syscalls++;
+		if (ret < 0) {
+			fprintf(stderr, "%s: Error lseek in %s.\n", __func__, file_in);
+			perror("lseek()");
+			return -1;
+		}
+	}
+
+	return nand->page_size;
+}
+
+/*
+ * PMECC uses inverted bit order, reverse @len bytes of every page of a chunk
+ */
+static void nand_reverse_pages(const struct nand_chip *nand, unsigned char *buf, int npages,
+                               int offset, int len, const unsigned char *rev_table)
+{
+	int i, p;
+	const int raw_size = nand->page_size + nand->spare_size;
+
+	for (p=0; p<npages; p++, buf += raw_size) {
+		for (i=offset; i<offset+len; i++)
+			buf[i] = rev_table[buf[i]&0xff];
+	}
+}
+
+/*
+ * where the ECC code of sector @i of a page goes: straight to its slot in the
+ * raw page @raw when there is one, else to the built page @buf
+ */
+static unsigned char *nand_ecc_code(const struct nand_bch_control *nbc, const struct nand_chip *nand,
+                                    unsigned char *buf, unsigned char *raw, int i)
+{
+	if (raw && (nbc->layout->ecc_slots[i] >= 0))
+		return raw + nbc->layout->ecc_slots[i];
+	return buf + nand->page_size + nand->ecc_offset + i*nand->ecc_bytes;
+}
+
+/*
+ * store the ECC codes of a page whose data area is erased, as computed by
+ * nand_bch_calculate_ecc() for each of its sectors; returns 0 if the page is
+ * not erased
+ */
+static int nand_bch_erased_page(struct nand_bch_control *nbc, const struct nand_chip *nand,
+                                unsigned char *buf, unsigned char *raw, unsigned int flag)
+{
+	int i, j;
+	const int steps = nand->page_size/nand->ecc_sector;
+	unsigned char *ecc;
+
+	if ((buf[0] != 0xff) || memcmp(buf, buf + 1, nand->page_size - 1))
+		return 0;
+
+	for (i=0; i<steps; i++) {
+		ecc = nand_ecc_code(nbc, nand, buf, raw, i);
+		for (j=0; j<nand->ecc_bytes; j++)
+			ecc[j] = (flag & FLAG_NO_MASK) ? ~nbc->eccmask[j] : 0xff;
+	}
+	nbc->erased += steps;
+	return 1;
+}
+
+/*
+ * generate ECC codes for every sector of @npages consecutive built pages, into
+ * the slots of the raw pages @raw if not NULL
+ */
+static void nand_bch_calculate_pages(struct nand_bch_control *nbc, const struct nand_chip *nand,
+                                     unsigned char *buf, unsigned char *raw, int npages,
+                                     unsigned int flag)
+{
+	int i, p;
+	const int steps = nand->page_size/nand->ecc_sector;
+	const int raw_size = nand->page_size + nand->spare_size;
+
+	if (nbc->slice_data && !nbc->dedup && (2*npages*steps >= BCH_SLICE_LANES)) {
+		for (p=0; p<npages; p++) {
+			for (i=0; i<steps; i++) {
+				nbc->slice_data[p*steps+i] = buf + p*raw_size + i*nand->ecc_sector;
+				nbc->slice_ecc[p*steps+i] = nand_ecc_code(nbc, nand, buf + p*raw_size,
+				                                          raw ? raw + p*raw_size : NULL, i);
+			}
+		}
+		if (!nand_bch_calculate_ecc_bulk(nbc, npages*steps, nbc->slice_data, nand->ecc_sector,
+		                                 nbc->slice_ecc, flag & FLAG_NO_MASK))
+			return;
+	}
+
+	for (p=0; p<npages; p++, buf += raw_size, raw = raw ? raw + raw_size : NULL) {
+		for (i=0; i<steps; i++) // Generate ECC codes for every sector
+			nand_bch_calculate_ecc(nbc, buf+i*nand->ecc_sector,
+															nand->ecc_sector, nand_ecc_code(nbc, nand, buf, raw, i),
+															flag & FLAG_NO_MASK);
+	}
+}
+
+/*
+ * input and output images of a previous run, for an incremental rebuild
+ */
+struct nand_previous {
+	int           fd_in;
+	int           fd_out;
+	off_t         out_size;
+	unsigned int  flag;     /* flags of the previous input reader */
+	int           eof;
+	unsigned char *buf;     /* a page of the previous input */
+	long          reused;
+	const struct nand_bad_blocks *bad; /* bad blocks of both outputs, or NULL */
+};
+
+static int nand_previous_open(struct nand_chip *nand, struct nand_previous *prev,
+                              const struct nandbch_options *opts, unsigned int flag,
+                              const struct nand_bad_blocks *bad)
+{
+	struct stat st;
+
+	prev->fd_in = open(opts->previous_in, O_RDONLY);
+	if (prev->fd_in < 0) {
+		fprintf(stderr, "%s: Error when open previous input file %s: ", __func__, opts->previous_in);
+		perror(NULL);
+		return -1;
+	}
+
+	prev->fd_out = open(opts->previous_out, O_RDONLY);
+	if ((prev->fd_out < 0) || (fstat(prev->fd_out, &st) < 0)) {
+		fprintf(stderr, "%s: Error when open previous output file %s: ", __func__, opts->previous_out);
+		perror(NULL);
+		return -1;
+	}
+
+	prev->buf = malloc(nand->page_size + nand->spare_size);
+	if (prev->buf == NULL) {
+		fprintf(stderr, "%s: Error when malloc page buffer.\n", __func__);
+		return -1;
+	}
+
+	prev->out_size = st.st_size;
+	prev->flag = flag;
+	prev->eof = 0;
+	prev->reused = 0;
+	prev->bad = bad;
+	return 0;
+}
+
+static void nand_previous_close(struct nand_previous *prev)
+{
+	if (prev->fd_in >= 0)
+		close(prev->fd_in);
+	if (prev->fd_out >= 0)
+		close(prev->fd_out);
+	free(prev->buf);
+}
+
+/*
+ * read page @page_no of the previous input the same way as the current one,
+ * and tell whether its output differs from the previous output
+ */
+static int nand_previous_changed(struct nand_chip *nand, struct nand_previous *prev,
+                                 const char *file, const unsigned char *buf_page,
+                                 long page_no, struct nand_stats *stats)
+{
+	const int raw_size = nand->page_size + nand->spare_size;
+
+	if (prev->eof)
+		return 1;
+
+	if (prev->bad)
+		page_no = nand_bad_blocks_phys(prev->bad, page_no);
+
+	if (nand_read_page(nand, prev->fd_in, file, prev->buf, &prev->flag, stats) <= 0) {
+		prev->eof = 1;
+		return 1;
+	}
+
+	if ((off_t)(page_no + 1)*raw_size > prev->out_size)
+		return 1;
+
+	return memcmp(prev->buf, buf_page, raw_size) != 0;
+}
+
+/*
+ * append @len bytes at @pos of the previous output to the output, sharing
+ * extents when the file system allows it
+ */
+static int nand_previous_copy(struct nand_previous *prev, int fd_out, off_t pos, size_t len,
+                              unsigned char *buf, size_t buf_size, struct nand_digest_ctx *digest,
+                              struct nand_stats *stats)
+{
+	ssize_t ret;
+
+	/* the copy is digested on the way, through the page buffer */
+	stats->write.bytes += len;
+	while (len && !digest) {
+		ret = copy_file_range(prev->fd_out, &pos, fd_out, NULL, len, 0);
+		stats->syscalls++;
+		if (ret <= 0)
+			break;
+		len -= ret;
+	}
+
+	/* not supported between these files, bounce through the page buffer */
+	while (len) {
+		ret = pread(prev->fd_out, buf, (len < buf_size) ? len : buf_size, pos);
+		stats->syscalls += 2;
+		if ((ret <= 0) || (write(fd_out, buf, ret) != ret))
+			return -1;
+		if (digest)
+			nand_digest_update(digest, buf, ret);
+		pos += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * pages of an image sharing one ECC scheme: a partition of the chip, or all
+ * the pages after its partitions
+ */
+struct nand_segment {
+	struct nand_chip        nand;   /* chip, with the ECC scheme of the segment */
+	struct nand_bch_control *nbc;
+	long                    end;    /* first page after the segment */
+	int                     npages; /* pages per chunk */
+};
+
+static void nand_segments_free(struct nand_segment *segs, int count)
 {
-	int ret = -1;
 	int i;
+
+	if (segs) {
+		for (i=0; i<count; i++)
+			nand_bch_free(segs[i].nbc);
+		free(segs);
+	}
+}
+
+/*
+ * one segment per partition of @nand, then one for the rest of the chip;
+ * partition ECC codes go to their own ecc_offset, not to ecc_regions
+ */
+static struct nand_segment *nand_segments_init(struct nand_chip *nand, unsigned int flag,
+                                               const struct nandbch_options *opts, int *count)
+{
+	const struct nand_partition *part;
+	struct nand_segment *segs, *seg;
+	long start = 0;
+
+	*count = 1;
+	for (part=nand->partitions; part && part->pages; part++)
+		(*count)++;
+
+	segs = calloc(*count, sizeof(*segs));
+	if (segs == NULL) {
+		fprintf(stderr, "%s: Error when malloc segments.\n", __func__);
+		return NULL;
+	}
+
+	for (seg=segs, part=nand->partitions; seg<segs+*count; seg++) {
+		seg->nand = *nand;
+		seg->end = LONG_MAX;
+		if (seg < segs + *count - 1) {
+			seg->nand.ecc_mode = part->ecc_mode;
+			seg->nand.ecc_sector = part->ecc_sector;
+			seg->nand.ecc_bytes = part->ecc_bytes;
+			seg->nand.ecc_offset = part->ecc_offset;
+			seg->nand.ecc_regions = NULL;
+			if ((part->ecc_sector <= 0) || (nand->page_size % part->ecc_sector)) {
+				fprintf(stderr, "%s: Error partition ECC sector %d.\n", __func__, part->ecc_sector);
+				goto FAIL;
+			}
+			if (part->ecc_offset == -1) // Right-aligned
+				seg->nand.ecc_offset = nand->spare_size -
+				                       (nand->page_size/part->ecc_sector)*part->ecc_bytes;
+			start += part->pages;
+			seg->end = start;
+			part++;
+		}
+
+		/* bit-sliced encoding works on enough pages to fill all its lanes */
+		seg->npages = 1;
+		if (flag & FLAG_BITSLICE)
+			seg->npages = DIV_ROUND_UP(BCH_SLICE_LANES, nand->page_size/seg->nand.ecc_sector);
+
+		seg->nbc = nand_bch_init(&seg->nand, flag, opts);
+		if (seg->nbc == NULL)
+			goto FAIL;
+	}
+
+	return segs;
+FAIL:
+	nand_segments_free(segs, *count);
+	return NULL;
+}
+
+/*
+ * scramble the data areas of the changed pages of a chunk, and reverse them
+ * all for PMECC, before encoding
+ */
+static void nand_scramble_chunk(const struct nand_segment *seg, unsigned char *buf,
+                                const unsigned char *changed, int npages, long page_no,
+                                unsigned int flag, const unsigned char *rev_table,
+                                struct nand_stats *stats)
+{
+	const struct nand_chip *chip = &seg->nand;
+	const int raw_size = chip->page_size + chip->spare_size;
+	int j;
+
+	/* the data area is stored scrambled, and its ECC computed as such */
+	if (seg->nbc->randomizer) {
+		for (j=0; j<npages; j++) {
+			if (changed[j]) {
+				nand_randomizer_apply(seg->nbc->randomizer, buf + j*raw_size, page_no + j);
+				stats->scramble.bytes += chip->page_size;
+			}
+		}
+		nand_stats_lap(stats, &stats->scramble);
+	}
+
+	if (flag & FLAG_PMECC) {
+		nand_reverse_pages(chip, buf, npages, 0, chip->page_size, rev_table);
+		stats->reverse.bytes += npages*chip->page_size;
+		nand_stats_lap(stats, &stats->reverse);
+	}
+}
+
+/*
+ * ECC codes of a run of changed pages, in the stored bit order, laid out as
+ * raw pages; returns the raw pages, in @buf or @buf_raw. With @buf_raw, the
+ * ECC codes with a slot go straight there and the rest is copied after.
+ */
+static unsigned char *nand_encode_run(const struct nand_segment *seg, unsigned char *buf,
+                                      unsigned char *changed, int npages, unsigned int flag,
+                                      const unsigned char *rev_table, unsigned char *buf_raw,
+                                      struct nand_stats *stats)
+{
+	const struct nand_chip *chip = &seg->nand;
+	struct nand_bch_control *nbc = seg->nbc;
+	const int raw_size = chip->page_size + chip->spare_size;
+	const int steps = chip->page_size/chip->ecc_sector;
+	int i, j, k;
+
+	/* erased pages need no encoding, encode runs of the other ones */
+	for (j=0; j<npages; j++) {
+		if (nand_bch_erased_page(nbc, chip, buf + j*raw_size, buf_raw ? buf_raw + j*raw_size : NULL,
+		                         flag)) {
+			changed[j] = PAGE_ERASED;
+			stats->erased.bytes += chip->page_size;
+		}
+	}
+	nand_stats_lap(stats, &stats->erased);
+
+	for (j=0; j<npages; j=k) {
+		for (k=j+1; (k<npages) && (changed[k] == changed[j]); k++)
+			;
+		if (changed[j] == PAGE_CHANGED) {
+			nand_bch_calculate_pages(nbc, chip, buf + j*raw_size,
+			                         buf_raw ? buf_raw + j*raw_size : NULL, k - j, flag);
+			stats->encode.bytes += (k - j)*chip->page_size;
+		}
+	}
+	nand_stats_lap(stats, &stats->encode);
+
+	if (flag & FLAG_PMECC) {
+		// Recovery the bit order for data area, store ECC codes follow PMECC bit order
+		nand_reverse_pages(chip, buf, npages, 0, chip->page_size, rev_table);
+		nand_reverse_pages(chip, buf, npages, chip->page_size + chip->ecc_offset,
+		                   chip->spare_size - chip->ecc_offset, rev_table);
+		for (i=0; buf_raw && (i<steps); i++) {
+			if (nbc->layout->ecc_slots[i] >= 0)
+				nand_reverse_pages(chip, buf_raw, npages, nbc->layout->ecc_slots[i],
+				                   chip->ecc_bytes, rev_table);
+		}
+		stats->reverse.bytes += npages*(chip->page_size + chip->spare_size - chip->ecc_offset);
+		nand_stats_lap(stats, &stats->reverse);
+	}
+
+	if (buf_raw) {
+		nand_layout_apply(nbc->layout, buf, buf_raw, npages);
+		stats->layout.bytes += npages*raw_size;
+		nand_stats_lap(stats, &stats->layout);
+		return buf_raw;
+	}
+	return buf;
+}
+
+/*
+ * write @npages raw pages of @buf from page @page_no on, or copy them from the
+ * previous output if @buf is NULL, around the bad blocks of the output if any
+ */
+static int nand_write_pages(int fd_out, const unsigned char *buf, long page_no, int npages,
+                            int raw_size, struct nand_bad_blocks *bad, struct nand_previous *prev,
+                            unsigned char *bounce, size_t bounce_size,
+                            struct nand_digest_ctx *digest, struct nand_stats *stats)
+{
+	unsigned long skipped;
+	ssize_t ret;
+	long pos;
+	int k;
+
+	for (; npages; npages -= k, page_no += k) {
+		k = npages;
+		pos = page_no;
+		if (bad) {
+			skipped = bad->skipped;
+			k = nand_bad_blocks_reserve(bad, fd_out, npages);
+			if (k < 0)
+				return -1;
+			pos = bad->pos - k;
+			for (skipped=(bad->skipped - skipped)*bad->block_pages; digest && skipped; skipped--)
+				nand_digest_update(digest, bad->filler, raw_size);
+		}
+
+		if (buf == NULL) {
+			if (nand_previous_copy(prev, fd_out, (off_t)pos*raw_size, (size_t)k*raw_size,
+			                       bounce, bounce_size, digest, stats))
+				return -1;
+			prev->reused += k;
+			continue;
+		}
+
+		ret = write(fd_out, buf, (size_t)k*raw_size);
+		stats->syscalls++;
+		if (ret > 0)
+			stats->write.bytes += ret;
+		if (ret != (ssize_t)k*raw_size)
+			return -1;
+
+		if (digest) {
+			nand_stats_lap(stats, &stats->write);
+			nand_digest_update(digest, buf, ret);
+			stats->digest.bytes += ret;
+			nand_stats_lap(stats, &stats->digest);
+		}
+		buf += (size_t)k*raw_size;
+	}
+
+	return 0;
+}
+
+int nandbch(struct nand_chip *nand, const char *file_in, const char *file_out, unsigned int flag,
+            const struct nandbch_options *opts)
+{
+	int ret = -1;
+	int i, n, p, q, npages, chunk, raw_size, nsegs = 0;
 	int fd_in, fd_out;
-	unsigned char *buf_page, *buf_spare;
+	long page_no = 0;
+	unsigned char *buf_chunk, *buf_raw = NULL, *buf_out, *changed;
 	unsigned char *rev_table = NULL;
-	struct nand_bch_control *nbc_handle = NULL;
+	struct nand_segment *segs = NULL, *seg;
+	struct nand_bad_blocks *bad = NULL;
+	struct nand_chip *chip;
+	struct nand_previous prev = { .fd_in = -1, .fd_out = -1 };
+	struct nand_digest_ctx digest_ctx, *digest = NULL;
+	struct nand_verify *verify = NULL;
+	struct nand_stats stats = {
+		.init = { "init" }, .read = { "read" }, .header = { "header" }, .scramble = { "scramble" },
+		.reverse = { "reverse" },
+		.encode = { "encode" }, .erased = { "erased" }, .layout = { "layout" }, .write = { "write" },
+		.digest = { "digest" }, .verify = { "verify" },
+	};
 
 	if ((nand == NULL) || (file_in == NULL) || (file_out == NULL))
 		return ret;
 
+	if (opts && opts->stats) {
+		stats.enabled = 1;
+		stats.start = stats.lap = nand_stats_clock();
+	}
+
+	raw_size = nand->page_size + nand->spare_size;
+
 	fd_in = open(file_in, O_RDONLY);
 	if (fd_in < 0) {
 		fprintf(stderr, "%s: Error when open input file %s: ", __func__, file_in);
@@ -152,111 +965,1625 @@ int nandbch(struct nand_chip *nand, const char *file_in, const char *file_out, u
 		goto OUT_1;
 	}
 
-	buf_page = malloc(nand->page_size + nand->spare_size);
-	if (buf_page == NULL) {
-		fprintf(stderr, "%s: Error when malloc page buffer.\n", __func__);
+	segs = nand_segments_init(nand, flag, opts, &nsegs);
+	if (segs == NULL) {
+		fprintf(stderr, "%s: Error when get nbc handle.\n", __func__);
 		goto OUT_2;
 	}
-	buf_spare = buf_page + nand->page_size;
+
+	for (seg=segs, npages=0; seg<segs+nsegs; seg++)
+		npages = (seg->npages > npages) ? seg->npages : npages;
+
+	buf_chunk = malloc(npages*(raw_size + 1));
+	if (buf_chunk == NULL) {
+		fprintf(stderr, "%s: Error when malloc page buffer.\n", __func__);
+		goto OUT_3;
+	}
+	changed = buf_chunk + npages*raw_size;
 
 	if (flag & FLAG_PMECC) {
 		rev_table = malloc(REV_TABLE_SIZE);
 		if (rev_table == NULL) {
 			fprintf(stderr, "%s: Error when malloc for reverse table.\n", __func__);
-			goto OUT_3;
+			goto OUT_4;
 		}
 
-		for (i=0; i<=REV_TABLE_SIZE; i++)
+		for (i=0; i<REV_TABLE_SIZE; i++)
 			rev_table[i] = bit_reverse(i);
 	}
 
-	nbc_handle = nand_bch_init(nand);
-	if (nbc_handle == NULL) {
-		fprintf(stderr, "%s: Error when get nbc handle.\n", __func__);
-		goto OUT_4;
+	/* pages are built in the usual layout, then laid out in another buffer */
+	for (seg=segs; (seg<segs+nsegs) && !buf_raw; seg++) {
+		if (!seg->nbc->layout->identity) {
+			buf_raw = malloc(npages*raw_size);
+			if (buf_raw == NULL) {
+				fprintf(stderr, "%s: Error when malloc raw page buffer.\n", __func__);
+				goto OUT_5;
+			}
+		}
 	}
 
-	while (1) {
-		if (flag & FLAG_HEADER) {
-			flag &= ~FLAG_HEADER;
-			for (i=0; i<REPEAT_TIMES; i++)
-				((unsigned int *)buf_page)[i] = nand->boot_header;
-
-			ret = read(fd_in, buf_page + REPEAT_TIMES*sizeof(unsigned int),
-									nand->page_size - REPEAT_TIMES*sizeof(unsigned int));
-			if (ret > 0)
-				ret += REPEAT_TIMES*sizeof(unsigned int);
-		} else
-			ret = read(fd_in, buf_page, nand->page_size);
-
-		if (ret < 0) { // Error occur
-			fprintf(stderr, "%s: Error when read %s.\n", __func__, file_in);
-			perror("read()");
-			ret = -1;
-			break;
-		} else if (ret == 0) // End of file
-			break;
+	if (opts && opts->bad_blocks) {
+		bad = nand_bad_blocks_init(opts->bad_blocks, nand);
+		if (bad == NULL)
+			goto OUT_5;
+	}
 
-		if (ret < nand->page_size) { // Padding 0xff, page size aligned
-			memset(buf_page + ret, 0xff, nand->page_size - ret);
-		}
+	if (opts && opts->previous_in && opts->previous_out &&
+	    nand_previous_open(nand, &prev, opts, flag, bad))
+		goto OUT_5;
 
-		if (flag & FLAG_PMECC) { // PMECC uses inverted bit order
-			for (i=0; i<nand->page_size; i++)
-				buf_page[i] = rev_table[buf_page[i]&0xff];
-		}
+	if (opts && opts->digest) {
+		nand_digest_init(&digest_ctx, 1);
+		digest = &digest_ctx;
+	}
+
+	if (opts && opts->self_check) {
+		verify = nand_verify_init(nsegs, raw_size, npages, NAND_VERIFY_SLOTS);
+		if (verify == NULL)
+			goto OUT_5;
+		for (i=0; i<nsegs; i++)
+			if (nand_verify_code_init(verify, i, &segs[i].nand, segs[i].nbc))
+				goto OUT_5;
+		nand_verify_start(verify);
+	}
 
-		memset(buf_spare, 0xff, nand->spare_size);
-		if (flag & FLAG_YAFFS) { // For YAFFS image, read free region data from input file
-			ret = read(fd_in, buf_spare + nand->free_offset, nand->ecc_offset - nand->free_offset);
-			if (ret != (nand->ecc_offset - nand->free_offset)) {
-				fprintf(stderr, "%s: Error read free region from %s.\n", __func__, file_in);
-				perror("read()");
-				ret = -1;
+	nand_stats_lap(&stats, &stats.init);
+	seg = segs;
+	while (1) {
+		/* chunks do not cross segments */
+		while (page_no >= seg->end)
+			seg++;
+		chip = &seg->nand;
+		chunk = seg->npages;
+		if (seg->end - page_no < chunk)
+			chunk = seg->end - page_no;
+
+		for (n=0; n<chunk; n++) {
+			ret = nand_read_page(chip, fd_in, file_in, buf_chunk + n*raw_size, &flag, &stats);
+			if (ret <= 0)
 				break;
+			changed[n] = PAGE_CHANGED;
+			if ((prev.fd_in >= 0) && !nand_previous_changed(chip, &prev, opts->previous_in,
+			                                                buf_chunk + n*raw_size, page_no + n, &stats))
+				changed[n] = PAGE_UNCHANGED;
+		}
+		nand_stats_lap(&stats, &stats.read);
+		if ((ret < 0) || (n == 0))
+			break;
+
+		nand_scramble_chunk(seg, buf_chunk, changed, n, page_no, flag, rev_table, &stats);
+
+		/* write runs of changed pages, copy runs of unchanged ones */
+		for (p=0; p<n; p=q) {
+			for (q=p+1; (q<n) && (!changed[q] == !changed[p]); q++)
+				;
+
+			if (!changed[p]) {
+				ret = nand_write_pages(fd_out, NULL, page_no + p, q - p, raw_size, bad, &prev,
+				                       buf_chunk, npages*raw_size, digest, &stats);
+				nand_stats_lap(&stats, &stats.write);
+				if (ret < 0) {
+					fprintf(stderr, "%s: Error when copy %s.\n", __func__, opts->previous_out);
+					perror(NULL);
+					break;
+				}
+				continue;
+			}
+
+			buf_out = nand_encode_run(seg, buf_chunk + p*raw_size, changed + p, q - p, flag,
+			                          rev_table, buf_raw, &stats);
+
+			/* checked as laid out, before bad block markers overwrite codes */
+			if (verify) {
+				ret = nand_verify_submit(verify, seg - segs, buf_out, page_no + p, q - p, flag);
+				stats.verify.bytes += (q - p)*raw_size;
+				nand_stats_lap(&stats, &stats.verify);
+				if (ret < 0) {
+					fprintf(stderr, "%s: Error self-check of %s, ECC code of page %lu does not match.\n",
+					        __func__, file_out, verify->bad_page);
+					break;
+				}
 			}
 
-			ret = lseek(fd_in, nand->spare_size - nand->ecc_offset + nand->free_offset, SEEK_CUR);
+			if (bad)
+				nand_bad_blocks_mark(bad, buf_out, page_no + p, q - p);
+
+			ret = nand_write_pages(fd_out, buf_out, page_no + p, q - p, raw_size, bad, &prev,
+			                       NULL, 0, digest, &stats);
+			nand_stats_lap(&stats, &stats.write);
 			if (ret < 0) {
-				fprintf(stderr, "%s: Error lseek in %s.\n", __func__, file_in);
-				perror("lseek()");
-				ret = -1;
+				fprintf(stderr, "%s: Error when write %s.\n", __func__, file_out);
+				perror("write()");
 				break;
 			}
 		}
+		if (ret < 0)
+			break;
+		page_no += n;
 
-		for (i=0; i<nand->page_size/nand->ecc_sector; i++) // Generate ECC codes for every sector
-			nand_bch_calculate_ecc(nbc_handle, buf_page+i*nand->ecc_sector,
-															nand->ecc_sector, buf_spare + nand->ecc_offset + i*nand->ecc_bytes,
-															flag & FLAG_NO_MASK);
+		if (n < chunk) { // End of file
+			ret = 0;
+			break;
+		}
+	}
 
-		if (flag & FLAG_PMECC) {
-			for (i=0; i<nand->page_size; i++) // Recovery the bit order for data area
-				buf_page[i] = rev_table[buf_page[i]&0xff];
+	if (prev.fd_in >= 0)
+		fprintf(stderr, "Reused %ld of %ld pages from %s.\n", prev.reused, page_no, opts->previous_out);
 
-			for (i=nand->ecc_offset; i<nand->spare_size; i++) // Store ECC codes follow PMECC bit order
-				buf_spare[i] = rev_table[buf_spare[i]&0xff];
-		}
+	if (verify && !ret) {
+		ret = nand_verify_finish(verify);
+		nand_stats_lap(&stats, &stats.verify);
+		if (ret < 0)
+			fprintf(stderr, "%s: Error self-check of %s, ECC code of page %lu does not match.\n",
+			        __func__, file_out, verify->bad_page);
+		else
+			fprintf(stderr, "Self-check: %lu pages, %lu sectors verified.\n", verify->pages,
+			        verify->sectors);
+	}
 
-		ret = write(fd_out, buf_page, nand->page_size + nand->spare_size);
-		if (ret != (nand->page_size + nand->spare_size)) {
-			fprintf(stderr, "%s: Error when write %s.\n", __func__, file_out);
-			perror("write()");
-			ret = -1;
-			break;
+	if (digest && !ret)
+		nand_digest_final(digest, opts->digest);
+
+	if (bad) {
+		/* marked erased pages written in place of the bad blocks */
+		stats.write.bytes += (unsigned long long)bad->skipped*bad->block_pages*raw_size;
+		stats.syscalls += bad->skipped*bad->block_pages;
+		fprintf(stderr, "Bad blocks: %d listed, %lu skipped.\n", bad->count, bad->skipped);
+	}
+
+	if (stats.enabled) {
+		stats.pages = page_no;
+		stats.dedup = segs[0].nbc->dedup != NULL;
+		for (seg=segs; stats.dedup && (seg<segs+nsegs); seg++) {
+			stats.hits += seg->nbc->dedup->hits;
+			stats.misses += seg->nbc->dedup->misses;
+			stats.erased_sectors += seg->nbc->erased;
 		}
+		nand_stats_print(&stats, opts->stats);
 	}
-	
-	nand_bch_free(nbc_handle);
 
-OUT_4:
+OUT_5:
+	nand_verify_free(verify);
+	nand_previous_close(&prev);
+	nand_bad_blocks_free(bad);
+	free(buf_raw);
 	if (flag | FLAG_PMECC)
 		free(rev_table);
+OUT_4:
+	free(buf_chunk);
 OUT_3:
-	free(buf_page);
+	nand_segments_free(segs, nsegs);
 OUT_2:
 	close(fd_out);
 OUT_1:
 	close(fd_in);
 	return ret;
 }
+
+/*
+ * apply one patch to the sectors it covers, updating their ECC codes from
+ * the difference between old and new data
+ */
+static int nand_patch_apply(const struct nand_segment *segs, const struct nand_bad_blocks *bad,
+                            int fd, const struct nandbch_patch *patch, unsigned int flag,
+                            const unsigned char *rev_table, unsigned char *buf, int buf_sector)
+{
+	int i, first, len;
+	unsigned long addr = patch->offset, end = patch->offset + patch->len;
+	unsigned long page, col;
+	off_t page_pos;
+	int ecc_pos;
+	const int raw_size = segs->nand.page_size + segs->nand.spare_size;
+	const struct nand_segment *seg;
+	const struct nand_chip *nand;
+	struct nand_bch_control *nbc;
+	unsigned char *delta = buf, *stored = buf + buf_sector, *code = stored + buf_sector, *ecc;
+	const unsigned char *src = patch->data, *data, *ks;
+
+	while (addr < end) {
+		page = addr / segs->nand.page_size;
+		for (seg=segs; page >= seg->end; seg++)
+			;
+		nand = &seg->nand;
+		nbc = seg->nbc;
+		ecc = code + nand->ecc_bytes;
+		col  = addr % nand->page_size;
+		col -= col % nand->ecc_sector; // sector start in page
+		first = addr % nand->ecc_sector;
+		len = nand->ecc_sector - first;
+		if (len > end - addr)
+			len = end - addr;
+
+		/* data and ecc offsets in the built page, placed by the layout */
+		page_pos = (off_t)(bad ? nand_bad_blocks_phys(bad, page) : page)*raw_size;
+		ecc_pos = nand->page_size + nand->ecc_offset + (col/nand->ecc_sector)*nand->ecc_bytes;
+
+		if (nand_layout_pread(nbc->layout, fd, page_pos, col + first, len, delta + first) ||
+		    nand_layout_pread(nbc->layout, fd, page_pos, ecc_pos, nand->ecc_bytes, ecc)) {
+			fprintf(stderr, "%s: Error patch at 0x%lx is out of image.\n", __func__, addr);
+			return -1;
+		}
+
+		/* new data as stored, scrambled by the keystream of the page */
+		data = src;
+		if (nbc->randomizer) {
+			ks = nand_randomizer_keystream(nbc->randomizer, page) + col;
+			for (i=first; i<first+len; i++)
+				stored[i - first] = src[i - first] ^ ks[i];
+			data = stored;
+		}
+
+		/* ecc(old ^ delta) = ecc(old) ^ ecc(delta), with the mask or not */
+		memset(delta, 0, first);
+		memset(delta + first + len, 0, nand->ecc_sector - first - len);
+		for (i=first; i<first+len; i++) {
+			delta[i] ^= data[i - first];
+			if (flag & FLAG_PMECC) // PMECC uses inverted bit order
+				delta[i] = rev_table[delta[i]];
+		}
+
+		if (nbc->ecc_mode == NAND_ECC_BCH) {
+			/* leading zero bytes do not change the code, start from the first change */
+			nand_bch_calculate_ecc(nbc, delta + first, nand->ecc_sector - first, code, 1);
+		} else {
+			/* Hamming codes depend on byte positions, and ecc(0) is all 0xff */
+			nand_bch_calculate_ecc(nbc, delta, nand->ecc_sector, code, 1);
+			for (i=0; i<nand->ecc_bytes; i++)
+				code[i] ^= 0xff;
+		}
+		for (i=0; i<nand->ecc_bytes; i++) {
+			if (flag & FLAG_PMECC) // Store ECC codes follow PMECC bit order
+				ecc[i] ^= rev_table[code[i]];
+			else
+				ecc[i] ^= code[i];
+		}
+
+		if (nand_layout_pwrite(nbc->layout, fd, page_pos, col + first, len, data) ||
+		    nand_layout_pwrite(nbc->layout, fd, page_pos, ecc_pos, nand->ecc_bytes, ecc)) {
+			fprintf(stderr, "%s: Error when write patch at 0x%lx: ", __func__, addr);
+			perror(NULL);
+			return -1;
+		}
+
+		addr += len;
+		src += len;
+	}
+
+	return 0;
+}
+
+/**
+ * nandbch_patch - patch data of an image generated by nandbch(), in place
+ * @nand:     NAND Flash parameters the image was generated with
+ * @file:     image file, with OOB data
+ * @flag:     FLAG_PMECC if the image uses PMECC format, other flags are ignored
+ * @patches:  patches to apply, in order
+ * @count:    number of patches
+ * @opts:     optional settings, or NULL
+ *
+ * Patch offsets are addresses in the NAND data area, i.e. page*page_size+column,
+ * not offsets in the image file. Since BCH and Hamming codes are linear (the
+ * latter up to its inversion), only the patched bytes and the ECC codes of
+ * their sectors are rewritten, from the difference between old and new data.
+ * The randomizer and skipped bad blocks of @opts, if any, must be the ones
+ * the image was generated with.
+ */
+int nandbch_patch(struct nand_chip *nand, const char *file, unsigned int flag,
+                  const struct nandbch_patch *patches, int count,
+                  const struct nandbch_options *opts)
+{
+	int ret = -1;
+	int i, fd, nsegs = 0, buf_sector = 0, buf_bytes = 0;
+	unsigned char *buf = NULL;
+	unsigned char *rev_table = NULL;
+	struct nand_segment *segs = NULL;
+	struct nand_bad_blocks *bad = NULL;
+
+	if ((nand == NULL) || (file == NULL) || (patches == NULL))
+		return ret;
+
+	fd = open(file, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "%s: Error when open image file %s: ", __func__, file);
+		perror(NULL);
+		return ret;
+	}
+
+	segs = nand_segments_init(nand, flag & FLAG_HUGE_PAGES, opts, &nsegs);
+	if (segs == NULL) {
+		fprintf(stderr, "%s: Error when get nbc handle.\n", __func__);
+		goto OUT_1;
+	}
+
+	/* an erased page left unscrambled would need all its data rewritten */
+	if (segs->nbc->randomizer && segs->nbc->randomizer->keep_erased) {
+		fprintf(stderr, "%s: Error patch of images with unscrambled erased pages.\n", __func__);
+		goto OUT_2;
+	}
+
+	/* sector buffers sized for the largest ECC scheme of the segments */
+	for (i=0; i<nsegs; i++) {
+		buf_sector = (segs[i].nand.ecc_sector > buf_sector) ? segs[i].nand.ecc_sector : buf_sector;
+		buf_bytes = (segs[i].nand.ecc_bytes > buf_bytes) ? segs[i].nand.ecc_bytes : buf_bytes;
+	}
+	buf = malloc(2*buf_sector + 2*buf_bytes);
+	if (buf == NULL) {
+		fprintf(stderr, "%s: Error when malloc sector buffer.\n", __func__);
+		goto OUT_2;
+	}
+
+	if (flag & FLAG_PMECC) {
+		rev_table = malloc(REV_TABLE_SIZE);
+		if (rev_table == NULL) {
+			fprintf(stderr, "%s: Error when malloc for reverse table.\n", __func__);
+			goto OUT_3;
+		}
+
+		for (i=0; i<REV_TABLE_SIZE; i++)
+			rev_table[i] = bit_reverse(i);
+	}
+
+	if (opts && opts->bad_blocks) {
+		bad = nand_bad_blocks_init(opts->bad_blocks, nand);
+		if (bad == NULL)
+			goto OUT_4;
+	}
+
+	for (i=0, ret=0; (i<count) && !ret; i++)
+		ret = nand_patch_apply(segs, bad, fd, &patches[i], flag, rev_table, buf, buf_sector);
+
+	nand_bad_blocks_free(bad);
+OUT_4:
+	free(rev_table);
+OUT_3:
+	free(buf);
+OUT_2:
+	nand_segments_free(segs, nsegs);
+OUT_1:
+	close(fd);
+	return ret;
+}
+
+/*
+ * segments of @segs, with control structures of their own for a worker
+ */
+static struct nand_segment *nand_segments_share(const struct nand_segment *segs, int count)
+{
+	struct nand_segment *share;
+	int i;
+
+	share = calloc(count, sizeof(*share));
+	if (share == NULL)
+		return NULL;
+
+	for (i=0; i<count; i++) {
+		share[i] = segs[i];
+		share[i].nbc = nand_bch_share(segs[i].nbc, &segs[i].nand);
+		if (share[i].nbc == NULL) {
+			nand_segments_free(share, count);
+			return NULL;
+		}
+	}
+
+	return share;
+}
+
+/*
+ * read the data area of page @page_no of an input, and its free OOB region
+ * for YAFFS images, as nand_read_page() would in turn; returns the number of
+ * data bytes read, or -1 on error
+ */
+static int nand_pread_page(const struct nand_chip *nand, int fd_in, unsigned long page_no,
+                           unsigned char *buf_page, unsigned int flag)
+{
+	const off_t header = (flag & FLAG_HEADER) ? REPEAT_TIMES*sizeof(unsigned int) : 0;
+	const off_t stride = nand->page_size + ((flag & FLAG_YAFFS) ? nand->spare_size : 0);
+	const int free_len = nand->ecc_offset - nand->free_offset;
+	off_t pos = (off_t)page_no*stride - header; // the boot header comes before the input
+	unsigned char *buf_spare = buf_page + nand->page_size;
+	int i, skip = 0;
+	ssize_t ret;
+
+	if (pos < 0) {
+		for (i=0; i<REPEAT_TIMES; i++)
+			((unsigned int *)buf_page)[i] = nand->boot_header;
+		skip = header;
+	}
+
+	ret = pread(fd_in, buf_page + skip, nand->page_size - skip, pos + skip);
+	if (ret < 0)
+		return -1;
+	if (ret < nand->page_size - skip) // Padding 0xff, page size aligned
+		memset(buf_page + skip + ret, 0xff, nand->page_size - skip - ret);
+
+	memset(buf_spare, 0xff, nand->spare_size);
+	if ((flag & FLAG_YAFFS) &&
+	    (pread(fd_in, buf_spare + nand->free_offset, free_len, pos + nand->page_size) != free_len))
+		return -1;
+
+	return skip + ret;
+}
+
+#define NAND_BATCH_PAGES  64 /* pages per task */
+#define NAND_BATCH_PARKED 2  /* buffers per worker for tasks hashed later */
+
+/*
+ * an image of a batch, cut into tasks of NAND_BATCH_PAGES pages
+ */
+struct nand_batch_image {
+	const struct nandbch_job *job;
+	int           fd_in;  /* shared by the tasks of the image, pread() only */
+	int           fd_out; /* same with pwrite(), and pread() of tasks to digest */
+	unsigned int  flag;
+	unsigned long pages;
+	unsigned long first_task;
+	unsigned long tasks;
+	unsigned long next_task; /* next task to hash, under the batch lock */
+	struct nand_digest_ctx digest; /* size and SHA-256 */
+};
+
+/*
+ * buffers and control structures of a worker
+ */
+struct nand_batch_worker {
+	struct nand_segment *segs;
+	unsigned char       *buf;
+	unsigned char       *buf_raw;
+	unsigned char       *changed;
+	unsigned char       *scratch;  /* self-check buffer */
+	unsigned long       verified; /* sectors self-checked */
+	struct nand_stats   stats;
+};
+
+struct nand_batch {
+	struct nand_segment      *segs;
+	int                      nsegs;
+	struct nand_batch_image  *images;
+	int                      count;
+	struct nand_batch_worker *workers;
+	const unsigned char      *rev_table;
+	int                      raw_size;
+	struct nand_verify       *verify; /* self-check on the workers, or NULL */
+
+	/* with digests, the CRC32C of each task, and its output until hashed */
+	unsigned int             *crcs;
+	pthread_mutex_t          lock;
+	pthread_cond_t           cond;    /* a cursor moved or a buffer came back */
+	unsigned char            **parked; /* output of a task done ahead, or NULL */
+	unsigned char            **free;   /* parking buffers not in use */
+	int                      nfree;
+	int                      failed;
+};
+
+/* bytes of task @t of @image */
+static size_t nand_batch_task_size(const struct nand_batch *batch,
+                                   const struct nand_batch_image *image, unsigned long t)
+{
+	unsigned long n = image->pages - t*NAND_BATCH_PAGES;
+
+	return (size_t)((n < NAND_BATCH_PAGES) ? n : NAND_BATCH_PAGES)*batch->raw_size;
+}
+
+/*
+ * stop the tasks waiting in nand_batch_digest(), a task failed
+ */
+static void nand_batch_fail(struct nand_batch *batch)
+{
+	if (batch->crcs == NULL)
+		return;
+	pthread_mutex_lock(&batch->lock);
+	batch->failed = 1;
+	pthread_cond_broadcast(&batch->cond);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+/*
+ * hash the output of task @t of @image in page order: the worker holding the
+ * next task of the image hashes it and the tasks parked after it, the others
+ * park a copy of their output, and wait for a parking buffer when every one
+ * is taken
+ */
+static int nand_batch_digest(struct nand_batch *batch, struct nand_batch_image *image,
+                             unsigned long t, const unsigned char *buf)
+{
+	unsigned char *parked = NULL;
+	size_t len = nand_batch_task_size(batch, image, t);
+	int failed;
+
+	pthread_mutex_lock(&batch->lock);
+	while ((t != image->next_task) && !batch->failed) {
+		if (parked) {
+			batch->parked[image->first_task + t] = parked;
+			pthread_mutex_unlock(&batch->lock);
+			return 0;
+		}
+		if (!batch->nfree) {
+			pthread_cond_wait(&batch->cond, &batch->lock);
+			continue;
+		}
+		/* the cursor may reach the task during the copy */
+		parked = batch->free[--batch->nfree];
+		pthread_mutex_unlock(&batch->lock);
+		memcpy(parked, buf, len);
+		pthread_mutex_lock(&batch->lock);
+	}
+	if (parked) {
+		batch->free[batch->nfree++] = parked;
+		parked = NULL;
+	}
+	failed = batch->failed;
+	pthread_mutex_unlock(&batch->lock);
+	if (failed)
+		return -1;
+
+	while (1) {
+		nand_digest_update_sha256(&image->digest, buf, len);
+
+		pthread_mutex_lock(&batch->lock);
+		if (parked)
+			batch->free[batch->nfree++] = parked;
+		t = ++image->next_task;
+		pthread_cond_broadcast(&batch->cond);
+		parked = (t < image->tasks) ? batch->parked[image->first_task + t] : NULL;
+		if (parked == NULL) {
+			pthread_mutex_unlock(&batch->lock);
+			return 0;
+		}
+		batch->parked[image->first_task + t] = NULL;
+		pthread_mutex_unlock(&batch->lock);
+
+		buf = parked;
+		len = nand_batch_task_size(batch, image, t);
+	}
+}
+
+/*
+ * build the raw pages of one task of a batch: read its input pages, encode
+ * them chunk by chunk as nandbch() does, and write them in place
+ */
+static int nand_batch_task(void *arg, unsigned long task, int worker)
+{
+	struct nand_batch *batch = arg;
+	struct nand_batch_worker *w = &batch->workers[worker];
+	struct nand_batch_image *image;
+	const struct nand_segment *seg;
+	const int raw_size = batch->raw_size;
+	unsigned long page_no;
+	int lo = 0, hi = batch->count - 1, mid;
+	int n, j, k;
+	unsigned char *buf_out;
+	unsigned long bad_page;
+	long verified;
+
+	/* last image starting at or before the task */
+	while (lo < hi) {
+		mid = (lo + hi + 1)/2;
+		if (batch->images[mid].first_task <= task)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	image = &batch->images[lo];
+	page_no = (task - image->first_task)*NAND_BATCH_PAGES;
+	n = (image->pages - page_no < NAND_BATCH_PAGES) ? image->pages - page_no : NAND_BATCH_PAGES;
+
+	/* chunks do not cross segments, nor exceed the bit-sliced encoder lanes */
+	for (j=0, seg=w->segs; j<n; j=k) {
+		while (page_no + j >= seg->end)
+			seg++;
+		k = j + seg->npages;
+		if (k > n)
+			k = n;
+		if (k - j > seg->end - page_no - j)
+			k = j + seg->end - page_no - j;
+
+		for (mid=j; mid<k; mid++) {
+			if (nand_pread_page(&seg->nand, image->fd_in, page_no + mid, w->buf + mid*raw_size,
+			                    image->flag) < 0) {
+				fprintf(stderr, "%s: Error when read page %lu of %s.\n", __func__,
+				        page_no + mid, image->job->file_in);
+				goto FAIL;
+			}
+			w->changed[mid] = PAGE_CHANGED;
+		}
+		w->stats.read.bytes += (k - j)*seg->nand.page_size;
+
+		nand_scramble_chunk(seg, w->buf + j*raw_size, w->changed + j, k - j, page_no + j,
+		                    image->flag, batch->rev_table, &w->stats);
+		buf_out = nand_encode_run(seg, w->buf + j*raw_size, w->changed + j, k - j, image->flag,
+		                          batch->rev_table, w->buf_raw ? w->buf_raw + j*raw_size : NULL,
+		                          &w->stats);
+
+		if (batch->verify) {
+			verified = nand_verify_pages(batch->verify, seg - w->segs, buf_out, page_no + j, k - j,
+			                             image->flag, w->scratch, &bad_page);
+			if (verified < 0) {
+				fprintf(stderr, "%s: Error self-check of %s, ECC code of page %lu does not match.\n",
+				        __func__, image->job->file_out, bad_page);
+				goto FAIL;
+			}
+			w->verified += verified;
+		}
+	}
+
+	buf_out = w->buf_raw ? w->buf_raw : w->buf;
+	if (pwrite(image->fd_out, buf_out, (size_t)n*raw_size, (off_t)page_no*raw_size) !=
+	    (ssize_t)n*raw_size) {
+		fprintf(stderr, "%s: Error when write %s: ", __func__, image->job->file_out);
+		perror(NULL);
+		goto FAIL;
+	}
+	w->stats.write.bytes += (size_t)n*raw_size;
+	if (batch->crcs) {
+		batch->crcs[task] = nand_crc32c(0, buf_out, (size_t)n*raw_size);
+		if (nand_batch_digest(batch, image, task - image->first_task, buf_out))
+			return -1;
+	}
+	return 0;
+
+FAIL:
+	nand_batch_fail(batch);
+	return -1;
+}
+
+/**
+ * nandbch_batch - generate many images for the same chip in one pool of threads
+ * @nand:     NAND Flash parameters
+ * @jobs:     input and output files, and flags of each image
+ * @count:    number of images
+ * @flag:     flags of every image, FLAG_HUGE_PAGES and FLAG_BITSLICE included
+ * @opts:     optional settings, or NULL; --previous, the sector cache, bad
+ *            blocks and stats are not supported in a batch
+ * @workers:  number of threads
+ *
+ * The control structures of the chip are built once, and every worker only
+ * gets its own encoder buffers. The pages of all images are cut into tasks
+ * of NAND_BATCH_PAGES pages, read and written in place, and spread over the
+ * workers, which steal tasks from each other, so that big and small images
+ * even out. Images are the same as with nandbch(). Every input and output
+ * stays open for the whole batch, two file descriptors per image.
+ *
+ * With @opts->digest, an array of @count digests, the CRC32C of each task is
+ * taken by its worker and they are combined in order at the end, while the
+ * SHA-256 of each image is taken in page order as its tasks are done, see
+ * nand_batch_digest(); a task done too far ahead of its turn waits for one of
+ * the few parking buffers of each worker, the output is never read back.
+ */
+int nandbch_batch(struct nand_chip *nand, const struct nandbch_job *jobs, int count,
+                  unsigned int flag, const struct nandbch_options *opts, int workers)
+{
+	struct nand_batch batch = { 0 };
+	struct work_pool_stats pool_stats;
+	unsigned int *crcs = NULL;
+	unsigned char *rev_table = NULL;
+	unsigned long tasks = 0, pages = 0, t;
+	struct stat st;
+	off_t stride, total;
+	int i, npages = 0, layout = 0, ret = -1;
+
+	if ((nand == NULL) || (jobs == NULL) || (workers < 1))
+		return ret;
+
+	if (opts && (opts->previous_in || opts->dedup_entries || opts->bad_blocks || opts->stats)) {
+		fprintf(stderr, "%s: Error previous run, sector cache, bad blocks or stats in a batch.\n",
+		        __func__);
+		return ret;
+	}
+
+	batch.raw_size = nand->page_size + nand->spare_size;
+	batch.count = count;
+	batch.images = calloc(count, sizeof(*batch.images));
+	batch.workers = calloc(workers, sizeof(*batch.workers));
+	rev_table = malloc(REV_TABLE_SIZE);
+	if (!batch.images || !batch.workers || !rev_table) {
+		fprintf(stderr, "%s: Error when malloc batch.\n", __func__);
+		goto OUT_1;
+	}
+	for (i=0; i<REV_TABLE_SIZE; i++)
+		rev_table[i] = bit_reverse(i);
+	batch.rev_table = rev_table;
+	for (i=0; i<count; i++)
+		batch.images[i].fd_in = batch.images[i].fd_out = -1;
+
+	/* every output is created empty, then written by tasks in place */
+	for (i=0; i<count; i++) {
+		batch.images[i].job = &jobs[i];
+		batch.images[i].flag = (flag | jobs[i].flag) & ~(FLAG_HUGE_PAGES|FLAG_BITSLICE);
+		batch.images[i].fd_in = open(jobs[i].file_in, O_RDONLY);
+		if ((batch.images[i].fd_in < 0) || (fstat(batch.images[i].fd_in, &st) < 0)) {
+			fprintf(stderr, "%s: Error when open input file %s: ", __func__, jobs[i].file_in);
+			perror(NULL);
+			goto OUT_1;
+		}
+		batch.images[i].fd_out = open(jobs[i].file_out, O_RDWR|O_CREAT|O_TRUNC,
+		                              S_IRWXU|S_IRUSR|S_IXUSR|S_IROTH|S_IXOTH);
+		if (batch.images[i].fd_out < 0) {
+			fprintf(stderr, "%s: Error when create output file %s: ", __func__, jobs[i].file_out);
+			perror(NULL);
+			goto OUT_1;
+		}
+
+		/* input pages, after the boot header, with their OOB data for YAFFS */
+		stride = nand->page_size + ((batch.images[i].flag & FLAG_YAFFS) ? nand->spare_size : 0);
+		total = st.st_size;
+		if (total && (batch.images[i].flag & FLAG_HEADER))
+			total += REPEAT_TIMES*sizeof(unsigned int);
+		batch.images[i].pages = DIV_ROUND_UP(total, stride);
+		batch.images[i].first_task = tasks;
+		batch.images[i].tasks = DIV_ROUND_UP(batch.images[i].pages, NAND_BATCH_PAGES);
+		tasks += batch.images[i].tasks;
+		pages += batch.images[i].pages;
+	}
+
+	batch.segs = nand_segments_init(nand, flag, opts, &batch.nsegs);
+	if (batch.segs == NULL) {
+		fprintf(stderr, "%s: Error when get nbc handle.\n", __func__);
+		goto OUT_1;
+	}
+	for (i=0; i<batch.nsegs; i++) {
+		npages = (batch.segs[i].npages > npages) ? batch.segs[i].npages : npages;
+		layout |= !batch.segs[i].nbc->layout->identity;
+	}
+
+	for (i=0; i<workers; i++) {
+		struct nand_batch_worker *w = &batch.workers[i];
+
+		w->segs = nand_segments_share(batch.segs, batch.nsegs);
+		w->buf = malloc(NAND_BATCH_PAGES*(batch.raw_size + 1));
+		if (layout)
+			w->buf_raw = malloc(NAND_BATCH_PAGES*batch.raw_size);
+		if (opts && opts->self_check)
+			w->scratch = malloc(NAND_VERIFY_SCRATCH(batch.raw_size));
+		if (!w->segs || !w->buf || (layout && !w->buf_raw) ||
+		    (opts && opts->self_check && !w->scratch)) {
+			fprintf(stderr, "%s: Error when init worker %d.\n", __func__, i);
+			goto OUT_2;
+		}
+		w->changed = w->buf + NAND_BATCH_PAGES*batch.raw_size;
+	}
+
+	/* the workers check their own pages, on every core already */
+	if (opts && opts->self_check) {
+		batch.verify = nand_verify_init(batch.nsegs, batch.raw_size, 0, 0);
+		if (batch.verify == NULL)
+			goto OUT_2;
+		for (i=0; i<batch.nsegs; i++)
+			if (nand_verify_code_init(batch.verify, i, &batch.segs[i].nand, batch.segs[i].nbc))
+				goto OUT_2;
+	}
+
+	if (opts && opts->digest) {
+		crcs = malloc(tasks*sizeof(*crcs) + 1);
+		batch.parked = calloc(tasks + 1, sizeof(*batch.parked));
+		batch.free = calloc(NAND_BATCH_PARKED*workers, sizeof(*batch.free));
+		if (!crcs || !batch.parked || !batch.free) {
+			fprintf(stderr, "%s: Error when malloc digests of %lu tasks.\n", __func__, tasks);
+			goto OUT_2;
+		}
+		for (batch.nfree=0; batch.nfree<NAND_BATCH_PARKED*workers; batch.nfree++) {
+			batch.free[batch.nfree] = malloc(NAND_BATCH_PAGES*batch.raw_size);
+			if (batch.free[batch.nfree] == NULL) {
+				fprintf(stderr, "%s: Error when malloc parking buffers.\n", __func__);
+				goto OUT_2;
+			}
+		}
+		for (i=0; i<count; i++)
+			nand_digest_init(&batch.images[i].digest, 1); // selects the CRC32C code too
+		pthread_mutex_init(&batch.lock, NULL);
+		pthread_cond_init(&batch.cond, NULL);
+		batch.crcs = crcs;
+	}
+
+	ret = work_pool_run(workers, tasks, nand_batch_task, &batch, &pool_stats);
+	fprintf(stderr, "Batch: %d images, %lu pages in %lu tasks, %d workers, %lu steals.\n",
+	        count, pages, pool_stats.tasks, workers, pool_stats.steals);
+	if (batch.verify && !ret) {
+		for (i=0, t=0; i<workers; i++)
+			t += batch.workers[i].verified;
+		fprintf(stderr, "Self-check: %lu pages, %lu sectors verified.\n", pages, t);
+	}
+
+	for (i=0; batch.crcs && !ret && (i<count); i++) {
+		struct nand_batch_image *image = &batch.images[i];
+		struct nand_digest *digest = &opts->digest[i];
+
+		nand_digest_final(&image->digest, digest);
+		digest->crc32c = 0;
+		for (t=0; t<image->tasks; t++)
+			digest->crc32c = nand_crc32c_combine(digest->crc32c, crcs[image->first_task + t],
+			                                     nand_batch_task_size(&batch, image, t));
+	}
+
+OUT_2:
+	for (i=0; i<workers; i++) {
+		nand_segments_free(batch.workers[i].segs, batch.nsegs);
+		free(batch.workers[i].buf);
+		free(batch.workers[i].buf_raw);
+		free(batch.workers[i].scratch);
+	}
+	nand_verify_free(batch.verify);
+	nand_segments_free(batch.segs, batch.nsegs);
+	if (batch.crcs) {
+		pthread_cond_destroy(&batch.cond);
+		pthread_mutex_destroy(&batch.lock);
+	}
+	for (t=0; batch.parked && (t<tasks); t++) // left by a failed batch
+		free(batch.parked[t]);
+	for (i=0; batch.free && (i<batch.nfree); i++)
+		free(batch.free[i]);
+	free(batch.free);
+	free(batch.parked);
+	free(crcs);
+OUT_1:
+	for (i=0; batch.images && (i<count); i++) {
+		if (batch.images[i].fd_in >= 0)
+			close(batch.images[i].fd_in);
+		if (batch.images[i].fd_out >= 0)
+			close(batch.images[i].fd_out);
+	}
+	free(rev_table);
+	free(batch.workers);
+	free(batch.images);
+	return ret;
+}
+
+/*
+ * splitmix64, the page sampler of nandbch_verify_sample()
+ */
+static u64 nand_sample_next(u64 *state)
+{
+	u64 z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/*
+ * Wilson score interval of @x events in @n trials, with 95% confidence;
+ * unlike the normal approximation, it holds for the few events of a good dump
+ */
+static void nand_sample_bounds(double x, double n, double *low, double *high)
+{
+	const double z = 1.959964;
+	double p, center, half;
+
+	*low = 0;
+	*high = 1;
+	if (n <= 0)
+		return;
+
+	p = x/n;
+	center = (p + z*z/(2*n))/(1 + z*z/n);
+	half = z*sqrt(p*(1 - p)/n + z*z/(4*n*n))/(1 + z*z/n);
+	if ((x > 0) && (center - half > 0))
+		*low = center - half;
+	if (center + half < 1)
+		*high = center + half;
+}
+
+/*
+ * what decoding pages read back from a chip found
+ */
+struct nand_decode_counts {
+	unsigned long sectors;
+	u64           bits;          /* bits of the correctable codewords */
+	unsigned long bitflips;
+	int           max_bitflips;  /* most bitflips of a sector */
+	unsigned long uncorrectable;
+	unsigned long bad_pages;     /* pages with an uncorrectable sector */
+	unsigned long first_bad;     /* first of them, if any */
+};
+
+/*
+ * decode and correct every sector of a raw page as read back, and add up its
+ * bitflips; @raw is changed, and @page is a built page buffer. Returns the
+ * built page, with the data area corrected, uncorrectable sectors left as
+ * read, in the stored bit order
+ */
+static unsigned char *nand_decode_page(const struct nand_segment *seg, unsigned char *raw,
+                                       unsigned char *page, unsigned long page_no,
+                                       unsigned int flag, const unsigned char *rev_table,
+                                       struct nand_decode_counts *counts)
+{
+	const struct nand_chip *nand = &seg->nand;
+	struct nand_bch_control *nbc = seg->nbc;
+	const int steps = nand->page_size/nand->ecc_sector;
+	const int ecc_start = nand->page_size + nand->ecc_offset;
+	const int ecc_end = nand->page_size + nand->spare_size;
+	unsigned char calc[NAND_HAMMING_BYTES], *data, *ecc;
+	const unsigned int *errloc;
+	int i, j, nerr, bad = 0;
+
+	if (!nbc->layout->identity) {
+		nand_layout_gather(nbc->layout, raw, page, 1);
+		raw = page;
+	}
+
+	/* back to the bit order of the code, for data and ecc alike */
+	for (j=0; (flag & FLAG_PMECC) && (j<nand->page_size); j++)
+		raw[j] = rev_table[raw[j]];
+	for (j=ecc_start; (flag & FLAG_PMECC) && (j<ecc_end); j++)
+		raw[j] = rev_table[raw[j]];
+
+	/* the sectors of a page are decoded side by side, with their error locators */
+	if (nbc->ecc_mode == NAND_ECC_BCH) {
+		for (i=0; i<steps; i++) {
+			ecc = raw + ecc_start + i*nand->ecc_bytes;
+			for (j=0; !(flag & FLAG_NO_MASK) && (j<nand->ecc_bytes); j++)
+				ecc[j] ^= nbc->eccmask[j];
+			nbc->dec_data[i] = raw + i*nand->ecc_sector;
+			nbc->dec_ecc[i] = ecc;
+		}
+		if (decode_bch_batch(nbc->bch, steps, nbc->dec_data, nand->ecc_sector, nbc->dec_ecc,
+		                     nbc->errloc, nbc->dec_nerr)) {
+			for (i=0; i<steps; i++)
+				nbc->dec_nerr[i] = -1;
+		}
+	}
+
+	for (i=0; i<steps; i++) {
+		data = raw + i*nand->ecc_sector;
+		ecc = raw + ecc_start + i*nand->ecc_bytes;
+
+		if (nbc->ecc_mode == NAND_ECC_BCH) {
+			errloc = nbc->errloc + i*nbc->bch->t;
+			nerr = nbc->dec_nerr[i];
+			for (j=0; j<nerr; j++) {
+				if (errloc[j] < 8*nand->ecc_sector)
+					data[errloc[j]/8] ^= 1 << (errloc[j] % 8);
+			}
+		} else {
+			nand_hamming_calculate(data, nand->ecc_sector, calc,
+			                       nbc->ecc_mode == NAND_ECC_HAMMING_SMC);
+			nerr = nand_hamming_correct(data, ecc, calc, nand->ecc_sector,
+			                            nbc->ecc_mode == NAND_ECC_HAMMING_SMC);
+		}
+
+		counts->sectors++;
+		if (nerr < 0) {
+			counts->uncorrectable++;
+			bad = 1;
+			continue;
+		}
+		counts->bits += 8*nand->ecc_sector +
+		                (nbc->bch ? nbc->bch->ecc_bits : 8*nand->ecc_bytes);
+		counts->bitflips += nerr;
+		if (nerr > counts->max_bitflips)
+			counts->max_bitflips = nerr;
+	}
+
+	if (bad && (!counts->bad_pages || (page_no < counts->first_bad)))
+		counts->first_bad = page_no;
+	counts->bad_pages += bad;
+
+	for (j=0; (flag & FLAG_PMECC) && (j<nand->page_size); j++)
+		raw[j] = rev_table[raw[j]];
+	return raw;
+}
+
+/**
+ * nandbch_verify_sample - estimate the bitflip rate of a dump from some pages
+ * @nand:     NAND Flash parameters the image was generated with
+ * @file:     raw dump of the chip, with OOB data
+ * @flag:     FLAG_PMECC and FLAG_NO_MASK as the image was generated with
+ * @opts:     optional settings, or NULL
+ * @sample:   pages to check, and output, the counts and their estimates
+ *
+ * Pages are picked by selection sampling with a seeded generator: each page
+ * is taken with the probability of the pages still wanted among the pages
+ * left, so that every set of pages is as likely, and they come in order of
+ * the dump. Only these pages are read, and every sector of them decoded.
+ * The bounds take bits, and pages, as independent trials; bitflips which
+ * cluster in some blocks make the true interval wider. The bad blocks of
+ * @opts, if any, are left out, and must be the ones the image was
+ * generated with.
+ *
+ * Returns 0 when the sample could be checked, whatever its bitflips, or -1.
+ */
+int nandbch_verify_sample(struct nand_chip *nand, const char *file, unsigned int flag,
+                          const struct nandbch_options *opts, struct nandbch_sample *sample)
+{
+	int ret = -1;
+	int i, fd, raw_size, nsegs = 0, is_bad = 0;
+	unsigned char *buf = NULL;
+	unsigned char *rev_table = NULL;
+	struct nand_segment *segs = NULL, *seg;
+	struct nand_bad_blocks *bad = NULL;
+	struct nand_decode_counts counts = {0};
+	unsigned long total, first, page, data_page, left, want;
+	struct stat st;
+	u64 state;
+
+	if ((nand == NULL) || (file == NULL) || (sample == NULL))
+		return ret;
+	raw_size = nand->page_size + nand->spare_size;
+
+	fd = open(file, O_RDONLY);
+	if ((fd < 0) || fstat(fd, &st)) {
+		fprintf(stderr, "%s: Error when open dump file %s: ", __func__, file);
+		perror(NULL);
+		goto OUT_1;
+	}
+	total = st.st_size/raw_size;
+
+	segs = nand_segments_init(nand, flag & FLAG_HUGE_PAGES, opts, &nsegs);
+	if (segs == NULL) {
+		fprintf(stderr, "%s: Error when get nbc handle.\n", __func__);
+		goto OUT_1;
+	}
+
+	buf = malloc(2*raw_size);
+	if (buf == NULL) {
+		fprintf(stderr, "%s: Error when malloc page buffer.\n", __func__);
+		goto OUT_2;
+	}
+
+	if (flag & FLAG_PMECC) {
+		rev_table = malloc(REV_TABLE_SIZE);
+		if (rev_table == NULL) {
+			fprintf(stderr, "%s: Error when malloc for reverse table.\n", __func__);
+			goto OUT_3;
+		}
+
+		for (i=0; i<REV_TABLE_SIZE; i++)
+			rev_table[i] = bit_reverse(i);
+	}
+
+	if (opts && opts->bad_blocks) {
+		bad = nand_bad_blocks_init(opts->bad_blocks, nand);
+		if (bad == NULL)
+			goto OUT_4;
+	}
+
+	/* pages of the dump, without the bad blocks in it */
+	sample->pages = total;
+	for (i=0; bad && (i<bad->count); i++) {
+		first = bad->blocks[i]*bad->block_pages;
+		if (first < total)
+			sample->pages -= (total - first < bad->block_pages) ? total - first : bad->block_pages;
+	}
+
+	want = sample->count;
+	if (!want) {
+		want = sample->fraction*sample->pages;
+		if (want < sample->fraction*sample->pages)
+			want++;
+	}
+	if (want > sample->pages)
+		want = sample->pages;
+
+	sample->sampled = 0;
+	/* scattered pages, no read-ahead of the pages between them */
+	if (want < sample->pages)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+
+	state = sample->seed;
+	left = sample->pages;
+	for (page=0, ret=0; (page<total) && want; page++) {
+		if (bad && !(page % bad->block_pages))
+			is_bad = nand_bad_blocks_is_bad(bad, page/bad->block_pages);
+		if (is_bad)
+			continue;
+
+		/* a 53-bit uniform number in [0, 1), against want/left */
+		if ((nand_sample_next(&state) >> 11)*(1.0/(1ULL << 53))*left-- >= want)
+			continue;
+		want--;
+
+		/* the segment of the data page, which skipped bad blocks shift */
+		data_page = bad ? nand_bad_blocks_data(bad, page) : page;
+		for (seg=segs; data_page >= seg->end; seg++)
+			;
+
+		if (pread(fd, buf, raw_size, (off_t)page*raw_size) != raw_size) {
+			fprintf(stderr, "%s: Error when read page %lu of %s.\n", __func__, page, file);
+			ret = -1;
+			break;
+		}
+		nand_decode_page(seg, buf, buf + raw_size, data_page, flag, rev_table, &counts);
+		sample->sampled++;
+	}
+
+	sample->sectors = counts.sectors;
+	sample->bits = counts.bits;
+	sample->bitflips = counts.bitflips;
+	sample->max_bitflips = counts.max_bitflips;
+	sample->uncorrectable = counts.uncorrectable;
+	sample->bad_pages = counts.bad_pages;
+
+	sample->rate = sample->bits ? (double)sample->bitflips/sample->bits : 0;
+	nand_sample_bounds(sample->bitflips, sample->bits, &sample->rate_low, &sample->rate_high);
+	nand_sample_bounds(sample->bad_pages, sample->sampled, &sample->bad_low, &sample->bad_high);
+
+	nand_bad_blocks_free(bad);
+OUT_4:
+	free(rev_table);
+OUT_3:
+	free(buf);
+OUT_2:
+	nand_segments_free(segs, nsegs);
+OUT_1:
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+#define NAND_EXTRACT_PAGES 64 /* raw pages per task */
+
+/*
+ * buffers, control structures and counts of an extraction worker
+ */
+struct nand_extract_worker {
+	struct nand_segment       *segs;
+	unsigned char             *raw;
+	unsigned char             *page;
+	unsigned char             *out;
+	struct nand_decode_counts counts;
+};
+
+struct nand_extract {
+	const struct nand_chip     *nand;
+	const struct nand_bad_blocks *bad;
+	int                        fd_in;
+	int                        fd_out;
+	unsigned int               flag;
+	unsigned long              total;  /* raw pages of the dump */
+	int                        nsegs;
+	const unsigned char        *rev_table;
+	struct nand_extract_worker *workers;
+};
+
+/*
+ * decode the raw pages of one task of an extraction, and write the records
+ * of its good pages, which follow each other in the output, in place
+ */
+static int nand_extract_task(void *arg, unsigned long task, int worker)
+{
+	struct nand_extract *ext = arg;
+	struct nand_extract_worker *w = &ext->workers[worker];
+	const struct nand_bad_blocks *bad = ext->bad;
+	const int raw_size = ext->nand->page_size + ext->nand->spare_size;
+	const int stride = ext->nand->page_size + ((ext->flag & FLAG_YAFFS) ? ext->nand->spare_size : 0);
+	const off_t header = (ext->flag & FLAG_HEADER) ? REPEAT_TIMES*sizeof(unsigned int) : 0;
+	const struct nand_segment *seg = w->segs;
+	const struct nand_chip *chip;
+	unsigned long first = task*NAND_EXTRACT_PAGES, page, data_page, data_first = 0;
+	unsigned char *built, *rec = w->out;
+	int p, npages, free_len;
+	off_t pos, skip = 0;
+
+	npages = (ext->total - first < NAND_EXTRACT_PAGES) ? ext->total - first : NAND_EXTRACT_PAGES;
+	if (pread(ext->fd_in, w->raw, (size_t)npages*raw_size, (off_t)first*raw_size) !=
+	    (ssize_t)npages*raw_size) {
+		fprintf(stderr, "%s: Error when read pages %lu to %lu.\n", __func__, first,
+		        first + npages - 1);
+		return -1;
+	}
+
+	for (p=0; p<npages; p++) {
+		page = first + p;
+		if (bad && nand_bad_blocks_is_bad(bad, page/bad->block_pages))
+			continue;
+		data_page = bad ? nand_bad_blocks_data(bad, page) : page;
+		if (rec == w->out)
+			data_first = data_page;
+		while (data_page >= seg->end)
+			seg++;
+		chip = &seg->nand;
+
+		built = nand_decode_page(seg, w->raw + p*raw_size, w->page, data_page, ext->flag,
+		                         ext->rev_table, &w->counts);
+		if (seg->nbc->randomizer)
+			nand_randomizer_apply(seg->nbc->randomizer, built, data_page);
+
+		/*
+		 * mkyaffs2image record: data, then the free region at the start of
+		 * the spare, none when ECC codes come first
+		 */
+		memcpy(rec, built, chip->page_size);
+		if (ext->flag & FLAG_YAFFS) {
+			free_len = chip->ecc_offset - chip->free_offset;
+			if (free_len < 0)
+				free_len = 0;
+			memcpy(rec + chip->page_size, built + chip->page_size + chip->free_offset, free_len);
+			memset(rec + chip->page_size + free_len, 0xff, chip->spare_size - free_len);
+		}
+		rec += stride;
+	}
+
+	/* the boot header comes before the input */
+	pos = (off_t)data_first*stride - header;
+	if (pos < 0) {
+		skip = -pos;
+		pos = 0;
+	}
+	if ((rec - w->out > skip) &&
+	    (pwrite(ext->fd_out, w->out + skip, rec - w->out - skip, pos) != rec - w->out - skip)) {
+		fprintf(stderr, "%s: Error when write pages %lu to %lu: ", __func__, first,
+		        first + npages - 1);
+		perror(NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * nandbch_extract - recover the input of nandbch() from a dump of a chip
+ * @nand:     NAND Flash parameters the image was generated with
+ * @file_in:  raw dump of the chip, with OOB data
+ * @file_out: output file
+ * @flag:     FLAG_PMECC and FLAG_NO_MASK as the image was generated with,
+ *            FLAG_YAFFS to write mkyaffs2image records of the data and the
+ *            free OOB region, not the data only, and FLAG_HEADER to leave
+ *            out the boot header
+ * @opts:     optional settings, or NULL
+ * @workers:  number of threads, the calling one included
+ *
+ * Every sector is decoded and corrected, and the data descrambled, in tasks
+ * of NAND_EXTRACT_PAGES pages read and written in place by a pool of
+ * workers, each with decoders of its own, so that dumps of any size go
+ * through small buffers. The randomizer and bad blocks of @opts, if any,
+ * must be the ones the image was generated with; skipped bad blocks are
+ * left out. The output is made of whole pages, the padding of the input
+ * of nandbch() included.
+ *
+ * Returns 0, 1 if some sectors could not be corrected, which are written as
+ * read, or -1 on error.
+ */
+int nandbch_extract(struct nand_chip *nand, const char *file_in, const char *file_out,
+                    unsigned int flag, const struct nandbch_options *opts, int workers)
+{
+	int ret = -1;
+	int i, raw_size;
+	unsigned char *rev_table = NULL;
+	struct nand_bad_blocks *bad = NULL;
+	struct nand_extract ext = {0};
+	struct nand_decode_counts *counts;
+	struct nand_decode_counts total = {0};
+	struct stat st;
+
+	if ((nand == NULL) || (file_in == NULL) || (file_out == NULL))
+		return ret;
+	raw_size = nand->page_size + nand->spare_size;
+	if (workers < 1)
+		workers = 1;
+
+	ext.nand = nand;
+	ext.flag = flag;
+	ext.fd_out = -1;
+	ext.fd_in = open(file_in, O_RDONLY);
+	if ((ext.fd_in < 0) || fstat(ext.fd_in, &st)) {
+		fprintf(stderr, "%s: Error when open dump file %s: ", __func__, file_in);
+		perror(NULL);
+		goto OUT_1;
+	}
+	ext.total = st.st_size/raw_size;
+
+	ext.fd_out = open(file_out, O_WRONLY|O_CREAT|O_TRUNC, S_IRWXU|S_IRUSR|S_IXUSR|S_IROTH|S_IXOTH);
+	if (ext.fd_out < 0) {
+		fprintf(stderr, "%s: Error when open output file %s: ", __func__, file_out);
+		perror(NULL);
+		goto OUT_1;
+	}
+
+	if (flag & FLAG_PMECC) {
+		rev_table = malloc(REV_TABLE_SIZE);
+		if (rev_table == NULL) {
+			fprintf(stderr, "%s: Error when malloc for reverse table.\n", __func__);
+			goto OUT_1;
+		}
+
+		for (i=0; i<REV_TABLE_SIZE; i++)
+			rev_table[i] = bit_reverse(i);
+		ext.rev_table = rev_table;
+	}
+
+	if (opts && opts->bad_blocks) {
+		bad = nand_bad_blocks_init(opts->bad_blocks, nand);
+		if (bad == NULL)
+			goto OUT_2;
+		ext.bad = bad;
+	}
+
+	/* decode_bch() works in its control structure, one per worker */
+	ext.workers = calloc(workers, sizeof(*ext.workers));
+	if (ext.workers == NULL) {
+		fprintf(stderr, "%s: Error when malloc %d workers.\n", __func__, workers);
+		goto OUT_3;
+	}
+	for (i=0; i<workers; i++) {
+		struct nand_extract_worker *w = &ext.workers[i];
+
+		w->segs = nand_segments_init(nand, flag & FLAG_HUGE_PAGES, opts, &ext.nsegs);
+		w->raw = malloc((size_t)NAND_EXTRACT_PAGES*raw_size);
+		w->page = malloc(raw_size);
+		w->out = malloc((size_t)NAND_EXTRACT_PAGES*raw_size);
+		if (!w->segs || !w->raw || !w->page || !w->out) {
+			fprintf(stderr, "%s: Error when set up worker %d.\n", __func__, i);
+			goto OUT_4;
+		}
+	}
+
+	ret = work_pool_run(workers, DIV_ROUND_UP(ext.total, NAND_EXTRACT_PAGES), nand_extract_task,
+	                    &ext, NULL);
+
+	for (i=0; i<workers; i++) {
+		counts = &ext.workers[i].counts;
+		if (counts->bad_pages && (!total.bad_pages || (counts->first_bad < total.first_bad)))
+			total.first_bad = counts->first_bad;
+		total.sectors += counts->sectors;
+		total.bitflips += counts->bitflips;
+		total.uncorrectable += counts->uncorrectable;
+		total.bad_pages += counts->bad_pages;
+		if (counts->max_bitflips > total.max_bitflips)
+			total.max_bitflips = counts->max_bitflips;
+	}
+	if (!ret) {
+		fprintf(stderr, "Extract: %lu sectors, %lu bitflips corrected, at most %d in a sector",
+		        total.sectors, total.bitflips, total.max_bitflips);
+		if (total.uncorrectable)
+			fprintf(stderr, ", %lu uncorrectable in %lu pages from page %lu on, written as read",
+			        total.uncorrectable, total.bad_pages, total.first_bad);
+		fprintf(stderr, ".\n");
+		ret = total.uncorrectable ? 1 : 0;
+	}
+
+OUT_4:
+	for (i=0; i<workers; i++) {
+		nand_segments_free(ext.workers[i].segs, ext.nsegs);
+		free(ext.workers[i].raw);
+		free(ext.workers[i].page);
+		free(ext.workers[i].out);
+	}
+	free(ext.workers);
+OUT_3:
+	nand_bad_blocks_free(bad);
+OUT_2:
+	free(rev_table);
+OUT_1:
+	if (ext.fd_out >= 0)
+		close(ext.fd_out);
+	if (ext.fd_in >= 0)
+		close(ext.fd_in);
+	return ret;
+}
+
+/*
+ * data area of page @page_no of a mapped input, and its free OOB region for
+ * YAFFS images, as nand_pread_page() reads it; returns -1 if the input ends
+ * in the free region
+ */
+static int nand_map_page(const struct nand_chip *nand, const unsigned char *map, size_t size,
+                         unsigned long page_no, unsigned char *buf_page, unsigned int flag)
+{
+	const off_t header = (flag & FLAG_HEADER) ? REPEAT_TIMES*sizeof(unsigned int) : 0;
+	const off_t stride = nand->page_size + ((flag & FLAG_YAFFS) ? nand->spare_size : 0);
+	const int free_len = nand->ecc_offset - nand->free_offset;
+	off_t pos = (off_t)page_no*stride - header; // the boot header comes before the input
+	unsigned char *buf_spare = buf_page + nand->page_size;
+	off_t len = 0;
+	int i, skip = 0;
+
+	if (pos < 0) {
+		for (i=0; i<REPEAT_TIMES; i++)
+			((unsigned int *)buf_page)[i] = nand->boot_header;
+		skip = header;
+	}
+
+	if (pos + skip < (off_t)size)
+		len = (off_t)size - pos - skip;
+	if (len > nand->page_size - skip)
+		len = nand->page_size - skip;
+	memcpy(buf_page + skip, map + pos + skip, len);
+	if (len < nand->page_size - skip) // Padding 0xff, page size aligned
+		memset(buf_page + skip + len, 0xff, nand->page_size - skip - len);
+
+	memset(buf_spare, 0xff, nand->spare_size);
+	if (flag & FLAG_YAFFS) {
+		if ((free_len < 0) || (pos + nand->page_size + free_len > (off_t)size))
+			return -1;
+		memcpy(buf_spare + nand->free_offset, map + pos + nand->page_size, free_len);
+	}
+
+	return 0;
+}
+
+/**
+ * nandbch_reader_open - random access to the raw pages of an image
+ * @nand:     NAND Flash parameters
+ * @file_in:  input file
+ * @flag:     FLAG_PMECC, FLAG_HEADER, FLAG_YAFFS or FLAG_NO_MASK, as for nandbch()
+ * @opts:     optional settings, or NULL; the randomizer, bad blocks, table
+ *            and sector caches are used, the others are not
+ * @cache_pages: pages kept for repeated reads, or 0
+ *
+ * The input is mapped, and nandbch_read_page() builds each page it is asked
+ * for, the same as nandbch() writes it, without the image ever being
+ * written: only the pages read are encoded. Pages are built one by one, so
+ * FLAG_BITSLICE is ignored. A reader is not thread safe, each thread needs
+ * its own.
+ *
+ * Returns the reader, or NULL on error.
+ */
+struct nandbch_reader *nandbch_reader_open(struct nand_chip *nand, const char *file_in,
+                                           unsigned int flag, const struct nandbch_options *opts,
+                                           int cache_pages)
+{
+	const off_t header = (flag & FLAG_HEADER) ? REPEAT_TIMES*sizeof(unsigned int) : 0;
+	struct nandbch_reader *r;
+	unsigned long data_pages = 0;
+	off_t stride;
+	int i, fd, raw_size;
+	struct stat st;
+
+	if ((nand == NULL) || (file_in == NULL))
+		return NULL;
+	raw_size = nand->page_size + nand->spare_size;
+	stride = nand->page_size + ((flag & FLAG_YAFFS) ? nand->spare_size : 0);
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		fprintf(stderr, "%s: Error when malloc reader.\n", __func__);
+		return NULL;
+	}
+	r->nand = nand;
+	r->flag = flag & ~FLAG_BITSLICE;
+	if (cache_pages > 0)
+		r->cache_pages = cache_pages;
+
+	fd = open(file_in, O_RDONLY);
+	if ((fd < 0) || fstat(fd, &st)) {
+		fprintf(stderr, "%s: Error when open input file %s: ", __func__, file_in);
+		perror(NULL);
+		goto FAIL;
+	}
+	r->size = st.st_size;
+	if (r->size) {
+		r->map = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (r->map == MAP_FAILED) {
+			r->map = NULL;
+			fprintf(stderr, "%s: Error when mmap %s: ", __func__, file_in);
+			perror(NULL);
+			goto FAIL;
+		}
+		data_pages = (r->size + header + stride - 1)/stride;
+	}
+	close(fd);
+	fd = -1;
+
+	r->segs = nand_segments_init(nand, r->flag, opts, &r->nsegs);
+	if (r->segs == NULL) {
+		fprintf(stderr, "%s: Error when get nbc handle.\n", __func__);
+		goto FAIL;
+	}
+
+	/* the page being built, and its state for nand_encode_run() */
+	r->buf = malloc(raw_size + 1);
+	r->cache = malloc((size_t)r->cache_pages*raw_size);
+	r->cache_page = malloc(r->cache_pages*sizeof(*r->cache_page));
+	r->cache_used = calloc(r->cache_pages, sizeof(*r->cache_used));
+	if (!r->buf || (r->cache_pages && (!r->cache || !r->cache_page || !r->cache_used))) {
+		fprintf(stderr, "%s: Error when malloc %d cache pages.\n", __func__, r->cache_pages);
+		goto FAIL;
+	}
+	for (i=0; i<r->cache_pages; i++)
+		r->cache_page[i] = ULONG_MAX;
+
+	if (flag & FLAG_PMECC) {
+		r->rev_table = malloc(REV_TABLE_SIZE);
+		if (r->rev_table == NULL) {
+			fprintf(stderr, "%s: Error when malloc for reverse table.\n", __func__);
+			goto FAIL;
+		}
+
+		for (i=0; i<REV_TABLE_SIZE; i++)
+			r->rev_table[i] = bit_reverse(i);
+	}
+
+	/* skipped bad blocks up to the last data page are in the image */
+	r->pages = data_pages;
+	if (opts && opts->bad_blocks) {
+		r->bad = nand_bad_blocks_init(opts->bad_blocks, nand);
+		if (r->bad == NULL)
+			goto FAIL;
+		if (data_pages)
+			r->pages = nand_bad_blocks_phys(r->bad, data_pages - 1) + 1;
+	}
+
+	return r;
+FAIL:
+	if (fd >= 0)
+		close(fd);
+	nandbch_reader_close(r);
+	return NULL;
+}
+
+/**
+ * nandbch_read_page - one raw page of an image
+ * @r:        reader
+ * @page:     page number, below @r->pages
+ * @out:      output, the raw page
+ *
+ * A page in the cache is copied, another one is built from the input: read
+ * from the mapping with the boot header and YAFFS free regions of @r->flag,
+ * scrambled, encoded and laid out as by nandbch(), or marked or left erased
+ * in a bad block. It then takes the place of the least recently read page
+ * of the cache.
+ *
+ * Returns 0, or -1 if there is no such page in the image.
+ */
+int nandbch_read_page(struct nandbch_reader *r, unsigned long page, unsigned char *out)
+{
+	const int raw_size = r->nand->page_size + r->nand->spare_size;
+	const struct nand_segment *seg;
+	struct nand_stats stats = { 0 };
+	unsigned long data_page = page;
+	unsigned char *built, *changed = r->buf + raw_size;
+	int i, slot = -1;
+
+	if (page >= r->pages)
+		return -1;
+
+	for (i=0; i<r->cache_pages; i++) {
+		if (r->cache_page[i] == page) {
+			memcpy(out, r->cache + (size_t)i*raw_size, raw_size);
+			r->cache_used[i] = ++r->tick;
+			r->hits++;
+			return 0;
+		}
+		if ((slot < 0) || (r->cache_used[i] < r->cache_used[slot]))
+			slot = i;
+	}
+
+	if (r->bad && (r->bad->mode == NAND_BAD_SKIP) &&
+	    nand_bad_blocks_is_bad(r->bad, page/r->bad->block_pages)) {
+		memcpy(out, r->bad->filler, raw_size);
+	} else {
+		/* the segment of the data page, which skipped bad blocks shift */
+		if (r->bad)
+			data_page = nand_bad_blocks_data(r->bad, page);
+		for (seg=r->segs; data_page >= seg->end; seg++)
+			;
+
+		if (nand_map_page(&seg->nand, r->map, r->size, data_page, r->buf, r->flag)) {
+			fprintf(stderr, "%s: Error read free region of page %lu.\n", __func__, data_page);
+			return -1;
+		}
+		changed[0] = PAGE_CHANGED;
+		nand_scramble_chunk(seg, r->buf, changed, 1, data_page, r->flag, r->rev_table, &stats);
+		built = nand_encode_run(seg, r->buf, changed, 1, r->flag, r->rev_table,
+		                        seg->nbc->layout->identity ? NULL : out, &stats);
+		if (built != out)
+			memcpy(out, built, raw_size);
+		if (r->bad)
+			nand_bad_blocks_mark(r->bad, out, page, 1);
+	}
+	r->misses++;
+
+	if (slot >= 0) {
+		memcpy(r->cache + (size_t)slot*raw_size, out, raw_size);
+		r->cache_page[slot] = page;
+		r->cache_used[slot] = ++r->tick;
+	}
+	return 0;
+}
+
+void nandbch_reader_close(struct nandbch_reader *r)
+{
+	if (r == NULL)
+		return;
+
+	if (r->map)
+		munmap((void *)r->map, r->size);
+	nand_segments_free(r->segs, r->nsegs);
+	nand_bad_blocks_free(r->bad);
+	free(r->rev_table);
+	free(r->buf);
+	free(r->cache);
+	free(r->cache_page);
+	free(r->cache_used);
+	free(r);
+}
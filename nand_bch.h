@@ -1,6 +1,37 @@
 #ifndef _NAND_BCH_H
 #define _NAND_BCH_H
 
+#include "bch_cache.h"
+#include "bch_gen.h"
+#include "nand_bad_blocks.h"
+#include "nand_digest.h"
+#include "nand_hamming.h"
+#include "nand_layout.h"
+#include "nand_randomizer.h"
+#include "sector_cache.h"
+#include "nand_verify.h"
+
+/* ECC schemes */
+#define NAND_ECC_BCH         0
+#define NAND_ECC_HAMMING     1 /* Linux software Hamming ECC, 3 bytes per 256 or 512 bytes */
+#define NAND_ECC_HAMMING_SMC 2 /* the same in SmartMedia byte order */
+
+/**
+ * struct nand_partition - pages with their own ECC scheme, e.g. for a boot ROM
+ * @pages:     partition size in pages, 0 ends a list of partitions
+ * @ecc_mode:  NAND_ECC_BCH, NAND_ECC_HAMMING or NAND_ECC_HAMMING_SMC
+ * @ecc_sector: ECC sector size
+ * @ecc_bytes: ECC bytes per sector
+ * @ecc_offset: ECC region offset in the OOB area, -1 for right-aligned
+ */
+struct nand_partition {
+	unsigned long pages;
+	int           ecc_mode;
+	int           ecc_sector;
+	int           ecc_bytes;
+	int           ecc_offset;
+};
+
 struct nand_chip {
 	char *name;
 	int  page_size;
@@ -20,25 +51,241 @@ struct nand_chip {
                              * NAND Flash and PMECC parameter header
                              * Check SAMA5Dx datasheet for more information.
                              */
+	int  layout;      /*
+                     * Raw page layout, NAND_LAYOUT_OOB or
+                     * NAND_LAYOUT_INTERLEAVED
+                     */
+	const struct nand_oob_region *ecc_regions; /*
+                     * OOB regions holding the ECC codes in turn,
+                     * ended by a zero length region, or NULL
+                     * for a single region at ecc_offset
+                     */
+	int  ecc_mode;    /* NAND_ECC_BCH, NAND_ECC_HAMMING or NAND_ECC_HAMMING_SMC */
+	const struct nand_partition *partitions; /*
+                     * Partitions from page 0 on, with their
+                     * own ECC scheme, or NULL; the pages after
+                     * them use the one of the chip
+                     */
 };
 
 /**
  * struct nand_bch_control - private NAND BCH control structure
- * @bch:       BCH control structure
- * @errloc:    error location array
+ * @bch:       BCH control structure, NULL with a Hamming ECC scheme
+ * @errloc:    error location array, t entries for each sector of a page
+ * @dec_data:  sector pointers of a page for decode_bch_batch()
+ * @dec_ecc:   ecc pointers of a page for decode_bch_batch()
+ * @dec_nerr:  decode_bch_batch() result of each sector of a page
  * @eccmask:   XOR ecc mask, allows erased pages to be decoded as valid
+ * @cache:     mapping of the precomputed table file, if any
+ * @encode:    encode_bch(), or an encoder specialized for the chip at build time
+ * @slice_data: sector pointers for encode_bch_bitslice(), with FLAG_BITSLICE
+ * @slice_ecc:  ecc pointers for encode_bch_bitslice(), with FLAG_BITSLICE
+ * @dedup:     ECC codes of recently seen sectors, or NULL
+ * @layout:    raw page layout of the chip, compiled into a copy plan
+ * @randomizer: data scrambler keystreams, or NULL
+ * @ecc_sector: ECC sector size
+ * @ecc_mode:  NAND_ECC_BCH, NAND_ECC_HAMMING or NAND_ECC_HAMMING_SMC
+ * @erased:    number of erased sectors, whose code is not computed
+ * @owner:     control structure whose tables, mask, layout and randomizer
+ *             this one uses from another thread, or NULL
  */
 struct nand_bch_control {
 	struct bch_control   *bch;
+	bch_encode_fn        encode;
 	unsigned int         *errloc;
+	const unsigned char  **dec_data;
+	const unsigned char  **dec_ecc;
+	int                  *dec_nerr;
 	unsigned char        *eccmask;
+	struct bch_cache     cache;
+	const unsigned char  **slice_data;
+	unsigned char        **slice_ecc;
+	struct sector_cache  *dedup;
+	struct nand_layout   *layout;
+	struct nand_randomizer *randomizer;
+	int                  ecc_sector;
+	int                  ecc_mode;
+	unsigned long        erased;
+	const struct nand_bch_control *owner;
+};
+
+/**
+ * struct nandbch_options - optional settings of nandbch()
+ * @table_cache: directory of precomputed BCH table files, or NULL
+ * @previous_in: input file of a previous run with the same parameters, or NULL
+ * @previous_out: output file of that run; pages whose input did not change
+ *               are copied from it instead of being encoded again
+ * @dedup_entries: size of the sector ECC cache, 0 to disable it
+ * @stats:     print time and bytes spent per stage on stderr at the end of the
+ *             run, NANDBCH_STATS_TEXT or NANDBCH_STATS_JSON, 0 to disable it
+ * @randomizer: scramble the data area of pages before computing their ECC
+ *             codes, or NULL
+ * @bad_blocks: mark or skip the bad blocks of the target chip, or NULL
+ * @digest:    output, CRC32C and SHA-256 of the image taken as it is written,
+ *             or NULL; one per job for nandbch_batch()
+ * @self_check: check the ECC code of every encoded sector again from the raw
+ *             page written, with another encoder, and fail on a mismatch
+ */
+struct nandbch_options {
+	const char    *table_cache;
+	const char    *previous_in;
+	const char    *previous_out;
+	unsigned long dedup_entries;
+	int           stats;
+	const struct nand_randomizer_params *randomizer;
+	const struct nand_bad_block_params *bad_blocks;
+	struct nand_digest *digest;
+	int           self_check;
+};
+
+#define NANDBCH_STATS_TEXT 1
+#define NANDBCH_STATS_JSON 2
+
+/**
+ * struct nandbch_patch - data to write at a NAND data area address
+ * @offset:    address in the data area, page*page_size+column
+ * @len:       number of bytes
+ * @data:      new data
+ */
+struct nandbch_patch {
+	unsigned long       offset;
+	unsigned int        len;
+	const unsigned char *data;
+};
+
+/**
+ * struct nandbch_job - one image of a batch
+ * @file_in:   input file
+ * @file_out:  output file
+ * @flag:      FLAG_PMECC, FLAG_HEADER, FLAG_YAFFS or FLAG_NO_MASK for this image
+ */
+struct nandbch_job {
+	const char   *file_in;
+	const char   *file_out;
+	unsigned int flag;
+};
+
+/**
+ * struct nandbch_sample - sampled verification of a dump read back from a chip
+ * @fraction:  fraction of the pages to check, when @count is 0
+ * @count:     number of pages to check
+ * @seed:      seed of the page sampler, the same seed picks the same pages
+ * @pages:     output, pages of the dump, bad blocks left out
+ * @sampled:   output, pages checked
+ * @sectors:   output, sectors decoded
+ * @bits:      output, bits of the codewords decoded
+ * @bitflips:  output, bitflips of the correctable sectors
+ * @max_bitflips: output, most bitflips of a correctable sector
+ * @uncorrectable: output, sectors with more bitflips than their code corrects
+ * @bad_pages: output, pages with an uncorrectable sector
+ * @rate:      output, bitflips per bit of the correctable sectors
+ * @rate_low:  output, lower bound of @rate with 95% confidence
+ * @rate_high: output, upper bound of @rate with 95% confidence
+ * @bad_low:   output, lower bound of the fraction of the pages with an
+ *             uncorrectable sector, with 95% confidence
+ * @bad_high:  output, upper bound of that fraction
+ */
+struct nandbch_sample {
+	double        fraction;
+	unsigned long count;
+	unsigned long seed;
+	unsigned long pages;
+	unsigned long sampled;
+	unsigned long sectors;
+	u64           bits;
+	unsigned long bitflips;
+	int           max_bitflips;
+	unsigned long uncorrectable;
+	unsigned long bad_pages;
+	double        rate;
+	double        rate_low;
+	double        rate_high;
+	double        bad_low;
+	double        bad_high;
+};
+
+struct nand_segment;
+
+/**
+ * struct nandbch_reader - raw pages of an image, built on demand from its input
+ * @nand:      NAND Flash parameters
+ * @flag:      FLAG_PMECC, FLAG_HEADER, FLAG_YAFFS or FLAG_NO_MASK of the image
+ * @pages:     raw pages of the image, as nandbch() would write it
+ * @hits:      pages read from the cache
+ * @misses:    pages built
+ * @map:       input, mapped, or NULL if it is empty
+ * @size:      input size
+ * @segs:      encoders of the ECC schemes of the chip
+ * @nsegs:     number of segments
+ * @bad:       bad blocks of the chip, or NULL
+ * @rev_table: bit reversal table for PMECC, or NULL
+ * @buf:       page being built, and its state
+ * @cache_pages: pages of the cache
+ * @cache:     recently read raw pages
+ * @cache_page: page in each cache slot, ULONG_MAX if none
+ * @cache_used: last read of each cache slot, in @tick
+ * @tick:      reads so far
+ */
+struct nandbch_reader {
+	struct nand_chip       *nand;
+	unsigned int           flag;
+	unsigned long          pages;
+	unsigned long          hits;
+	unsigned long          misses;
+	const unsigned char    *map;
+	size_t                 size;
+	struct nand_segment    *segs;
+	int                    nsegs;
+	struct nand_bad_blocks *bad;
+	unsigned char          *rev_table;
+	unsigned char          *buf;
+	int                    cache_pages;
+	unsigned char          *cache;
+	unsigned long          *cache_page;
+	unsigned long          *cache_used;
+	unsigned long          tick;
 };
 
 #define FLAG_PMECC   0x01
 #define FLAG_HEADER  0x02
 #define FLAG_YAFFS   0x04
 #define FLAG_NO_MASK 0x08
+#define FLAG_HUGE_PAGES 0x10
+#define FLAG_BITSLICE   0x20
+
+struct nand_bch_control *nand_bch_init(struct nand_chip *nand, unsigned int flag,
+                                       const struct nandbch_options *opts);
+
+struct nand_bch_control *nand_bch_share(const struct nand_bch_control *nbc,
+                                        const struct nand_chip *nand);
+
+void nand_bch_free(struct nand_bch_control *nbc);
+
+int nand_bch_calculate_ecc(struct nand_bch_control *nbc, const unsigned char *buf, int len,
+                           unsigned char *code, int no_mask);
+
+int nandbch(struct nand_chip *nand, const char *file_in, const char *file_out, unsigned int flag,
+            const struct nandbch_options *opts);
+
+int nandbch_patch(struct nand_chip *nand, const char *file, unsigned int flag,
+                  const struct nandbch_patch *patches, int count,
+                  const struct nandbch_options *opts);
+
+int nandbch_batch(struct nand_chip *nand, const struct nandbch_job *jobs, int count,
+                  unsigned int flag, const struct nandbch_options *opts, int workers);
+
+int nandbch_extract(struct nand_chip *nand, const char *file_in, const char *file_out,
+                    unsigned int flag, const struct nandbch_options *opts, int workers);
+
+int nandbch_verify_sample(struct nand_chip *nand, const char *file, unsigned int flag,
+                          const struct nandbch_options *opts, struct nandbch_sample *sample);
+
+struct nandbch_reader *nandbch_reader_open(struct nand_chip *nand, const char *file_in,
+                                           unsigned int flag, const struct nandbch_options *opts,
+                                           int cache_pages);
+
+int nandbch_read_page(struct nandbch_reader *r, unsigned long page, unsigned char *out);
 
-int nandbch(struct nand_chip *nand, const char *file_in, const char *file_out, unsigned int flag);
+void nandbch_reader_close(struct nandbch_reader *r);
 
 #endif /* _NAND_BCH_H */
@@ -0,0 +1,44 @@
+#ifndef _NAND_CHIPS_H
+#define _NAND_CHIPS_H
+
+/*
+ * Predefined NAND Flash models
+ *
+ * Also read at build time by tools/bchgen, which generates a specialized BCH
+ * encoder for every (m, t) pair used by these models.
+ */
+static struct nand_chip chips[] = {
+	{
+		.name = "MT29F4G08ABADAWP, MT29F2G08ABAEAWP",
+		.page_size   = 2048,
+		.spare_size  = 64,
+		.ecc_sector  = 512,
+		.ecc_bytes   = 7,
+		.ecc_offset  = -1,
+		.free_offset = 2,
+		.boot_header = 0xc0902405
+	},
+	{
+		.name = "MX30LF1G28AD-TI, TC58NVG1S3HBAI4",
+		.page_size   = 2048,
+		.spare_size  = 128,
+		.ecc_sector  = 512,
+		.ecc_bytes   = 13,
+		.ecc_offset  = -1,
+		.free_offset = 2,
+		.boot_header = 0xc1304805
+	},
+	{
+		.name = "MT29F4G08ABAEAWP",
+		.page_size   = 4096,
+		.spare_size  = 224,
+		.ecc_sector  = 512,
+		.ecc_bytes   = 13,
+		.ecc_offset  = -1,
+		.free_offset = 2,
+		.boot_header = 0xc1e04e07
+	}
+};
+#define CHIP_COUNT (sizeof(chips)/sizeof(struct nand_chip))
+
+#endif /* _NAND_CHIPS_H */
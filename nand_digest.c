@@ -0,0 +1,307 @@
+/*
+ * Digests of the output, computed as it is written
+ *
+ * A programmer manifest wants the CRC32C and SHA-256 of an image; taking
+ * them while the pages are written saves a read of the whole output. CRC32C
+ * uses the SSE4.2 crc32 instruction and SHA-256 the SHA extensions when the
+ * CPU has them, with portable code otherwise.
+ *
+ * The CRC of pieces of an image can be combined into the CRC of the image
+ * (nand_crc32c_combine()), so that workers writing different parts of it
+ * each take their own; SHA-256 needs the image in order.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "os_swap.h"
+#include "nand_digest.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define NAND_DIGEST_X86
+#endif
+
+#define CRC32C_POLY 0x82f63b78 /* reflected Castagnoli polynomial */
+
+static const unsigned int sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const unsigned int sha256_h0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static unsigned int crc32c_table[256];
+
+typedef unsigned int (*crc32c_fn)(unsigned int crc, const unsigned char *buf, size_t len);
+typedef void (*sha256_fn)(unsigned int *state, const unsigned char *data, size_t blocks);
+
+static crc32c_fn crc32c_update;
+static sha256_fn sha256_blocks;
+
+/* CRC without the initial and final inversion, a byte at a time */
+static unsigned int crc32c_soft(unsigned int crc, const unsigned char *buf, size_t len)
+{
+	while (len--)
+		crc = crc32c_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#define ROR32(_x, _n) (((_x) >> (_n)) | ((_x) << (32 - (_n))))
+
+static void sha256_soft(unsigned int *state, const unsigned char *data, size_t blocks)
+{
+	unsigned int w[64], s[8], t1, t2;
+	int i;
+
+	for (; blocks; blocks--, data += 64) {
+		for (i=0; i<16; i++)
+			w[i] = (data[4*i] << 24) | (data[4*i + 1] << 16) | (data[4*i + 2] << 8) | data[4*i + 3];
+		for (; i<64; i++)
+			w[i] = w[i - 16] + w[i - 7] +
+			       (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			       (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+		memcpy(s, state, sizeof(s));
+		for (i=0; i<64; i++) {
+			t1 = s[7] + (ROR32(s[4], 6) ^ ROR32(s[4], 11) ^ ROR32(s[4], 25)) +
+			     ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+			t2 = (ROR32(s[0], 2) ^ ROR32(s[0], 13) ^ ROR32(s[0], 22)) +
+			     ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+			memmove(s + 1, s, 7*sizeof(s[0]));
+			s[4] += t1;
+			s[0] = t1 + t2;
+		}
+		for (i=0; i<8; i++)
+			state[i] += s[i];
+	}
+}
+
+#ifdef NAND_DIGEST_X86
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int crc, const unsigned char *buf, size_t len)
+{
+#ifdef __x86_64__
+	unsigned long long c = crc, v;
+
+	for (; len >= 8; len -= 8, buf += 8) {
+		memcpy(&v, buf, 8);
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = c;
+#endif
+	while (len--)
+		crc = _mm_crc32_u8(crc, *buf++);
+	return crc;
+}
+
+/*
+ * 4 rounds per sha256rnds2 pair, the state kept as ABEF and CDGH, and the
+ * message schedule of the next 4 words from the last 16 with sha256msg1/2
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_shani(unsigned int *state, const unsigned char *data, size_t blocks)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i abef, cdgh, abef_save, cdgh_save, msg, t, w[4];
+	int i;
+
+	t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1); /* CDAB */
+	cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b); /* EFGH */
+	abef = _mm_alignr_epi8(t, cdgh, 8);
+	cdgh = _mm_blend_epi16(cdgh, t, 0xf0);
+
+	for (; blocks; blocks--, data += 64) {
+		abef_save = abef;
+		cdgh_save = cdgh;
+
+		/* unrolled, so that w[] stays in registers */
+#pragma GCC unroll 16
+		for (i=0; i<16; i++) {
+			if (i < 4) {
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16*i)), bswap);
+			} else {
+				t = _mm_sha256msg1_epu32(w[i & 3], w[(i - 3) & 3]);
+				t = _mm_add_epi32(t, _mm_alignr_epi8(w[(i - 1) & 3], w[(i - 2) & 3], 4));
+				w[i & 3] = _mm_sha256msg2_epu32(t, w[(i - 1) & 3]);
+			}
+
+			msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[4*i]));
+			cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+			abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0e));
+		}
+
+		abef = _mm_add_epi32(abef, abef_save);
+		cdgh = _mm_add_epi32(cdgh, cdgh_save);
+	}
+
+	t = _mm_shuffle_epi32(abef, 0x1b); /* FEBA */
+	cdgh = _mm_shuffle_epi32(cdgh, 0xb1); /* DCHG */
+	_mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(t, cdgh, 0xf0)); /* DCBA */
+	_mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(cdgh, t, 8)); /* HGFE */
+}
+#endif
+
+/**
+ * nand_digest_accel - use the CRC32C and SHA-256 instructions of the CPU
+ * @enable:    0 for the portable code only
+ *
+ * Returns 1 if at least one of them is used.
+ */
+int nand_digest_accel(int enable)
+{
+	crc32c_fn crc = crc32c_soft;
+	sha256_fn sha = sha256_soft;
+	unsigned int i, k, r;
+	int accel = 0;
+
+	for (i=0; i<256; i++) {
+		for (r=i, k=0; k<8; k++)
+			r = (r >> 1) ^ ((r & 1) ? CRC32C_POLY : 0);
+		crc32c_table[i] = r;
+	}
+
+#ifdef NAND_DIGEST_X86
+	{
+		unsigned int eax, ebx, ecx, edx;
+
+		if (enable && __get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+			if (ecx & bit_SSE4_2) {
+				crc = crc32c_sse42;
+				accel = 1;
+			}
+			if ((ecx & bit_SSSE3) && (ecx & bit_SSE4_1) &&
+			    __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA)) {
+				sha = sha256_shani;
+				accel = 1;
+			}
+		}
+	}
+#endif
+
+	crc32c_update = crc;
+	sha256_blocks = sha;
+	return accel;
+}
+
+/**
+ * nand_crc32c - update a CRC32C
+ * @crc:       CRC32C of the data before, 0 to start
+ * @buf:       next data
+ * @len:       size of @buf
+ */
+unsigned int nand_crc32c(unsigned int crc, const unsigned char *buf, size_t len)
+{
+	if (crc32c_update == NULL)
+		nand_digest_accel(1);
+	return ~crc32c_update(~crc, buf, len);
+}
+
+/* product of two polynomials modulo the CRC polynomial, bit 31 is x^0 */
+static unsigned int crc32c_multmodp(unsigned int a, unsigned int b)
+{
+	unsigned int m = 1U << 31, p = 0;
+
+	for (; m; m >>= 1) {
+		if (a & m)
+			p ^= b;
+		b = (b >> 1) ^ ((b & 1) ? CRC32C_POLY : 0);
+	}
+	return p;
+}
+
+/**
+ * nand_crc32c_combine - CRC32C of two pieces of data one after the other
+ * @crc1:      CRC32C of the first piece
+ * @crc2:      CRC32C of the second piece
+ * @len2:      size of the second piece
+ *
+ * Appending @len2 bytes multiplies the CRC register by x^(8*@len2) modulo
+ * the polynomial, taken by squaring x^8 for each bit of @len2.
+ */
+unsigned int nand_crc32c_combine(unsigned int crc1, unsigned int crc2, u64 len2)
+{
+	unsigned int xn = 1U << (31 - 8), p = 1U << 31;
+
+	for (; len2; len2 >>= 1, xn = crc32c_multmodp(xn, xn))
+		if (len2 & 1)
+			p = crc32c_multmodp(xn, p);
+	return crc32c_multmodp(p, crc1) ^ crc2;
+}
+
+void nand_digest_init(struct nand_digest_ctx *ctx, int sha256)
+{
+	if (crc32c_update == NULL)
+		nand_digest_accel(1);
+	memset(ctx, 0, sizeof(*ctx));
+	memcpy(ctx->sha256, sha256_h0, sizeof(ctx->sha256));
+	ctx->sha256_on = sha256;
+}
+
+void nand_digest_update(struct nand_digest_ctx *ctx, const unsigned char *buf, size_t len)
+{
+	ctx->crc32c = ~crc32c_update(~ctx->crc32c, buf, len);
+	nand_digest_update_sha256(ctx, buf, len);
+}
+
+/*
+ * the size and SHA-256 only, for an image whose CRC32C is combined from
+ * pieces taken elsewhere
+ */
+void nand_digest_update_sha256(struct nand_digest_ctx *ctx, const unsigned char *buf, size_t len)
+{
+	unsigned int used = ctx->size % 64, n;
+
+	ctx->size += len;
+	if (!ctx->sha256_on)
+		return;
+
+	if (used) {
+		n = (len < 64 - used) ? len : 64 - used;
+		memcpy(ctx->block + used, buf, n);
+		buf += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		sha256_blocks(ctx->sha256, ctx->block, 1);
+	}
+
+	sha256_blocks(ctx->sha256, buf, len/64);
+	memcpy(ctx->block, buf + len/64*64, len % 64);
+}
+
+void nand_digest_final(struct nand_digest_ctx *ctx, struct nand_digest *digest)
+{
+	unsigned int used = ctx->size % 64;
+	u64 bits = ctx->size*8;
+	int i;
+
+	digest->size = ctx->size;
+	digest->crc32c = ctx->crc32c;
+	digest->has_sha256 = ctx->sha256_on;
+	if (!ctx->sha256_on)
+		return;
+
+	/* padding: 0x80, zeros, then the size in bits, big endian */
+	ctx->block[used++] = 0x80;
+	if (used > 56) {
+		memset(ctx->block + used, 0, 64 - used);
+		sha256_blocks(ctx->sha256, ctx->block, 1);
+		used = 0;
+	}
+	memset(ctx->block + used, 0, 56 - used);
+	for (i=0; i<8; i++)
+		ctx->block[56 + i] = bits >> (56 - 8*i);
+	sha256_blocks(ctx->sha256, ctx->block, 1);
+
+	for (i=0; i<NAND_SHA256_BYTES; i++)
+		digest->sha256[i] = ctx->sha256[i/4] >> (24 - 8*(i % 4));
+}
@@ -0,0 +1,51 @@
+#ifndef _NAND_DIGEST_H
+#define _NAND_DIGEST_H
+
+#define NAND_SHA256_BYTES 32
+
+/**
+ * struct nand_digest - digests of an image, for the programmer manifest
+ * @size:      image size in bytes
+ * @crc32c:    CRC32C (Castagnoli) of the image
+ * @sha256:    SHA-256 of the image
+ * @has_sha256: @sha256 is set; a SHA-256 is only computed over an image
+ *             written in order
+ */
+struct nand_digest {
+	u64           size;
+	unsigned int  crc32c;
+	unsigned char sha256[NAND_SHA256_BYTES];
+	int           has_sha256;
+};
+
+/**
+ * struct nand_digest_ctx - digests of an image being written
+ * @size:      bytes so far
+ * @crc32c:    CRC32C so far
+ * @sha256:    SHA-256 chaining state, or not computed if @sha256_on is 0
+ * @block:     bytes of the next SHA-256 block
+ * @sha256_on: compute the SHA-256 too
+ */
+struct nand_digest_ctx {
+	u64           size;
+	unsigned int  crc32c;
+	unsigned int  sha256[8];
+	unsigned char block[64];
+	int           sha256_on;
+};
+
+unsigned int nand_crc32c(unsigned int crc, const unsigned char *buf, size_t len);
+
+unsigned int nand_crc32c_combine(unsigned int crc1, unsigned int crc2, u64 len2);
+
+int nand_digest_accel(int enable);
+
+void nand_digest_init(struct nand_digest_ctx *ctx, int sha256);
+
+void nand_digest_update(struct nand_digest_ctx *ctx, const unsigned char *buf, size_t len);
+
+void nand_digest_update_sha256(struct nand_digest_ctx *ctx, const unsigned char *buf, size_t len);
+
+void nand_digest_final(struct nand_digest_ctx *ctx, struct nand_digest *digest);
+
+#endif /* _NAND_DIGEST_H */
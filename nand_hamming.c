@@ -0,0 +1,152 @@
+/*
+ * Hamming ECC, as the software ECC of Linux (nand_ecc.c)
+ *
+ * A 256 or 512 byte sector gets 3 ECC bytes: the parities of the bytes whose
+ * index has bit k clear (rp2k) and set (rp2k+1), and the parities of the
+ * bit columns (cp0..cp5), all inverted so that an erased sector has an all
+ * 0xff code, which corrects 1 bit and detects 2 bit errors.
+ *
+ * Every parity is a parity of a XOR of some bytes. The sector is folded by
+ * pairs of vectors: at each level, the vectors at odd positions are the bytes
+ * whose index has the next high bit set. The last vector is then folded by
+ * 64-bit lanes and by bytes, and the parity of each XOR taken once at the end.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "os_swap.h"
+#include "nand_hamming.h"
+
+typedef u64 hamming_vec_t __attribute__((vector_size(32)));
+
+#define HAMMING_VEC_BYTES  sizeof(hamming_vec_t)
+#define HAMMING_VEC_MAX    (512/HAMMING_VEC_BYTES)
+
+/* bytes of a 64-bit word whose index in the word has bit 0, 1 or 2 set */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HAMMING_BYTE_BIT0  0xff00ff00ff00ff00ULL
+#define HAMMING_BYTE_BIT1  0xffff0000ffff0000ULL
+#define HAMMING_BYTE_BIT2  0xffffffff00000000ULL
+#else
+#define HAMMING_BYTE_BIT0  0x00ff00ff00ff00ffULL
+#define HAMMING_BYTE_BIT1  0x0000ffff0000ffffULL
+#define HAMMING_BYTE_BIT2  0x00000000ffffffffULL
+#endif
+
+/* inverted parity */
+#define INV_PARITY(_x)  (!__builtin_parityll(_x))
+
+/**
+ * nand_hamming_calculate - calculate the Hamming ECC code of a sector
+ * @buf:       sector data
+ * @len:       sector size, 256 or 512
+ * @code:      output, NAND_HAMMING_BYTES bytes
+ * @sm_order:  SmartMedia byte order, with rp0..rp7 in the first byte, as
+ *             Linux with CONFIG_MTD_NAND_ECC_SW_HAMMING_SMC
+ */
+void nand_hamming_calculate(const unsigned char *buf, unsigned int len, unsigned char *code,
+                            int sm_order)
+{
+	hamming_vec_t v[HAMMING_VEC_MAX], odd[4];
+	unsigned int i, k, levels, n = len/HAMMING_VEC_BYTES;
+	u64 all, set[9]; /* XOR of the bytes whose index has bit k set */
+	unsigned int lo = 0, hi = 0, par, p;
+
+	for (i=0; i<n; i++)
+		memcpy(&v[i], buf + i*HAMMING_VEC_BYTES, HAMMING_VEC_BYTES);
+
+	for (levels=0; n>1; levels++, n/=2) {
+		odd[levels] = v[1];
+		v[0] ^= v[1];
+		for (i=1; i<n/2; i++) {
+			odd[levels] ^= v[2*i + 1];
+			v[i] = v[2*i] ^ v[2*i + 1];
+		}
+	}
+
+	/* 32-byte vectors, 64-bit lanes: byte index bits 3-4 are the lane */
+	all = v[0][0] ^ v[0][1] ^ v[0][2] ^ v[0][3];
+	set[0] = all & HAMMING_BYTE_BIT0;
+	set[1] = all & HAMMING_BYTE_BIT1;
+	set[2] = all & HAMMING_BYTE_BIT2;
+	set[3] = v[0][1] ^ v[0][3];
+	set[4] = v[0][2] ^ v[0][3];
+	for (k=0; k<levels; k++)
+		set[5 + k] = odd[k][0] ^ odd[k][1] ^ odd[k][2] ^ odd[k][3];
+
+	/* rp2k = parity of all bytes ^ rp2k+1, inverted */
+	p = __builtin_parityll(all);
+	for (k=0; k<8; k++) {
+		i = __builtin_parityll(set[k]);
+		if (k < 4)
+			lo |= (!(p ^ i) << 2*k) | (!i << (2*k + 1));
+		else
+			hi |= (!(p ^ i) << 2*(k - 4)) | (!i << (2*(k - 4) + 1));
+	}
+
+	/* column parities, from the XOR of all bytes */
+	all ^= all >> 32;
+	all ^= all >> 16;
+	all ^= all >> 8;
+	par = all & 0xff;
+
+	code[0] = sm_order ? lo : hi;
+	code[1] = sm_order ? hi : lo;
+	code[2] = (INV_PARITY(par & 0xf0) << 7) | (INV_PARITY(par & 0x0f) << 6) |
+	          (INV_PARITY(par & 0xcc) << 5) | (INV_PARITY(par & 0x33) << 4) |
+	          (INV_PARITY(par & 0xaa) << 3) | (INV_PARITY(par & 0x55) << 2);
+	if (len == 512) {
+		i = __builtin_parityll(set[8]);
+		code[2] |= (!i << 1) | !(p ^ i);
+	} else {
+		code[2] |= 3;
+	}
+}
+
+/* bits 1, 3, 5 and 7 of a byte of parities, where a bitflip sets its address */
+static unsigned int hamming_address(unsigned int b)
+{
+	return ((b >> 1) & 1) | ((b >> 2) & 2) | ((b >> 3) & 4) | ((b >> 4) & 8);
+}
+
+/**
+ * nand_hamming_correct - correct a sector as Linux does (nand_correct_data)
+ * @buf:       sector data, corrected in place, or NULL to count bitflips only
+ * @read_ecc:  code stored with the sector
+ * @calc_ecc:  code calculated from the sector as read
+ * @len:       sector size, 256 or 512
+ * @sm_order:  SmartMedia byte order, as nand_hamming_calculate()
+ *
+ * Returns 0 or 1 bitflip, in the data or in the code, or -1 if the sector
+ * has more than the code corrects.
+ */
+int nand_hamming_correct(unsigned char *buf, const unsigned char *read_ecc,
+                         const unsigned char *calc_ecc, unsigned int len, int sm_order)
+{
+	/* b0 holds rp0..rp7, b1 rp8..rp15, b2 the column parities and rp16, rp17 */
+	const unsigned int b0 = read_ecc[!sm_order] ^ calc_ecc[!sm_order];
+	const unsigned int b1 = read_ecc[sm_order] ^ calc_ecc[sm_order];
+	const unsigned int b2 = read_ecc[2] ^ calc_ecc[2];
+	const unsigned int b2_mask = (len == 512) ? 0x55 : 0x54;
+	unsigned int byte;
+
+	if ((b0 | b1 | b2) == 0)
+		return 0;
+
+	/* a data bitflip flips one of each pair of parities, at its address */
+	if ((((b0 ^ (b0 >> 1)) & 0x55) == 0x55) && (((b1 ^ (b1 >> 1)) & 0x55) == 0x55) &&
+	    (((b2 ^ (b2 >> 1)) & b2_mask) == b2_mask)) {
+		byte = (hamming_address(b1) << 4) | hamming_address(b0);
+		if (len == 512)
+			byte |= hamming_address(b2 & 3) << 8;
+		if (buf)
+			buf[byte] ^= 1 << hamming_address(b2 >> 2);
+		return 1;
+	}
+
+	/* a code bitflip flips that bit only */
+	if (__builtin_popcount(b0 | b1 << 8 | b2 << 16) == 1)
+		return 1;
+
+	return -1;
+}
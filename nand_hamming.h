@@ -0,0 +1,12 @@
+#ifndef _NAND_HAMMING_H
+#define _NAND_HAMMING_H
+
+#define NAND_HAMMING_BYTES 3 /* ECC bytes per 256 or 512 byte sector */
+
+void nand_hamming_calculate(const unsigned char *buf, unsigned int len, unsigned char *code,
+                            int sm_order);
+
+int nand_hamming_correct(unsigned char *buf, const unsigned char *read_ecc,
+                         const unsigned char *calc_ecc, unsigned int len, int sm_order);
+
+#endif /* _NAND_HAMMING_H */
@@ -0,0 +1,300 @@
+/*
+ * Raw page layouts
+ *
+ * nandbch() builds every page the same way: the data area, then the OOB area
+ * with the ECC codes of all sectors in a row at ecc_offset. The layout of a
+ * chip tells where these bytes go in the raw page: ECC codes scattered over
+ * several OOB regions like with the mtd_ooblayout_ops of Linux, or data and
+ * ECC codes interleaved sector by sector. It is compiled once into a copy
+ * plan, the runs of bytes which stay contiguous in the raw page, so that a
+ * page costs one memcpy() per run whatever the layout, and nothing at all
+ * with the usual one. The plan also gives the slot of each ECC code in the
+ * raw page, for the encoder to write it there instead of copying it after.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "os_swap.h"
+#include "nand_bch.h"
+
+/*
+ * move @len bytes at @src of the built page to @dst of the raw page;
+ * returns -1 if a byte is out of the page or its destination already taken
+ */
+static int nand_layout_place(int *map, unsigned char *used, int raw_size,
+                             int src, int dst, int len)
+{
+	int i;
+
+	if ((src < 0) || (dst < 0) || (src + len > raw_size) || (dst + len > raw_size))
+		return -1;
+
+	for (i=0; i<len; i++) {
+		if ((map[src + i] >= 0) || used[dst + i])
+			return -1;
+		map[src + i] = dst + i;
+		used[dst + i] = 1;
+	}
+
+	return 0;
+}
+
+/*
+ * merge the bytes of a built page into spans contiguous in the raw page,
+ * leaving out those flagged in @skip if not NULL; returns the number of spans,
+ * stored in @spans if not NULL
+ */
+static unsigned int nand_layout_spans(const int *map, const unsigned char *skip, int raw_size,
+                                      struct nand_copy_span *spans)
+{
+	unsigned int count = 0;
+	int src;
+
+	for (src=0; src<raw_size; src++) {
+		if (skip && skip[src])
+			continue;
+		if (!src || (skip && skip[src - 1]) || (map[src] != map[src - 1] + 1)) {
+			if (spans) {
+				spans[count].src = src;
+				spans[count].dst = map[src];
+				spans[count].len = 0;
+			}
+			count++;
+		}
+		if (spans)
+			spans[count - 1].len++;
+	}
+
+	return count;
+}
+
+/**
+ * nand_layout_init - compile the raw page layout of a chip into a copy plan
+ * @nand:      NAND Flash parameters, with ecc_offset resolved
+ *
+ * ECC codes go to @nand->ecc_regions in turn, or to ecc_offset when there is
+ * no region list, and the other OOB bytes fill the rest of the OOB area in
+ * order. With NAND_LAYOUT_INTERLEAVED, the ECC code of each sector follows
+ * its data instead, and ecc_regions is ignored.
+ *
+ * Returns the layout, or NULL on error.
+ */
+struct nand_layout *nand_layout_init(const struct nand_chip *nand)
+{
+	const int raw_size = nand->page_size + nand->spare_size;
+	const int steps = nand->page_size/nand->ecc_sector;
+	const int ecc_size = steps*nand->ecc_bytes;
+	const int ecc_start = nand->page_size + nand->ecc_offset;
+	const struct nand_oob_region *region;
+	struct nand_layout *layout = NULL;
+	unsigned char *used;
+	int *map;
+	int i, j, n, src, dst, ret = 0;
+	unsigned int count, copies;
+
+	map = malloc(raw_size*sizeof(*map));
+	used = calloc(raw_size, 1);
+	if (!map || !used) {
+		fprintf(stderr, "%s: Error when malloc layout map.\n", __func__);
+		goto OUT;
+	}
+	memset(map, 0xff, raw_size*sizeof(*map));
+
+	if ((nand->ecc_offset < 0) || (nand->ecc_offset + ecc_size > nand->spare_size)) {
+		fprintf(stderr, "%s: Error ECC codes out of OOB area.\n", __func__);
+		goto OUT;
+	}
+
+	if (nand->layout == NAND_LAYOUT_INTERLEAVED) {
+		for (i=0, dst=0; (i<steps) && !ret; i++) {
+			ret = nand_layout_place(map, used, raw_size, i*nand->ecc_sector, dst, nand->ecc_sector);
+			dst += nand->ecc_sector;
+			ret |= nand_layout_place(map, used, raw_size, ecc_start + i*nand->ecc_bytes, dst,
+			                         nand->ecc_bytes);
+			dst += nand->ecc_bytes;
+		}
+	} else if (nand->layout == NAND_LAYOUT_OOB) {
+		ret = nand_layout_place(map, used, raw_size, 0, 0, nand->page_size);
+		if (nand->ecc_regions) {
+			for (region=nand->ecc_regions, i=0; region->length && (i<ecc_size) && !ret; region++) {
+				n = (region->length < ecc_size - i) ? region->length : ecc_size - i;
+				if (region->offset + region->length > nand->spare_size)
+					ret = -1;
+				else
+					ret = nand_layout_place(map, used, raw_size, ecc_start + i,
+					                        nand->page_size + region->offset, n);
+				i += n;
+			}
+			if (i < ecc_size)
+				ret = -1;
+		} else {
+			ret |= nand_layout_place(map, used, raw_size, ecc_start, ecc_start, ecc_size);
+		}
+	} else {
+		ret = -1;
+	}
+	if (ret) {
+		fprintf(stderr, "%s: Error ECC regions overlap, exceed the OOB area or are too small.\n", __func__);
+		goto OUT;
+	}
+
+	/* other OOB bytes keep their order */
+	for (src=nand->page_size, dst=0; src<raw_size; src++) {
+		if (map[src] >= 0)
+			continue;
+		while (used[dst])
+			dst++;
+		map[src] = dst;
+		used[dst] = 1;
+	}
+
+	/* ECC codes contiguous in the raw page get a slot, used[] now flags their bytes */
+	memset(used, 0, raw_size);
+	for (i=0; i<steps; i++) {
+		src = ecc_start + i*nand->ecc_bytes;
+		for (j=1; (j<nand->ecc_bytes) && (map[src + j] == map[src] + j); j++)
+			;
+		if (j == nand->ecc_bytes)
+			memset(used + src, 1, nand->ecc_bytes);
+	}
+
+	count = nand_layout_spans(map, NULL, raw_size, NULL);
+	copies = nand_layout_spans(map, used, raw_size, NULL);
+	layout = malloc(sizeof(*layout) + (count + copies)*sizeof(layout->spans[0]) +
+	                steps*sizeof(layout->ecc_slots[0]));
+	if (layout == NULL) {
+		fprintf(stderr, "%s: Error when malloc layout.\n", __func__);
+		goto OUT;
+	}
+
+	layout->raw_size = raw_size;
+	layout->count = nand_layout_spans(map, NULL, raw_size, layout->spans);
+	layout->copy = layout->spans + count;
+	layout->copies = nand_layout_spans(map, used, raw_size, layout->copy);
+	layout->ecc_slots = (int *)(layout->copy + copies);
+	for (i=0; i<steps; i++) {
+		src = ecc_start + i*nand->ecc_bytes;
+		layout->ecc_slots[i] = used[src] ? map[src] : -1;
+	}
+	layout->identity = (layout->count == 1) && !layout->spans[0].dst;
+
+OUT:
+	free(used);
+	free(map);
+	return layout;
+}
+
+void nand_layout_free(struct nand_layout *layout)
+{
+	free(layout);
+}
+
+/**
+ * nand_layout_apply - lay out built pages as raw pages
+ * @layout:    compiled layout
+ * @page:      @npages consecutive pages built by nandbch()
+ * @raw:       output, @npages consecutive raw pages
+ * @npages:    number of pages
+ *
+ * Copies every byte but the ECC codes with a slot, which the encoder has
+ * already written to @raw.
+ */
+void nand_layout_apply(const struct nand_layout *layout, const unsigned char *page,
+                       unsigned char *raw, int npages)
+{
+	const struct nand_copy_span *span, *end = layout->copy + layout->copies;
+	int p;
+
+	for (p=0; p<npages; p++, page += layout->raw_size, raw += layout->raw_size) {
+		for (span=layout->copy; span<end; span++)
+			memcpy(raw + span->dst, page + span->src, span->len);
+	}
+}
+
+/**
+ * nand_layout_gather - built pages back from raw pages
+ * @layout:    compiled layout
+ * @raw:       @npages consecutive raw pages
+ * @page:      output, @npages consecutive pages as built by nandbch()
+ * @npages:    number of pages
+ */
+void nand_layout_gather(const struct nand_layout *layout, const unsigned char *raw,
+                        unsigned char *page, int npages)
+{
+	const struct nand_copy_span *span, *end = layout->spans + layout->count;
+	int p;
+
+	for (p=0; p<npages; p++, page += layout->raw_size, raw += layout->raw_size) {
+		for (span=layout->spans; span<end; span++)
+			memcpy(page + span->src, raw + span->dst, span->len);
+	}
+}
+
+/*
+ * read or write @len bytes at @offset of a built page, from or to the raw
+ * page at @pos of a file, one system call per span
+ */
+static int nand_layout_io(const struct nand_layout *layout, int fd, off_t pos,
+                          unsigned int offset, unsigned int len, unsigned char *buf,
+                          int write)
+{
+	const struct nand_copy_span *span, *end = layout->spans + layout->count;
+	unsigned int skip, n;
+	ssize_t ret;
+
+	for (span=layout->spans; (span<end) && len; span++) {
+		if (offset >= span->src + span->len)
+			continue;
+
+		skip = offset - span->src;
+		n = (span->len - skip < len) ? span->len - skip : len;
+		if (write)
+			ret = pwrite(fd, buf, n, pos + span->dst + skip);
+		else
+			ret = pread(fd, buf, n, pos + span->dst + skip);
+		if (ret != n)
+			return -1;
+
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+
+	return len ? -1 : 0;
+}
+
+/**
+ * nand_layout_pread - read bytes of a built page from a raw page of a file
+ * @layout:    compiled layout
+ * @fd:        file descriptor
+ * @pos:       file offset of the raw page
+ * @offset:    offset in the built page
+ * @len:       number of bytes
+ * @buf:       output buffer
+ *
+ * Returns 0 if successful, or -1 on short read or error.
+ */
+int nand_layout_pread(const struct nand_layout *layout, int fd, off_t pos,
+                      unsigned int offset, unsigned int len, unsigned char *buf)
+{
+	return nand_layout_io(layout, fd, pos, offset, len, buf, 0);
+}
+
+/**
+ * nand_layout_pwrite - write bytes of a built page to a raw page of a file
+ * @layout:    compiled layout
+ * @fd:        file descriptor
+ * @pos:       file offset of the raw page
+ * @offset:    offset in the built page
+ * @len:       number of bytes
+ * @buf:       data to write
+ *
+ * Returns 0 if successful, or -1 on short write or error.
+ */
+int nand_layout_pwrite(const struct nand_layout *layout, int fd, off_t pos,
+                       unsigned int offset, unsigned int len, const unsigned char *buf)
+{
+	return nand_layout_io(layout, fd, pos, offset, len, (unsigned char *)buf, 1);
+}
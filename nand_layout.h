@@ -0,0 +1,74 @@
+#ifndef _NAND_LAYOUT_H
+#define _NAND_LAYOUT_H
+
+#include <sys/types.h>
+
+struct nand_chip;
+
+/**
+ * struct nand_oob_region - region of the OOB area, as mtd_oob_region in Linux
+ * @offset:    region start in the OOB area
+ * @length:    region size in bytes, 0 ends a list of regions
+ */
+struct nand_oob_region {
+	int offset;
+	int length;
+};
+
+/* placement of the data and ECC codes in a raw page */
+#define NAND_LAYOUT_OOB         0 /* data area, then OOB area with the ECC regions */
+#define NAND_LAYOUT_INTERLEAVED 1 /* data0|ecc0|data1|ecc1|..., then other OOB bytes */
+
+/**
+ * struct nand_copy_span - one memcpy() of a copy plan
+ * @src:       offset in the page built by nandbch()
+ * @dst:       offset in the raw page
+ * @len:       number of bytes
+ */
+struct nand_copy_span {
+	unsigned int src;
+	unsigned int dst;
+	unsigned int len;
+};
+
+/**
+ * struct nand_layout - raw page layout of a chip, compiled into a copy plan
+ * @identity:  the built page is the raw page, nothing to copy
+ * @raw_size:  page size with the OOB area
+ * @count:     number of spans
+ * @copies:    number of spans in @copy
+ * @ecc_slots: offset in the raw page of the ECC code of each sector, where the
+ *             encoder writes it directly, or -1 if the code is split over
+ *             several OOB regions
+ * @copy:      spans of the bytes which have no ECC slot, those copied by
+ *             nand_layout_apply()
+ * @spans:     spans moving every byte of a built page to the raw page, in
+ *             built page order
+ */
+struct nand_layout {
+	int                   identity;
+	unsigned int          raw_size;
+	unsigned int          count;
+	unsigned int          copies;
+	int                   *ecc_slots;
+	struct nand_copy_span *copy;
+	struct nand_copy_span spans[];
+};
+
+struct nand_layout *nand_layout_init(const struct nand_chip *nand);
+
+void nand_layout_free(struct nand_layout *layout);
+
+void nand_layout_apply(const struct nand_layout *layout, const unsigned char *page,
+                       unsigned char *raw, int npages);
+
+void nand_layout_gather(const struct nand_layout *layout, const unsigned char *raw,
+                        unsigned char *page, int npages);
+
+int nand_layout_pread(const struct nand_layout *layout, int fd, off_t pos,
+                      unsigned int offset, unsigned int len, unsigned char *buf);
+
+int nand_layout_pwrite(const struct nand_layout *layout, int fd, off_t pos,
+                       unsigned int offset, unsigned int len, const unsigned char *buf);
+
+#endif /* _NAND_LAYOUT_H */
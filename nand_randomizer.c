@@ -0,0 +1,116 @@
+/*
+ * Data randomizer
+ *
+ * NAND controllers scramble the data area of a page with an LFSR keystream
+ * seeded per page before computing its ECC codes, so that the cells do not
+ * keep long runs of the same level. Keystreams only depend on the seed: the
+ * few of them used in a seed cycle are computed once at init, and applying
+ * one to a page is a plain XOR, 64 bits at a time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "os_swap.h"
+#include "nand_randomizer.h"
+
+/**
+ * nand_randomizer_init - precompute the keystreams of a randomizer
+ * @params:    LFSR and seed rule
+ * @len:       data area size, a multiple of 8 bytes
+ *
+ * Returns the randomizer, or NULL on error.
+ */
+struct nand_randomizer *nand_randomizer_init(const struct nand_randomizer_params *params,
+                                             unsigned int len)
+{
+	struct nand_randomizer *rnd;
+	unsigned char *ks;
+	unsigned int p, i, b, reg, mask;
+
+	if (!params->taps || (len % 8)) {
+		fprintf(stderr, "%s: Error randomizer taps 0x%x or page size %u.\n", __func__,
+		        params->taps, len);
+		return NULL;
+	}
+	mask = ~0U >> __builtin_clz(params->taps);
+
+	rnd = malloc(sizeof(*rnd));
+	if (rnd == NULL)
+		return NULL;
+	rnd->len = len;
+	rnd->period = params->period ? params->period : 1;
+	rnd->keep_erased = params->keep_erased;
+	rnd->keystream = malloc((size_t)rnd->period*len);
+	if (rnd->keystream == NULL) {
+		fprintf(stderr, "%s: Error when malloc %u keystreams.\n", __func__, rnd->period);
+		free(rnd);
+		return NULL;
+	}
+
+	ks = (unsigned char *)rnd->keystream;
+	for (p=0; p<rnd->period; p++) {
+		reg = (params->seed + p) & mask;
+		if (reg == 0) {
+			fprintf(stderr, "%s: Error seed of page %u is 0.\n", __func__, p);
+			nand_randomizer_free(rnd);
+			return NULL;
+		}
+		for (i=0; i<len; i++, ks++) {
+			for (b=0, *ks=0; b<8; b++) {
+				*ks |= (reg & 1) << b;
+				reg = (reg & 1) ? (reg >> 1) ^ params->taps : reg >> 1;
+			}
+		}
+	}
+
+	return rnd;
+}
+
+void nand_randomizer_free(struct nand_randomizer *rnd)
+{
+	if (rnd) {
+		free(rnd->keystream);
+		free(rnd);
+	}
+}
+
+/**
+ * nand_randomizer_keystream - keystream of a page
+ * @rnd:       randomizer
+ * @page:      page number in the image
+ */
+const unsigned char *nand_randomizer_keystream(const struct nand_randomizer *rnd, unsigned long page)
+{
+	return (const unsigned char *)rnd->keystream + (page % rnd->period)*rnd->len;
+}
+
+/**
+ * nand_randomizer_apply - scramble the data area of a page in place
+ * @rnd:       randomizer
+ * @buf:       data area
+ * @page:      page number in the image
+ *
+ * The erased page check is done in the same pass as the XOR.
+ *
+ * Returns 1 if the page is erased and left unscrambled, 0 otherwise.
+ */
+int nand_randomizer_apply(const struct nand_randomizer *rnd, unsigned char *buf, unsigned long page)
+{
+	const u64 *ks = rnd->keystream + (page % rnd->period)*(rnd->len/8);
+	u64 w, erased = ~0ULL;
+	unsigned int i;
+
+	for (i=0; i<rnd->len/8; i++, buf += 8) {
+		memcpy(&w, buf, 8);
+		erased &= w;
+		w ^= ks[i];
+		memcpy(buf, &w, 8);
+	}
+
+	if (rnd->keep_erased && (erased == ~0ULL)) {
+		memset(buf - rnd->len, 0xff, rnd->len);
+		return 1;
+	}
+	return 0;
+}
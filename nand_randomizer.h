@@ -0,0 +1,49 @@
+#ifndef _NAND_RANDOMIZER_H
+#define _NAND_RANDOMIZER_H
+
+#include "os_swap.h"
+
+/**
+ * struct nand_randomizer_params - data scrambler of a NAND controller
+ * @taps:      Galois LFSR taps: the register is shifted right, and XORed with
+ *             @taps when the bit shifted out is 1; the highest tap gives the
+ *             register width, up to 32 bits
+ * @seed:      register value for page 0, must not be 0
+ * @period:    pages per seed cycle: page p starts from seed + p % period,
+ *             0 or 1 for the same seed on every page
+ * @keep_erased: leave erased (all 0xff) pages unscrambled
+ *
+ * The keystream is the sequence of bits shifted out, least significant bit
+ * of each byte first, and is XORed with the data area of a page.
+ */
+struct nand_randomizer_params {
+	unsigned int taps;
+	unsigned int seed;
+	unsigned int period;
+	int          keep_erased;
+};
+
+/**
+ * struct nand_randomizer - keystreams of every page seed, precomputed
+ * @len:       data area size, a multiple of 8 bytes
+ * @period:    number of keystreams
+ * @keep_erased: leave erased pages unscrambled
+ * @keystream: @period keystreams of @len bytes
+ */
+struct nand_randomizer {
+	unsigned int len;
+	unsigned int period;
+	int          keep_erased;
+	u64          *keystream;
+};
+
+struct nand_randomizer *nand_randomizer_init(const struct nand_randomizer_params *params,
+                                             unsigned int len);
+
+void nand_randomizer_free(struct nand_randomizer *rnd);
+
+const unsigned char *nand_randomizer_keystream(const struct nand_randomizer *rnd, unsigned long page);
+
+int nand_randomizer_apply(const struct nand_randomizer *rnd, unsigned char *buf, unsigned long page);
+
+#endif /* _NAND_RANDOMIZER_H */
@@ -0,0 +1,339 @@
+/*
+ * Self-check of the ECC codes written by nandbch()
+ *
+ * Every raw page that gets encoded is checked again from what is written:
+ * the layout is undone, the PMECC bit order reversed back, and the code of
+ * each sector computed with a BCH control structure of its own, with the
+ * remainder tables of the Linux encoder, not the generated or bit-sliced
+ * encoder of the pages (or the other table width when they used the Linux
+ * encoder too), and its own erased sector mask. Any difference with the
+ * stored code stops the run.
+ *
+ * nandbch() hands copies of the pages to a thread through a small ring, so
+ * that the check runs on another core while the next pages are encoded; a
+ * batch checks the pages of each task on its worker.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "os_swap.h"
+#include "bch.h"
+#include "nand_bch.h"
+
+static unsigned char nand_verify_reverse(unsigned char b)
+{
+	b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+	b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+	b = (b & 0xaa) >> 1 | (b & 0x55) << 1;
+	return b;
+}
+
+/**
+ * nand_verify_init - self-check of pages of @count ECC schemes
+ * @count:     number of ECC schemes, see nand_verify_code_init()
+ * @raw_size:  raw page size
+ * @max_pages: most pages handed to the thread at once
+ * @slots:     jobs in the ring of the thread, 0 without a thread
+ */
+struct nand_verify *nand_verify_init(int count, int raw_size, int max_pages, int slots)
+{
+	struct nand_verify *v;
+	int i;
+
+	v = calloc(1, sizeof(*v));
+	if (v == NULL)
+		return NULL;
+	v->count = count;
+	v->raw_size = raw_size;
+	v->slots = slots;
+	for (i=0; i<256; i++)
+		v->rev_table[i] = nand_verify_reverse(i);
+
+	v->codes = calloc(count, sizeof(*v->codes));
+	if (v->codes == NULL)
+		goto FAIL;
+
+	v->scratch = malloc(NAND_VERIFY_SCRATCH(raw_size));
+	if (v->scratch == NULL)
+		goto FAIL;
+
+	if (slots) {
+		v->jobs = calloc(slots, sizeof(*v->jobs));
+		if (v->jobs == NULL)
+			goto FAIL;
+		for (i=0; i<slots; i++) {
+			v->jobs[i].raw = malloc((size_t)max_pages*raw_size);
+			if (v->jobs[i].raw == NULL)
+				goto FAIL;
+		}
+	}
+
+	return v;
+FAIL:
+	fprintf(stderr, "%s: Error when malloc self-check.\n", __func__);
+	nand_verify_free(v);
+	return NULL;
+}
+
+/**
+ * nand_verify_code_init - ECC scheme @index of the pages to check
+ * @v:         self-check
+ * @index:     ECC scheme number
+ * @nand:      chip, with the ECC scheme of the pages
+ * @nbc:       its encoder, whose layout is used as it is
+ */
+int nand_verify_code_init(struct nand_verify *v, int index, const struct nand_chip *nand,
+                          const struct nand_bch_control *nbc)
+{
+	struct nand_verify_code *code = &v->codes[index];
+	unsigned int m, t, flags = BCH_ENCODE_ONLY;
+	unsigned char *erased;
+	int i;
+
+	code->ecc_mode = nand->ecc_mode;
+	code->page_size = nand->page_size;
+	code->ecc_sector = nand->ecc_sector;
+	code->ecc_bytes = nand->ecc_bytes;
+	code->ecc_offset = nand->ecc_offset;
+	code->layout = nbc->layout;
+	if (nand->ecc_mode != NAND_ECC_BCH)
+		return 0;
+
+	/* another encoder than the pages were encoded with */
+	if ((nbc->encode == encode_bch) && !nbc->slice_data)
+		flags |= nbc->bch->mod4_tab ? BCH_ENCODER_MOD8 : BCH_ENCODER_MOD4;
+
+	m = fls(1+8*nand->ecc_sector);
+	t = (nand->ecc_bytes*8)/m;
+	code->bch = init_bch(m, t, 0, flags);
+	code->mask = malloc(nand->ecc_bytes);
+	erased = malloc(nand->ecc_sector);
+	if (!code->bch || !code->mask || !erased) {
+		fprintf(stderr, "%s: Error when init BCH m=%u t=%u.\n", __func__, m, t);
+		free(erased);
+		return -1;
+	}
+
+	memset(erased, 0xff, nand->ecc_sector);
+	memset(code->mask, 0, nand->ecc_bytes);
+	encode_bch(code->bch, erased, nand->ecc_sector, code->mask);
+	for (i=0; i<nand->ecc_bytes; i++)
+		code->mask[i] ^= 0xff;
+	free(erased);
+	return 0;
+}
+
+/**
+ * nand_verify_pages - check the ECC codes of raw pages
+ * @v:         self-check
+ * @index:     ECC scheme of the pages
+ * @raw:       @npages consecutive raw pages, as written
+ * @page_no:   number of the first page
+ * @npages:    number of pages
+ * @flag:      FLAG_PMECC and FLAG_NO_MASK as they were encoded
+ * @scratch:   NAND_VERIFY_SCRATCH(raw_size) bytes
+ * @bad_page:  output, the page whose code does not match
+ *
+ * Returns the number of sectors checked, or -1 if a code does not match.
+ * Calls for the same @v can run concurrently, with their own @scratch.
+ */
+long nand_verify_pages(const struct nand_verify *v, int index, const unsigned char *raw,
+                       unsigned long page_no, int npages, unsigned int flag,
+                       unsigned char *scratch, unsigned long *bad_page)
+{
+	const struct nand_verify_code *code = &v->codes[index];
+	const int steps = code->page_size/code->ecc_sector;
+	unsigned char *sector = scratch + v->raw_size;
+	unsigned char *calc = sector + v->raw_size, *stored = calc + code->ecc_bytes;
+	const unsigned char *page, *data, *ecc;
+	int p, i, j;
+
+	for (p=0; p<npages; p++, raw += v->raw_size) {
+		page = raw;
+		if (!code->layout->identity) {
+			nand_layout_gather(code->layout, raw, scratch, 1);
+			page = scratch;
+		}
+
+		for (i=0; i<steps; i++) {
+			data = page + i*code->ecc_sector;
+			ecc = page + code->page_size + code->ecc_offset + i*code->ecc_bytes;
+			memcpy(stored, ecc, code->ecc_bytes);
+
+			if (flag & FLAG_PMECC) {
+				for (j=0; j<code->ecc_sector; j++)
+					sector[j] = v->rev_table[data[j]];
+				for (j=0; j<code->ecc_bytes; j++)
+					stored[j] = v->rev_table[stored[j]];
+				data = sector;
+			}
+
+			if (code->bch) {
+				memset(calc, 0, code->ecc_bytes);
+				encode_bch(code->bch, data, code->ecc_sector, calc);
+				for (j=0; !(flag & FLAG_NO_MASK) && (j<code->ecc_bytes); j++)
+					calc[j] ^= code->mask[j];
+			} else {
+				nand_hamming_calculate(data, code->ecc_sector, calc,
+				                       code->ecc_mode == NAND_ECC_HAMMING_SMC);
+			}
+
+			if (memcmp(calc, stored, code->ecc_bytes)) {
+				*bad_page = page_no + p;
+				return -1;
+			}
+		}
+	}
+
+	return (long)npages*steps;
+}
+
+static void *nand_verify_thread(void *data)
+{
+	struct nand_verify *v = data;
+	struct nand_verify_job *job;
+	long ret;
+
+	pthread_mutex_lock(&v->lock);
+	while (1) {
+		while ((v->head == v->tail) && !v->stop)
+			pthread_cond_wait(&v->cond, &v->lock);
+		if (v->head == v->tail)
+			break;
+		job = &v->jobs[v->head % v->slots];
+		pthread_mutex_unlock(&v->lock);
+
+		ret = -1;
+		if (!v->failed)
+			ret = nand_verify_pages(v, job->code, job->raw, job->page_no, job->npages,
+			                        job->flag, v->scratch, &v->bad_page);
+
+		pthread_mutex_lock(&v->lock);
+		if (ret < 0) {
+			v->failed = 1;
+		} else {
+			v->pages += job->npages;
+			v->sectors += ret;
+		}
+		v->head++;
+		pthread_cond_broadcast(&v->cond);
+	}
+	pthread_mutex_unlock(&v->lock);
+
+	return NULL;
+}
+
+/**
+ * nand_verify_start - start the self-check thread
+ * @v:         self-check with slots, and every ECC scheme set
+ *
+ * Without a thread, nand_verify_submit() checks the pages itself, as it does
+ * if the thread cannot be created.
+ */
+int nand_verify_start(struct nand_verify *v)
+{
+	pthread_mutex_init(&v->lock, NULL);
+	pthread_cond_init(&v->cond, NULL);
+	if (pthread_create(&v->thread, NULL, nand_verify_thread, v)) {
+		fprintf(stderr, "%s: Error when create self-check thread, checking in line.\n", __func__);
+		pthread_cond_destroy(&v->cond);
+		pthread_mutex_destroy(&v->lock);
+		return -1;
+	}
+	v->threaded = 1;
+	return 0;
+}
+
+/**
+ * nand_verify_submit - check raw pages on the self-check thread
+ * @v:         self-check
+ * @index:     ECC scheme of the pages
+ * @raw:       @npages consecutive raw pages, as written, copied
+ * @page_no:   number of the first page
+ * @npages:    number of pages, up to max_pages of nand_verify_init()
+ * @flag:      FLAG_PMECC and FLAG_NO_MASK as they were encoded
+ *
+ * Waits for a free slot if the thread is behind. Returns -1 if a code of
+ * these or earlier pages did not match, see @v->bad_page.
+ */
+int nand_verify_submit(struct nand_verify *v, int index, const unsigned char *raw,
+                       unsigned long page_no, int npages, unsigned int flag)
+{
+	struct nand_verify_job *job;
+	long ret;
+	int failed;
+
+	if (!v->threaded) {
+		ret = nand_verify_pages(v, index, raw, page_no, npages, flag, v->scratch, &v->bad_page);
+		if (ret < 0)
+			return -1;
+		v->pages += npages;
+		v->sectors += ret;
+		return 0;
+	}
+
+	pthread_mutex_lock(&v->lock);
+	while ((v->tail - v->head == v->slots) && !v->failed)
+		pthread_cond_wait(&v->cond, &v->lock);
+	failed = v->failed;
+	pthread_mutex_unlock(&v->lock);
+	if (failed)
+		return -1;
+
+	/* the slot at the tail is not the thread's until the tail moves */
+	job = &v->jobs[v->tail % v->slots];
+	job->code = index;
+	job->page_no = page_no;
+	job->npages = npages;
+	job->flag = flag;
+	memcpy(job->raw, raw, (size_t)npages*v->raw_size);
+
+	pthread_mutex_lock(&v->lock);
+	v->tail++;
+	pthread_cond_broadcast(&v->cond);
+	pthread_mutex_unlock(&v->lock);
+	return 0;
+}
+
+/**
+ * nand_verify_finish - wait for the pages handed to the thread
+ * @v:         self-check
+ *
+ * Returns -1 if a code did not match, see @v->bad_page.
+ */
+int nand_verify_finish(struct nand_verify *v)
+{
+	if (v->threaded) {
+		pthread_mutex_lock(&v->lock);
+		v->stop = 1;
+		pthread_cond_broadcast(&v->cond);
+		pthread_mutex_unlock(&v->lock);
+		pthread_join(v->thread, NULL);
+		pthread_cond_destroy(&v->cond);
+		pthread_mutex_destroy(&v->lock);
+		v->threaded = 0;
+	}
+
+	return v->failed ? -1 : 0;
+}
+
+void nand_verify_free(struct nand_verify *v)
+{
+	int i;
+
+	if (v == NULL)
+		return;
+
+	nand_verify_finish(v);
+	for (i=0; v->codes && (i<v->count); i++) {
+		free_bch(v->codes[i].bch);
+		free(v->codes[i].mask);
+	}
+	for (i=0; v->jobs && (i<v->slots); i++)
+		free(v->jobs[i].raw);
+	free(v->jobs);
+	free(v->codes);
+	free(v->scratch);
+	free(v);
+}
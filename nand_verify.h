@@ -0,0 +1,110 @@
+#ifndef _NAND_VERIFY_H
+#define _NAND_VERIFY_H
+
+#include <pthread.h>
+
+struct bch_control;
+struct nand_chip;
+struct nand_bch_control;
+struct nand_layout;
+
+/* scratch buffer of nand_verify_pages(): a built page, a sector and 2 codes */
+#define NAND_VERIFY_SCRATCH(_raw_size) (3*(_raw_size))
+
+/**
+ * struct nand_verify_code - ECC scheme of some pages, as the self-check sees it
+ * @ecc_mode:  NAND_ECC_BCH, NAND_ECC_HAMMING or NAND_ECC_HAMMING_SMC
+ * @page_size: data area size
+ * @ecc_sector: ECC sector size
+ * @ecc_bytes: ECC bytes per sector
+ * @ecc_offset: ECC code offset in the OOB area of a built page
+ * @layout:    raw page layout of the encoder
+ * @bch:       BCH control structure of its own, with another encoder than
+ *             the one of the pages, or NULL for Hamming
+ * @mask:      ECC code of an erased sector, inverted
+ */
+struct nand_verify_code {
+	int                      ecc_mode;
+	int                      page_size;
+	int                      ecc_sector;
+	int                      ecc_bytes;
+	int                      ecc_offset;
+	const struct nand_layout *layout;
+	struct bch_control       *bch;
+	unsigned char            *mask;
+};
+
+/**
+ * struct nand_verify_job - raw pages waiting for the self-check thread
+ * @code:      index of their ECC scheme
+ * @page_no:   number of the first page
+ * @npages:    number of pages
+ * @flag:      FLAG_PMECC and FLAG_NO_MASK as they were encoded
+ * @raw:       copy of the raw pages
+ */
+struct nand_verify_job {
+	int           code;
+	unsigned long page_no;
+	int           npages;
+	unsigned int  flag;
+	unsigned char *raw;
+};
+
+/**
+ * struct nand_verify - self-check of the ECC codes written by nandbch()
+ * @codes:     ECC schemes
+ * @count:     number of ECC schemes
+ * @raw_size:  raw page size
+ * @rev_table: bit reversal table for PMECC
+ * @jobs:      ring of pages handed to the thread, or NULL without a thread
+ * @slots:     size of the ring
+ * @threaded:  the thread is running
+ * @head:      next job of the thread
+ * @tail:      next free job
+ * @stop:      no more jobs
+ * @failed:    a code did not match, set by the thread under @lock
+ * @bad_page:  the page whose code did not match
+ * @scratch:   page and sector buffer of the thread, or of in line checks
+ * @pages:     pages checked
+ * @sectors:   sectors checked
+ */
+struct nand_verify {
+	struct nand_verify_code *codes;
+	int                     count;
+	int                     raw_size;
+	unsigned char           rev_table[256];
+	struct nand_verify_job  *jobs;
+	int                     slots;
+	int                     threaded;
+	unsigned long           head;
+	unsigned long           tail;
+	int                     stop;
+	int                     failed;
+	unsigned long           bad_page;
+	unsigned char           *scratch;
+	unsigned long           pages;
+	unsigned long           sectors;
+	pthread_t               thread;
+	pthread_mutex_t         lock;
+	pthread_cond_t          cond;
+};
+
+struct nand_verify *nand_verify_init(int count, int raw_size, int max_pages, int slots);
+
+int nand_verify_code_init(struct nand_verify *v, int index, const struct nand_chip *nand,
+                          const struct nand_bch_control *nbc);
+
+long nand_verify_pages(const struct nand_verify *v, int index, const unsigned char *raw,
+                       unsigned long page_no, int npages, unsigned int flag,
+                       unsigned char *scratch, unsigned long *bad_page);
+
+int nand_verify_start(struct nand_verify *v);
+
+int nand_verify_submit(struct nand_verify *v, int index, const unsigned char *raw,
+                       unsigned long page_no, int npages, unsigned int flag);
+
+int nand_verify_finish(struct nand_verify *v);
+
+void nand_verify_free(struct nand_verify *v);
+
+#endif /* _NAND_VERIFY_H */
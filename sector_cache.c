@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "os_swap.h"
+#include "sector_cache.h"
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline u64 fmix64(u64 k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+
+	return k;
+}
+
+/*
+ * 128-bit hash with the MurmurHash3 x64_128 mixing; the tail is zero padded
+ * to a full block, which is fine since all sectors of a run have one size
+ */
+static void sector_hash(const unsigned char *data, unsigned int len, struct sector_key *key)
+{
+	const u64 c1 = 0x87c37b91114253d5ULL;
+	const u64 c2 = 0x4cf5ad432745937fULL;
+	u64 h1 = 0, h2 = 0, k1, k2, block[2];
+	unsigned int i;
+
+	for (i = 0; i < len; i += 16) {
+		if (len - i < 16) {
+			memset(block, 0, sizeof(block));
+			memcpy(block, data + i, len - i);
+		} else {
+			memcpy(block, data + i, sizeof(block));
+		}
+		k1 = block[0];
+		k2 = block[1];
+
+		k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = ROTL64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+
+		k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = ROTL64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+	}
+
+	h1 ^= len;
+	h2 ^= len;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+
+	key->h[0] = h1;
+	key->h[1] = h2;
+}
+
+/**
+ * sector_cache_init - allocate a sector ECC cache
+ * @entries:   maximum number of cached codes, rounded down to a power of 2
+ * @ecc_bytes: ECC code size
+ */
+struct sector_cache *sector_cache_init(unsigned long entries, unsigned int ecc_bytes)
+{
+	struct sector_cache *cache;
+
+	if (!entries)
+		return NULL;
+
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL)
+		return NULL;
+
+	while (entries & (entries - 1))
+		entries &= entries - 1;
+
+	cache->mask = entries - 1;
+	cache->ecc_bytes = ecc_bytes;
+	cache->entry_size = ALIGN(sizeof(struct sector_key) + ecc_bytes, sizeof(u64));
+	/* zeroed keys never match, a real hash of 0 is not worth caring about */
+	cache->entries = calloc(entries, cache->entry_size);
+	if (cache->entries == NULL) {
+		free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+void sector_cache_free(struct sector_cache *cache)
+{
+	if (cache) {
+		free(cache->entries);
+		free(cache);
+	}
+}
+
+/**
+ * sector_cache_get - look up the ECC code of a sector
+ * @cache:     sector cache
+ * @data:      sector data
+ * @len:       sector size
+ * @key:       output key of @data, to pass to sector_cache_put() on a miss
+ * @ecc:       output ECC code, on a hit
+ *
+ * Returns 1 on a hit, 0 on a miss.
+ */
+int sector_cache_get(struct sector_cache *cache, const unsigned char *data, unsigned int len,
+                     struct sector_key *key, unsigned char *ecc)
+{
+	const unsigned char *entry;
+
+	sector_hash(data, len, key);
+	entry = cache->entries + (key->h[0] & cache->mask)*cache->entry_size;
+
+	if (memcmp(entry, key, sizeof(*key))) {
+		cache->misses++;
+		return 0;
+	}
+
+	memcpy(ecc, entry + sizeof(*key), cache->ecc_bytes);
+	cache->hits++;
+	return 1;
+}
+
+/**
+ * sector_cache_put - store the ECC code of a sector, replacing older codes
+ * @cache:     sector cache
+ * @key:       key returned by sector_cache_get()
+ * @ecc:       ECC code
+ */
+void sector_cache_put(struct sector_cache *cache, const struct sector_key *key,
+                      const unsigned char *ecc)
+{
+	unsigned char *entry = cache->entries + (key->h[0] & cache->mask)*cache->entry_size;
+
+	memcpy(entry, key, sizeof(*key));
+	memcpy(entry + sizeof(*key), ecc, cache->ecc_bytes);
+}
@@ -0,0 +1,39 @@
+#ifndef _SECTOR_CACHE_H
+#define _SECTOR_CACHE_H
+
+/**
+ * struct sector_key - 128-bit hash of a sector content
+ */
+struct sector_key {
+	u64 h[2];
+};
+
+/**
+ * struct sector_cache - ECC codes of recently seen sectors, keyed by content
+ * @mask:      number of entries minus one, entries are direct mapped
+ * @entry_size: size of an entry, a key followed by its ECC code
+ * @ecc_bytes: ECC code size
+ * @entries:   entry array
+ * @hits:      lookups which returned a cached code
+ * @misses:    lookups which did not
+ */
+struct sector_cache {
+	unsigned long  mask;
+	size_t         entry_size;
+	unsigned int   ecc_bytes;
+	unsigned char  *entries;
+	unsigned long  hits;
+	unsigned long  misses;
+};
+
+struct sector_cache *sector_cache_init(unsigned long entries, unsigned int ecc_bytes);
+
+void sector_cache_free(struct sector_cache *cache);
+
+int sector_cache_get(struct sector_cache *cache, const unsigned char *data, unsigned int len,
+                     struct sector_key *key, unsigned char *ecc);
+
+void sector_cache_put(struct sector_cache *cache, const struct sector_key *key,
+                      const unsigned char *ecc);
+
+#endif /* _SECTOR_CACHE_H */
@@ -0,0 +1,131 @@
+/*
+ * Generate BCH encoders specialized for the (m, t) parameters of the
+ * predefined NAND Flash models in nand_chips.h
+ *
+ * Run on the build host; the generated C code is written to stdout.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "os_swap.h"
+#include "bch.h"
+#include "nand_bch.h"
+#include "nand_chips.h"
+
+/* remainder tables, 4 x 256 entries of l words */
+static void gen_table(struct bch_control *bch, unsigned int l)
+{
+	unsigned int i;
+
+	printf("static const uint32_t mod8_tab_m%u_t%u[%u] = {",
+	       bch->m, bch->t, 1024*l);
+	for (i = 0; i < 1024*l; i++)
+		printf("%s0x%08x,", (i % 6) ? " " : "\n\t", bch->mod8_tab[i]);
+	printf("\n};\n\n");
+}
+
+/* one byte of input, as encode_bch_unaligned() */
+static void gen_byte_step(unsigned int l)
+{
+	unsigned int i;
+
+	printf("\t\tp0 = tab + %u*(((r0 >> 24)^(*data++)) & 0xff);\n", l);
+	for (i = 0; i+1 < l; i++)
+		printf("\t\tr%u = ((r%u << 8)|(r%u >> 24))^p0[%u];\n", i, i, i+1, i);
+	printf("\t\tr%u = (r%u << 8)^p0[%u];\n", l-1, l-1, l-1);
+}
+
+static void gen_encoder(struct bch_control *bch)
+{
+	const unsigned int l = DIV_ROUND_UP(bch->m*bch->t, 32);
+	const unsigned int m = bch->m, t = bch->t;
+	unsigned int i, j, b;
+
+	gen_table(bch, l);
+
+	printf("static void encode_bch_m%u_t%u(struct bch_control *bch, const uint8_t *data,\n"
+	       "\t\t\t\tunsigned int len, uint8_t *ecc)\n{\n", m, t);
+	printf("\tconst uint32_t * const tab = mod8_tab_m%u_t%u;\n", m, t);
+	printf("\tconst uint32_t *p0, *p1, *p2, *p3;\n\tuint32_t w");
+	for (i = 0; i < l; i++)
+		printf(", r%u", i);
+	printf(";\n\n");
+
+	/* load ecc parity bytes, zero-padded, as load_ecc8() */
+	for (i = 0; i < l; i++) {
+		printf("\tr%u = 0", i);
+		for (j = 0; j < 4; j++) {
+			b = 4*i+j;
+			if (b < bch->ecc_bytes)
+				printf("|((uint32_t)ecc[%u] << %u)", b, 24-8*j);
+		}
+		printf(";\n");
+	}
+
+	printf("\n\t/* process first unaligned data bytes */\n"
+	       "\twhile (len && (((unsigned long)data) & 3)) {\n");
+	gen_byte_step(l);
+	printf("\t\tlen--;\n\t}\n");
+
+	printf("\n\t/* process 32-bit aligned data words, see encode_bch() */\n"
+	       "\tfor (; len >= 4; len -= 4, data += 4) {\n"
+	       "\t\tw = r0^cpu_to_be32(*(const uint32_t *)data);\n");
+	for (b = 0; b < 4; b++)
+		printf("\t\tp%u = tab + %u + %u*((w >> %2u) & 0xff);\n", b, 256*l*b, l, 8*b);
+	for (i = 0; i < l; i++) {
+		printf("\t\tr%u = ", i);
+		if (i+1 < l)
+			printf("r%u^", i+1);
+		printf("p0[%u]^p1[%u]^p2[%u]^p3[%u];\n", i, i, i, i);
+	}
+	printf("\t}\n");
+
+	printf("\n\t/* process last unaligned bytes */\n\twhile (len--) {\n");
+	gen_byte_step(l);
+	printf("\t}\n\n");
+
+	/* store ecc parity bytes, as store_ecc8() */
+	for (b = 0; b < bch->ecc_bytes; b++)
+		printf("\tecc[%u] = r%u >> %u;\n", b, b/4, 24-8*(b%4));
+	printf("}\n\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i, j, m, t, n = 0;
+	struct bch_control *bch[CHIP_COUNT];
+
+	printf("/*\n * Generated by tools/bchgen from nand_chips.h, do not edit.\n */\n"
+	       "#include <stdio.h>\n#include <stdlib.h>\n#include <string.h>\n\n"
+	       "#include \"os_swap.h\"\n#include \"bch.h\"\n#include \"bch_gen.h\"\n\n");
+
+	for (i = 0; i < CHIP_COUNT; i++) {
+		m = fls(1+8*chips[i].ecc_sector);
+		t = (chips[i].ecc_bytes*8)/m;
+
+		for (j = 0; j < n; j++)
+			if ((bch[j]->m == m) && (bch[j]->t == t))
+				break;
+		if (j < n)
+			continue;
+
+		bch[n] = init_bch(m, t, 0, BCH_ENCODE_ONLY|BCH_ENCODER_MOD8);
+		if (bch[n] == NULL) {
+			fprintf(stderr, "%s: Error when init BCH m=%u t=%u for %s.\n",
+			        argv[0], m, t, chips[i].name);
+			return -1;
+		}
+		gen_encoder(bch[n++]);
+	}
+
+	printf("const struct bch_gen_encoder bch_gen_encoders[] = {\n");
+	for (i = 0; i < n; i++) {
+		printf("\t{ %u, %u, 0x%x, encode_bch_m%u_t%u },\n", bch[i]->m,
+		       bch[i]->t, bch[i]->prim_poly, bch[i]->m, bch[i]->t);
+		free_bch(bch[i]);
+	}
+	printf("\t{ 0, 0, 0, NULL }\n};\n");
+
+	return 0;
+}
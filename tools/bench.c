@@ -0,0 +1,401 @@
+/*
+ * Encode throughput benchmark
+ *
+ * Measures every available BCH encoding kernel for the predefined NAND Flash
+ * models of nand_chips.h and for a sweep of (m, t, sector size) parameters,
+ * and the Hamming engine, on erased and random data. Results are printed as
+ * a table, CSV or JSON.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "os_swap.h"
+#include "bch.h"
+#include "nand_bch.h"
+#include "nand_chips.h"
+#include "perf_counters.h"
+
+#define BENCH_SECTORS BCH_SLICE_LANES
+#define BENCH_ECC_MAX 128
+
+/**
+ * struct bench_result - one measurement
+ * @config:   chip name, or "sweep"
+ * @kernel:   encoding kernel
+ * @data:     "random" or "erased"
+ * @order:    "normal", or "pmecc" for bit reversed data
+ * @m:        Galois field order
+ * @t:        error correction capability
+ * @sector:   ECC sector size
+ * @mbps:     throughput in MB/s
+ * @cpb:      time stamp counter cycles per byte, 0 when not available
+ * @perf:     hardware counters per byte, see perf_counter_names[], -1 when
+ *            not available
+ */
+struct bench_result {
+	const char   *config;
+	const char   *kernel;
+	const char   *data;
+	const char   *order;
+	unsigned int m;
+	unsigned int t;
+	unsigned int sector;
+	double       mbps;
+	double       cpb;
+	double       perf[PERF_COUNTERS];
+};
+
+/**
+ * struct bench_ctx - data of one kernel measurement
+ * @bch:      BCH control structure, NULL for the "hamming" kernel
+ * @nbc:      NAND BCH control structure, for the "nand" kernel
+ * @encode:   encoder of the "mod8", "mod4" and "gen" kernels
+ * @data:     BENCH_SECTORS sectors
+ * @ecc:      BENCH_SECTORS ecc codes
+ * @sector:   ECC sector size
+ * @rev:      bit reversal table, for PMECC order
+ */
+struct bench_ctx {
+	struct bch_control      *bch;
+	struct nand_bch_control *nbc;
+	bch_encode_fn           encode;
+	unsigned char           *data[BENCH_SECTORS];
+	unsigned char           *ecc[BENCH_SECTORS];
+	unsigned int            sector;
+	const unsigned char     *rev;
+};
+
+static double bench_time = 0.2;
+static enum bench_format bench_format = FORMAT_TABLE;
+static int bench_count;
+static struct perf_counters perf = {
+	.fd = { -1, -1, -1, -1, -1 },
+};
+
+static unsigned long long cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void reverse(const unsigned char *rev, unsigned char *buf, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = rev[buf[i]];
+}
+
+/* encode all sectors once with the kernel of @ctx */
+static void bench_encode(struct bench_ctx *ctx, const char *kernel)
+{
+	unsigned int i;
+
+	if (!strcmp(kernel, "bitslice")) {
+		encode_bch_bitslice(ctx->bch, BENCH_SECTORS,
+		                    (const uint8_t *const *)ctx->data, ctx->sector,
+		                    ctx->ecc);
+		return;
+	}
+
+	for (i = 0; i < BENCH_SECTORS; i++) {
+		/* PMECC order: reverse data in, and back as nandbch() does */
+		if (ctx->rev)
+			reverse(ctx->rev, ctx->data[i], ctx->sector);
+		if (ctx->nbc) {
+			nand_bch_calculate_ecc(ctx->nbc, ctx->data[i], ctx->sector, ctx->ecc[i], 0);
+		} else {
+			memset(ctx->ecc[i], 0, ctx->bch->ecc_bytes);
+			ctx->encode(ctx->bch, ctx->data[i], ctx->sector, ctx->ecc[i]);
+		}
+		if (ctx->rev) {
+			reverse(ctx->rev, ctx->data[i], ctx->sector);
+			reverse(ctx->rev, ctx->ecc[i], ctx->bch ? ctx->bch->ecc_bytes : NAND_HAMMING_BYTES);
+		}
+	}
+}
+
+static void print_result(const struct bench_result *r)
+{
+	switch (bench_format) {
+	case FORMAT_TABLE:
+		if (!bench_count) {
+			printf("%-36s %-8s %-6s %-6s %3s %3s %6s %10s %8s", "config", "kernel",
+			       "data", "order", "m", "t", "sector", "MB/s", "tsc/B");
+			perf_counters_print_header(bench_format);
+		}
+		printf("%-36s %-8s %-6s %-6s %3u %3u %6u %10.1f %8.2f", r->config, r->kernel,
+		       r->data, r->order, r->m, r->t, r->sector, r->mbps, r->cpb);
+		perf_counters_print(r->perf, bench_format);
+		printf("\n");
+		break;
+	case FORMAT_CSV:
+		if (!bench_count) {
+			printf("config,kernel,data,order,m,t,sector,mbps,cycles_per_byte");
+			perf_counters_print_header(bench_format);
+		}
+		printf("\"%s\",%s,%s,%s,%u,%u,%u,%.1f,%.2f", r->config, r->kernel, r->data,
+		       r->order, r->m, r->t, r->sector, r->mbps, r->cpb);
+		perf_counters_print(r->perf, bench_format);
+		printf("\n");
+		break;
+	case FORMAT_JSON:
+		printf("%s\n  {\"config\": \"%s\", \"kernel\": \"%s\", \"data\": \"%s\", "
+		       "\"order\": \"%s\", \"m\": %u, \"t\": %u, \"sector\": %u, "
+		       "\"mbps\": %.1f, \"cycles_per_byte\": %.2f",
+		       bench_count ? "," : "[", r->config, r->kernel, r->data, r->order,
+		       r->m, r->t, r->sector, r->mbps, r->cpb);
+		perf_counters_print(r->perf, bench_format);
+		printf("}");
+		break;
+	}
+	bench_count++;
+	fflush(stdout);
+}
+
+/* run a kernel on erased then random data for at least bench_time seconds */
+static void bench_kernel(struct bench_ctx *ctx, const char *config, const char *kernel,
+                         const char *order)
+{
+	struct bench_result r = { config, kernel, NULL, order, ctx->bch ? ctx->bch->m : 0,
+	                          ctx->bch ? ctx->bch->t : 1, ctx->sector };
+	unsigned long long c0, bytes;
+	unsigned int i, j, pass;
+	double t0, t;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < BENCH_SECTORS; i++)
+			for (j = 0; j < ctx->sector; j++)
+				ctx->data[i][j] = pass ? rand() : 0xff;
+		r.data = pass ? "random" : "erased";
+
+		bench_encode(ctx, kernel); // warm up tables and caches
+		bytes = 0;
+		perf_counters_start(&perf);
+		t0 = now();
+		c0 = cycles();
+		do {
+			bench_encode(ctx, kernel);
+			bytes += BENCH_SECTORS*ctx->sector;
+			t = now() - t0;
+		} while (t < bench_time);
+		perf_counters_stop(&perf);
+
+		r.mbps = bytes/t/1e6;
+		r.cpb = (double)(cycles() - c0)/bytes;
+		perf_counters_per_byte(&perf, bytes, r.perf);
+		print_result(&r);
+	}
+}
+
+static bch_encode_fn gen_encoder(unsigned int m, unsigned int t, unsigned int prim_poly)
+{
+	const struct bch_gen_encoder *gen;
+
+	for (gen = bch_gen_encoders; gen->encode; gen++)
+		if ((gen->m == m) && (gen->t == t) && (gen->prim_poly == prim_poly))
+			return gen->encode;
+	return NULL;
+}
+
+/* run every raw encoding kernel for one set of parameters */
+static int bench_params(struct bench_ctx *ctx, const char *config, unsigned int m,
+                        unsigned int t)
+{
+	static const struct {
+		const char   *name;
+		unsigned int flags;
+	} kernels[] = {
+		{ "mod8",     BCH_ENCODER_MOD8 },
+		{ "mod4",     BCH_ENCODER_MOD4 },
+		{ "gen",      BCH_ENCODER_MOD8 },
+		{ "bitslice", 0 },
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(kernels); i++) {
+		ctx->bch = init_bch(m, t, 0, BCH_ENCODE_ONLY|kernels[i].flags);
+		if (ctx->bch == NULL) {
+			fprintf(stderr, "%s: Error when init BCH m=%u t=%u.\n", __func__, m, t);
+			return -1;
+		}
+		ctx->encode = encode_bch;
+		if (!strcmp(kernels[i].name, "gen"))
+			ctx->encode = gen_encoder(m, t, ctx->bch->prim_poly);
+		if (ctx->encode)
+			bench_kernel(ctx, config, kernels[i].name, "normal");
+		free_bch(ctx->bch);
+	}
+
+	return 0;
+}
+
+/* run nand_bch_calculate_ecc(), as used by nandbch(), for a chip */
+static int bench_chip(struct bench_ctx *ctx, struct nand_chip *chip, const unsigned char *rev)
+{
+	ctx->nbc = nand_bch_init(chip, 0, NULL);
+	if (ctx->nbc == NULL) {
+		fprintf(stderr, "%s: Error when init %s.\n", __func__, chip->name);
+		return -1;
+	}
+	ctx->bch = ctx->nbc->bch;
+
+	ctx->rev = NULL;
+	bench_kernel(ctx, chip->name, "nand", "normal");
+	ctx->rev = rev;
+	bench_kernel(ctx, chip->name, "nand", "pmecc");
+	ctx->rev = NULL;
+
+	nand_bch_free(ctx->nbc);
+	ctx->nbc = NULL;
+	return 0;
+}
+
+/* run nand_bch_calculate_ecc() with the Hamming ECC scheme */
+static int bench_hamming(struct bench_ctx *ctx, unsigned int sector)
+{
+	struct nand_chip chip = {
+		.name = "hamming", .page_size = 2048, .spare_size = 64,
+		.ecc_sector = sector, .ecc_bytes = NAND_HAMMING_BYTES,
+		.ecc_offset = 64 - 2048/sector*NAND_HAMMING_BYTES, .ecc_mode = NAND_ECC_HAMMING,
+	};
+
+	ctx->nbc = nand_bch_init(&chip, 0, NULL);
+	if (ctx->nbc == NULL) {
+		fprintf(stderr, "%s: Error when init %u byte sectors.\n", __func__, sector);
+		return -1;
+	}
+	ctx->bch = NULL;
+	ctx->sector = sector;
+	bench_kernel(ctx, chip.name, "hamming", "normal");
+
+	nand_bch_free(ctx->nbc);
+	ctx->nbc = NULL;
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: nandbch-bench [OPTION]\n"
+		"Measure BCH encoding throughput\n"
+		"\n"
+		"Options:\n"
+		"  -t, --time=SEC    Minimum time per measurement, default 0.2\n"
+		"  -c, --csv         Print results as CSV\n"
+		"  -j, --json        Print results as JSON\n"
+		"      --no-perf     Do not read hardware performance counters\n"
+		"      --no-sweep    Only measure the predefined NAND Flash models\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned int sweep_sectors[] = { 512, 1024, 2048 };
+	static const unsigned int sweep_t[] = { 4, 8, 16, 24, 40 };
+	static struct option options[] = {
+		{"time"    , required_argument, NULL, 't'},
+		{"csv"     , no_argument      , NULL, 'c'},
+		{"json"    , no_argument      , NULL, 'j'},
+		{"no-perf" , no_argument      , NULL, 'P'},
+		{"no-sweep", no_argument      , NULL, 'S'},
+		{"help"    , no_argument      , NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+	struct bench_ctx ctx;
+	struct nand_chip chip;
+	unsigned char rev[256];
+	unsigned int i, j, m, t, max_sector = 0;
+	int opt, sweep = 1, use_perf = 1, ret = 0;
+
+	while ((opt = getopt_long(argc, argv, "t:cjh", options, NULL)) >= 0) {
+		switch (opt) {
+		case 't':
+			bench_time = strtod(optarg, NULL);
+			break;
+		case 'c':
+			bench_format = FORMAT_CSV;
+			break;
+		case 'j':
+			bench_format = FORMAT_JSON;
+			break;
+		case 'P':
+			use_perf = 0;
+			break;
+		case 'S':
+			sweep = 0;
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 0, rev[i] = 0; j < 8; j++)
+			if (i & (1 << j))
+				rev[i] |= 0x80 >> j;
+
+	for (i = 0; i < CHIP_COUNT; i++)
+		if (chips[i].ecc_sector > max_sector)
+			max_sector = chips[i].ecc_sector;
+	for (i = 0; i < ARRAY_SIZE(sweep_sectors); i++)
+		if (sweep_sectors[i] > max_sector)
+			max_sector = sweep_sectors[i];
+
+	memset(&ctx, 0, sizeof(ctx));
+	for (i = 0; i < BENCH_SECTORS; i++) {
+		ctx.data[i] = malloc(max_sector);
+		ctx.ecc[i] = malloc(BENCH_ECC_MAX);
+		if (!ctx.data[i] || !ctx.ecc[i]) {
+			fprintf(stderr, "%s: Error when malloc buffers.\n", argv[0]);
+			return -1;
+		}
+	}
+	srand(1);
+
+	if (use_perf && !perf_counters_open(&perf))
+		fprintf(stderr, "%s: Hardware performance counters not available.\n", argv[0]);
+
+	for (i = 0; (i < CHIP_COUNT) && !ret; i++) {
+		chip = chips[i];
+		if (chip.ecc_offset == -1)
+			chip.ecc_offset = chip.spare_size - (chip.page_size/chip.ecc_sector*chip.ecc_bytes);
+		m = fls(1+8*chip.ecc_sector);
+		t = (chip.ecc_bytes*8)/m;
+		ctx.sector = chip.ecc_sector;
+		ret = bench_params(&ctx, chip.name, m, t);
+		if (!ret)
+			ret = bench_chip(&ctx, &chip, rev);
+	}
+
+	if (!ret)
+		ret = bench_hamming(&ctx, 256);
+	if (!ret)
+		ret = bench_hamming(&ctx, 512);
+
+	for (i = 0; sweep && (i < ARRAY_SIZE(sweep_sectors)) && !ret; i++) {
+		for (j = 0; (j < ARRAY_SIZE(sweep_t)) && !ret; j++) {
+			ctx.sector = sweep_sectors[i];
+			m = fls(1+8*ctx.sector);
+			ret = bench_params(&ctx, "sweep", m, sweep_t[j]);
+		}
+	}
+
+	if ((bench_format == FORMAT_JSON) && bench_count)
+		printf("\n]\n");
+
+	for (i = 0; i < BENCH_SECTORS; i++) {
+		free(ctx.data[i]);
+		free(ctx.ecc[i]);
+	}
+	perf_counters_close(&perf);
+	return ret;
+}
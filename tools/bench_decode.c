@@ -0,0 +1,384 @@
+/*
+ * Decode benchmark
+ *
+ * Encodes random sectors, injects exactly k random bit flips in data and ecc
+ * (k = 0...t, and t+1 for uncorrectable codewords), then times decode_bch()
+ * end to end, decode_bch_batch() on all the sectors at once, and each stage
+ * of decode_bch(): ecc computation, syndromes, error locator polynomial and
+ * root finding (BTZ and Chien search). Every corrected location is checked
+ * against the injected ones.
+ *
+ * Built with CONFIG_BCH_STAGE_API, which exports the decode_bch() stages.
+ */
+#define CONFIG_BCH_STAGE_API
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "os_swap.h"
+#include "bch.h"
+#include "nand_bch.h"
+#include "nand_chips.h"
+#include "perf_counters.h"
+
+#define DEC_SECTORS    64
+
+/**
+ * struct dec_result - one measurement, times are in ns per codeword
+ * @config:   chip name, or "sweep"
+ * @m:        Galois field order
+ * @t:        error correction capability
+ * @sector:   ECC sector size
+ * @k:        injected bit flips per codeword
+ * @decode:   decode_bch() end to end
+ * @batch:    decode_bch_batch() of DEC_SECTORS codewords, per codeword
+ * @ecc:      received data ecc computation
+ * @syn:      syndromes
+ * @elp:      error locator polynomial
+ * @btz:      root finding with the BTZ algorithm
+ * @chien:    root finding with a Chien search
+ * @perf:     hardware counters per data byte during decode_bch(), see
+ *            perf_counter_names[], -1 when not available
+ * @failed:   codewords with up to t errors not corrected exactly by
+ *            decode_bch(), decode_bch_batch() or by the Chien search, or
+ *            with t+1 errors not
+ *            reported as uncorrectable (miscorrections)
+ */
+struct dec_result {
+	const char   *config;
+	unsigned int m;
+	unsigned int t;
+	unsigned int sector;
+	unsigned int k;
+	double       decode;
+	double       batch;
+	double       ecc;
+	double       syn;
+	double       elp;
+	double       btz;
+	double       chien;
+	double       perf[PERF_COUNTERS];
+	unsigned int failed;
+};
+
+static double bench_time = 0.1;
+static enum bench_format bench_format = FORMAT_TABLE;
+static int bench_count;
+static struct perf_counters perf = {
+	.fd = { -1, -1, -1, -1, -1 },
+};
+static int use_chien = 1;
+
+static int cmp_uint(const void *a, const void *b)
+{
+	const unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * flip @k distinct random bits of a codeword; locations follow decode_bch():
+ * bit l is bit l%8 of byte l/8 of data followed by ecc
+ */
+static void inject(struct bch_control *bch, unsigned char *data, unsigned int len,
+                   unsigned char *ecc, unsigned int k, unsigned int *loc)
+{
+	const unsigned int nbits = 8*len + 8*bch->ecc_bytes;
+	unsigned int i, j, l, q;
+
+	for (i = 0; i < k; i++) {
+		do {
+			l = rand() % nbits;
+			/* skip ecc padding bits, beyond ecc_bits in MSB first order */
+			q = l - 8*len;
+			if ((l >= 8*len) && ((q & ~7) + 7 - (q & 7) >= bch->ecc_bits))
+				continue;
+			for (j = 0; (j < i) && (loc[j] != l); j++)
+				;
+			if (j == i)
+				break;
+		} while (1);
+
+		loc[i] = l;
+		if (l < 8*len)
+			data[l/8] ^= 1 << (l % 8);
+		else
+			ecc[q/8] ^= 1 << (q % 8);
+	}
+	qsort(loc, k, sizeof(*loc), cmp_uint);
+}
+
+static void print_result(const struct dec_result *r)
+{
+	switch (bench_format) {
+	case FORMAT_TABLE:
+		if (!bench_count) {
+			printf("%-36s %3s %3s %6s %3s %9s %9s %8s %8s %8s %9s %9s %6s", "config", "m", "t",
+			       "sector", "k", "decode", "batch", "ecc", "syn", "elp", "btz", "chien", "failed");
+			perf_counters_print_header(bench_format);
+		}
+		printf("%-36s %3u %3u %6u %3u %9.0f %9.0f %8.0f %8.0f %8.0f %9.0f %9.0f %6u", r->config,
+		       r->m, r->t, r->sector, r->k, r->decode, r->batch, r->ecc, r->syn, r->elp, r->btz,
+		       r->chien, r->failed);
+		perf_counters_print(r->perf, bench_format);
+		printf("\n");
+		break;
+	case FORMAT_CSV:
+		if (!bench_count) {
+			printf("config,m,t,sector,k,decode_ns,batch_ns,ecc_ns,syndromes_ns,elp_ns,btz_ns,"
+			       "chien_ns,failed");
+			perf_counters_print_header(bench_format);
+		}
+		printf("\"%s\",%u,%u,%u,%u,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%u", r->config, r->m, r->t,
+		       r->sector, r->k, r->decode, r->batch, r->ecc, r->syn, r->elp, r->btz, r->chien,
+		       r->failed);
+		perf_counters_print(r->perf, bench_format);
+		printf("\n");
+		break;
+	case FORMAT_JSON:
+		printf("%s\n  {\"config\": \"%s\", \"m\": %u, \"t\": %u, \"sector\": %u, \"k\": %u, "
+		       "\"decode_ns\": %.0f, \"batch_ns\": %.0f, \"ecc_ns\": %.0f, "
+		       "\"syndromes_ns\": %.0f, \"elp_ns\": %.0f, \"btz_ns\": %.0f, \"chien_ns\": %.0f, "
+		       "\"failed\": %u",
+		       bench_count ? "," : "[", r->config, r->m, r->t, r->sector, r->k, r->decode,
+		       r->batch, r->ecc, r->syn, r->elp, r->btz, r->chien, r->failed);
+		perf_counters_print(r->perf, bench_format);
+		printf("}");
+		break;
+	}
+	bench_count++;
+	fflush(stdout);
+}
+
+/* check decoded locations against the injected ones */
+static int check(int nerr, unsigned int *errloc, const unsigned int *loc, unsigned int k,
+                 unsigned int t)
+{
+	if (k > t)
+		return nerr == -EBADMSG;
+	if (nerr != k)
+		return 0;
+	qsort(errloc, k, sizeof(*errloc), cmp_uint);
+	return !memcmp(errloc, loc, k*sizeof(*loc));
+}
+
+static int bench_decode(const char *config, unsigned int m, unsigned int t, unsigned int sector)
+{
+	struct dec_result r = { config, m, t, sector };
+	struct bch_control *bch;
+	unsigned char *data, *ecc;
+	const uint8_t *data_ptr[DEC_SECTORS], *ecc_ptr[DEC_SECTORS];
+	unsigned int *loc, *errloc, *batch_errloc;
+	int batch_nerr[DEC_SECTORS];
+	unsigned int i, k, s, n;
+	double t0, t1, t2, t3, t4;
+	int nerr, err, ret = -1;
+
+	bch = init_bch(m, t, 0, 0);
+	if (bch == NULL) {
+		fprintf(stderr, "%s: Error when init BCH m=%u t=%u.\n", __func__, m, t);
+		return -1;
+	}
+
+	data = malloc(DEC_SECTORS*sector);
+	ecc = calloc(DEC_SECTORS, bch->ecc_bytes);
+	loc = malloc(DEC_SECTORS*(t+1)*sizeof(*loc));
+	errloc = malloc((t+1)*sizeof(*errloc));
+	batch_errloc = malloc(DEC_SECTORS*t*sizeof(*batch_errloc));
+	if (!data || !ecc || !loc || !errloc || !batch_errloc) {
+		fprintf(stderr, "%s: Error when malloc buffers.\n", __func__);
+		goto OUT;
+	}
+
+	for (k = 0; k <= t+1; k++) {
+		for (s = 0; s < DEC_SECTORS; s++) {
+			for (i = 0; i < sector; i++)
+				data[s*sector+i] = rand();
+			memset(ecc + s*bch->ecc_bytes, 0, bch->ecc_bytes);
+			encode_bch(bch, data + s*sector, sector, ecc + s*bch->ecc_bytes);
+			inject(bch, data + s*sector, sector, ecc + s*bch->ecc_bytes, k, loc + s*(t+1));
+		}
+
+		r.k = k;
+		r.failed = 0;
+
+		/* end to end, and correctness */
+		n = 0;
+		perf_counters_start(&perf);
+		t0 = now();
+		do {
+			for (s = 0; s < DEC_SECTORS; s++) {
+				nerr = decode_bch(bch, data + s*sector, sector, ecc + s*bch->ecc_bytes,
+				                  NULL, NULL, errloc);
+				if (!n && !check(nerr, errloc, loc + s*(t+1), k, t))
+					r.failed++;
+			}
+			n++;
+		} while (now() - t0 < bench_time);
+		r.decode = (now() - t0)*1e9/(n*DEC_SECTORS);
+		perf_counters_stop(&perf);
+		perf_counters_per_byte(&perf, (unsigned long long)n*DEC_SECTORS*sector, r.perf);
+
+		/* every sector at once, error locators side by side */
+		for (s = 0; s < DEC_SECTORS; s++) {
+			data_ptr[s] = data + s*sector;
+			ecc_ptr[s] = ecc + s*bch->ecc_bytes;
+		}
+		n = 0;
+		t0 = now();
+		do {
+			decode_bch_batch(bch, DEC_SECTORS, data_ptr, sector, ecc_ptr, batch_errloc,
+			                 batch_nerr);
+			for (s = 0; !n && (s < DEC_SECTORS); s++)
+				if (!check(batch_nerr[s], batch_errloc + s*t, loc + s*(t+1), k, t))
+					r.failed++;
+			n++;
+		} while (now() - t0 < bench_time);
+		r.batch = (now() - t0)*1e9/(n*DEC_SECTORS);
+
+		/* stages */
+		r.ecc = r.syn = r.elp = r.btz = r.chien = 0;
+		n = 0;
+		t0 = now();
+		do {
+			for (s = 0; s < DEC_SECTORS; s++) {
+				t1 = now();
+				err = bch_stage_ecc(bch, data + s*sector, sector, ecc + s*bch->ecc_bytes);
+				t2 = now();
+				r.ecc += t2 - t1;
+				if (err <= 0)
+					continue;
+
+				bch_stage_syndromes(bch);
+				t3 = now();
+				err = bch_stage_elp(bch);
+				t4 = now();
+				r.syn += t3 - t2;
+				r.elp += t4 - t3;
+
+				bch_stage_roots(bch, sector, err, errloc, 0);
+				t1 = now();
+				r.btz += t1 - t4;
+
+				if (use_chien) {
+					/* BTZ factorization divides bch->elp in place */
+					bch_stage_elp(bch);
+					t1 = now();
+					nerr = bch_stage_roots(bch, sector, err, errloc, 1);
+					r.chien += now() - t1;
+					if (!n && !check(nerr, errloc, loc + s*(t+1), k, t))
+						r.failed++;
+				}
+			}
+			n++;
+		} while (now() - t0 < bench_time);
+
+		r.ecc *= 1e9/(n*DEC_SECTORS);
+		r.syn *= 1e9/(n*DEC_SECTORS);
+		r.elp *= 1e9/(n*DEC_SECTORS);
+		r.btz *= 1e9/(n*DEC_SECTORS);
+		r.chien *= 1e9/(n*DEC_SECTORS);
+		print_result(&r);
+		if (r.failed && (k <= t)) {
+			fprintf(stderr, "%s: Error %u codewords with %u errors not corrected (m=%u t=%u).\n",
+			        __func__, r.failed, k, m, t);
+			goto OUT;
+		}
+	}
+	ret = 0;
+
+OUT:
+	free(batch_errloc);
+	free(errloc);
+	free(loc);
+	free(ecc);
+	free(data);
+	free_bch(bch);
+	return ret;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: nandbch-bench-decode [OPTION]\n"
+		"Measure BCH decoding time per stage, with injected bit flips\n"
+		"\n"
+		"Options:\n"
+		"  -t, --time=SEC    Minimum time per measurement, default 0.1\n"
+		"  -c, --csv         Print results as CSV\n"
+		"  -j, --json        Print results as JSON\n"
+		"      --no-chien    Skip the (slow) Chien search\n"
+		"      --no-perf     Do not read hardware performance counters\n"
+		"      --no-sweep    Only measure the predefined NAND Flash models\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const struct {
+		unsigned int sector;
+		unsigned int t;
+	} sweep_params[] = {
+		{ 512, 4 }, { 512, 16 }, { 1024, 24 }, { 1024, 40 }, { 2048, 40 },
+	};
+	static struct option options[] = {
+		{"time"    , required_argument, NULL, 't'},
+		{"csv"     , no_argument      , NULL, 'c'},
+		{"json"    , no_argument      , NULL, 'j'},
+		{"no-chien", no_argument      , NULL, 'C'},
+		{"no-perf" , no_argument      , NULL, 'P'},
+		{"no-sweep", no_argument      , NULL, 'S'},
+		{"help"    , no_argument      , NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+	unsigned int i, m, t;
+	int opt, sweep = 1, use_perf = 1, ret = 0;
+
+	while ((opt = getopt_long(argc, argv, "t:cjh", options, NULL)) >= 0) {
+		switch (opt) {
+		case 't':
+			bench_time = strtod(optarg, NULL);
+			break;
+		case 'c':
+			bench_format = FORMAT_CSV;
+			break;
+		case 'j':
+			bench_format = FORMAT_JSON;
+			break;
+		case 'C':
+			use_chien = 0;
+			break;
+		case 'P':
+			use_perf = 0;
+			break;
+		case 'S':
+			sweep = 0;
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+	srand(1);
+
+	if (use_perf && !perf_counters_open(&perf))
+		fprintf(stderr, "%s: Hardware performance counters not available.\n", argv[0]);
+
+	for (i = 0; (i < CHIP_COUNT) && !ret; i++) {
+		m = fls(1+8*chips[i].ecc_sector);
+		t = (chips[i].ecc_bytes*8)/m;
+		ret = bench_decode(chips[i].name, m, t, chips[i].ecc_sector);
+	}
+
+	for (i = 0; sweep && (i < ARRAY_SIZE(sweep_params)) && !ret; i++) {
+		m = fls(1+8*sweep_params[i].sector);
+		ret = bench_decode("sweep", m, sweep_params[i].t, sweep_params[i].sector);
+	}
+
+	if ((bench_format == FORMAT_JSON) && bench_count)
+		printf("\n]\n");
+
+	perf_counters_close(&perf);
+	return ret;
+}
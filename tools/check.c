@@ -0,0 +1,1502 @@
+/*
+ * Differential correctness check of the BCH kernels
+ *
+ * Compares every encoder (8-bit and 4-bit remainder tables, prebuilt tables,
+ * build-time generated encoders and the bit-sliced encoder) with a bit serial
+ * reference LFSR, for random (m, t, length, alignment) combinations, in one
+ * call and in several incremental calls. Decoders (decode_bch() on data or on
+ * calculated ecc, decode_bch_batch(), and BTZ and Chien root finding through
+ * the CONFIG_BCH_STAGE_API exports) are fuzzed with random error patterns.
+ * Finally nandbch(), its --bitslice, --dedup and --previous modes and
+ * nandbch_patch() are run on random images of every predefined NAND Flash
+ * model, in normal and PMECC order, and their output checked page by page,
+ * also with ECC codes interleaved with data and scattered over OOB regions,
+ * with the data randomizer, with the Hamming ECC scheme on the whole chip and
+ * on partitions of it, with bad blocks marked or skipped, and in batches on
+ * several workers, each time with the self-check on, which must also find a
+ * bit flipped in an image, and a sampled verification must count the bits
+ * flipped in it, which the extraction of the data back must correct, and
+ * every page read on demand from the input must be the one written. The
+ * CRC32C and SHA-256 taken as the output is written, with and without the
+ * CPU instructions for them, are checked against test vectors and against
+ * the digests of the whole output.
+ *
+ * Runs offline; returns 0 if every check passed.
+ */
+#define CONFIG_BCH_STAGE_API
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "os_swap.h"
+#include "bch.h"
+#include "nand_bch.h"
+#include "nand_chips.h"
+
+#define CHECK_ECC_MAX   128
+#define CHECK_PAGES     48
+#define CHECK_BIG_PAGES (24*64) /* pages of a batch image of many tasks */
+#define CHECK_BATCH     (2*BCH_BATCH_LANES+3)
+#define CHECK_RAW_MAX   8192
+#define CHECK_HEADER    (52*sizeof(unsigned int)) /* boot header of FLAG_HEADER */
+
+static unsigned int check_rounds = 100;
+static unsigned long checks;
+static unsigned long failures;
+
+/* report a failed check, with the parameters to reproduce it */
+#define CHECK(_cond, _fmt, ...)                                                  \
+	do {                                                                     \
+		checks++;                                                        \
+		if (!(_cond)) {                                                  \
+			failures++;                                              \
+			fprintf(stderr, "%s: Error " _fmt "\n", __func__,        \
+			        ##__VA_ARGS__);                                  \
+		}                                                                \
+	} while (0)
+
+static unsigned int rnd(unsigned int n)
+{
+	return n ? (unsigned int)rand() % n : 0;
+}
+
+static void fill_random(unsigned char *buf, unsigned int len)
+{
+	while (len--)
+		*buf++ = rand();
+}
+
+static int cmp_uint(const void *a, const void *b)
+{
+	const unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return (x > y) - (x < y);
+}
+
+static unsigned char bit_reverse(unsigned char b)
+{
+	unsigned char r = 0;
+	unsigned int i;
+
+	for (i = 0; i < 8; i++)
+		if (b & (1 << i))
+			r |= 0x80 >> i;
+	return r;
+}
+
+/**
+ * struct ref_code - bit serial reference encoder
+ * @n:         generator polynomial degree, ecc_bits
+ * @bytes:     ecc size in bytes
+ * @g:         generator polynomial without its leading term, in ecc parity
+ *             bit order: bit k (MSB first) is the coefficient of X^(n-1-k)
+ */
+struct ref_code {
+	unsigned int  n;
+	unsigned int  bytes;
+	unsigned char g[CHECK_ECC_MAX];
+};
+
+static void ref_init(struct ref_code *ref, struct bch_control *bch)
+{
+	ref->n = bch->ecc_bits;
+	ref->bytes = bch->ecc_bytes;
+
+	/* X^n mod g(X) is the ecc of the single message bit 1 */
+	memset(ref->g, 0, sizeof(ref->g));
+	encode_bch(bch, (const uint8_t *)"\x01", 1, ref->g);
+}
+
+#define REF_BIT(_p, _k) (((_p)[(_k)/8] >> (7 - (_k) % 8)) & 1)
+
+/*
+ * divide data, MSB first, by the generator polynomial with a one bit at a time
+ * LFSR whose state is loaded from, and stored to, @ecc as encode_bch() does
+ */
+static void ref_encode(const struct ref_code *ref, const unsigned char *data, unsigned int len,
+                       unsigned char *ecc)
+{
+	unsigned int i, k, fb;
+	unsigned char s[CHECK_ECC_MAX];
+
+	/* bits of the last byte beyond n are zero, and remain so */
+	memcpy(s, ecc, ref->bytes);
+	for (i = 0; i < 8*len; i++) {
+		fb = REF_BIT(data, i) ^ (s[0] >> 7);
+		for (k = 0; k+1 < ref->bytes; k++)
+			s[k] = (s[k] << 1)|(s[k+1] >> 7);
+		s[k] <<= 1;
+		if (fb)
+			for (k = 0; k < ref->bytes; k++)
+				s[k] ^= ref->g[k];
+	}
+	memcpy(ecc, s, ref->bytes);
+}
+
+/* encode in 1 to 4 calls of random lengths, the first starting from zero */
+static void encode_split(struct bch_control *bch, bch_encode_fn encode, const unsigned char *data,
+                         unsigned int len, unsigned char *ecc, int split)
+{
+	unsigned int i, l, parts = split ? 1 + rnd(4) : 1;
+
+	memset(ecc, 0, bch->ecc_bytes);
+	for (i = 0; i < parts; i++) {
+		l = (i+1 < parts) ? rnd(len+1) : len;
+		encode(bch, data, l, ecc);
+		data += l;
+		len -= l;
+	}
+}
+
+static bch_encode_fn gen_encoder(struct bch_control *bch)
+{
+	const struct bch_gen_encoder *gen;
+
+	for (gen = bch_gen_encoders; gen->encode; gen++)
+		if ((gen->m == bch->m) && (gen->t == bch->t) && (gen->prim_poly == bch->prim_poly))
+			return gen->encode;
+	return NULL;
+}
+
+/*
+ * every encoder against the reference, on random lengths and alignments
+ */
+static int check_encode(struct bch_control *bch, const struct ref_code *ref)
+{
+	const unsigned int max_len = (bch->n - bch->ecc_bits)/8;
+	const unsigned int m = bch->m, t = bch->t;
+	struct bch_control *kernels[3] = { bch };
+	static const char *const names[] = { "mod8", "mod4", "prebuilt", "gen" };
+	unsigned char *buf, *data, ecc[CHECK_ECC_MAX], code[CHECK_ECC_MAX];
+	unsigned char *slice_buf, *slice_ecc;
+	const uint8_t *slice_data[BCH_SLICE_LANES+8];
+	uint8_t *slice_code[BCH_SLICE_LANES+8];
+	unsigned int i, j, r, len, nsec, errloc[8*CHECK_ECC_MAX];
+	bch_encode_fn gen = gen_encoder(bch);
+	int ret = -1;
+
+	kernels[1] = init_bch(m, t, 0, BCH_ENCODE_ONLY|BCH_ENCODER_MOD4);
+	kernels[2] = init_bch_prebuilt(m, t, 0, BCH_ENCODE_ONLY|BCH_ENCODER_MOD8, bch->ecc_bits,
+	                               bch->mod8_tab);
+	buf = malloc(max_len + 8);
+	nsec = BCH_SLICE_LANES + 8;
+	len = (max_len < 600) ? max_len : 600;
+	slice_buf = malloc(nsec*(len + 1));
+	slice_ecc = malloc(nsec*CHECK_ECC_MAX);
+	if (!kernels[1] || !kernels[2] || !buf || !slice_buf || !slice_ecc) {
+		fprintf(stderr, "%s: Error when init kernels m=%u t=%u.\n", __func__, m, t);
+		goto OUT;
+	}
+
+	for (r = 0; r < check_rounds; r++) {
+		/* short, unaligned and full length data */
+		len = (r % 4 == 0) ? max_len : 1 + rnd(((r % 4 == 1) && (max_len > 16)) ? 16 : max_len);
+		data = buf + rnd(8);
+		fill_random(data, len);
+		if (r % 8 == 7)
+			memset(data, 0xff, len);
+
+		memset(ecc, 0, sizeof(ecc));
+		ref_encode(ref, data, len, ecc);
+		CHECK(!decode_bch(bch, data, len, ecc, NULL, NULL, errloc),
+		      "reference code is not a codeword m=%u t=%u len=%u", m, t, len);
+
+		for (i = 0; i < ARRAY_SIZE(names); i++) {
+			for (j = 0; j < 2; j++) {
+				if (i < 3)
+					encode_split(kernels[i], encode_bch, data, len, code, j);
+				else if (gen)
+					encode_split(bch, gen, data, len, code, j);
+				else
+					continue;
+				CHECK(!memcmp(code, ecc, bch->ecc_bytes),
+				      "%s encoder m=%u t=%u len=%u align=%u split=%u", names[i], m, t,
+				      len, (unsigned int)(data - buf), j);
+			}
+		}
+	}
+
+	/* bit-sliced encoder, with partial lane groups */
+	for (r = 0; r < 2; r++) {
+		len = 1 + rnd((max_len < 600) ? max_len : 600);
+		nsec = 1 + rnd(BCH_SLICE_LANES + 8);
+		for (i = 0; i < nsec; i++) {
+			slice_data[i] = slice_buf + i*(len + 1) + (i & 1);
+			slice_code[i] = slice_ecc + i*CHECK_ECC_MAX;
+			fill_random((unsigned char *)slice_data[i], len);
+			if (i % 5 == 4)
+				memset((unsigned char *)slice_data[i], 0xff, len);
+		}
+		CHECK(!encode_bch_bitslice(bch, nsec, slice_data, len, slice_code),
+		      "bitslice encoder failed m=%u t=%u len=%u nsec=%u", m, t, len, nsec);
+		for (i = 0; i < nsec; i++) {
+			memset(ecc, 0, sizeof(ecc));
+			ref_encode(ref, slice_data[i], len, ecc);
+			CHECK(!memcmp(slice_code[i], ecc, bch->ecc_bytes),
+			      "bitslice encoder m=%u t=%u len=%u nsec=%u sector=%u", m, t, len, nsec, i);
+		}
+	}
+	ret = 0;
+
+OUT:
+	free(slice_ecc);
+	free(slice_buf);
+	free(buf);
+	free_bch(kernels[2]);
+	free_bch(kernels[1]);
+	return ret;
+}
+
+/*
+ * flip @k distinct random bits of a codeword; locations follow decode_bch():
+ * bit l is bit l%8 of byte l/8 of data followed by ecc
+ */
+static void inject(struct bch_control *bch, unsigned char *data, unsigned int len,
+                   unsigned char *ecc, unsigned int k, unsigned int *loc)
+{
+	const unsigned int nbits = 8*len + bch->ecc_bits;
+	unsigned int i, j, l, q;
+
+	for (i = 0; i < k; i++) {
+		do {
+			l = rnd(nbits);
+			for (j = 0; (j < i) && (loc[j] != l); j++)
+				;
+		} while (j < i);
+		loc[i] = l;
+	}
+
+	for (i = 0; i < k; i++) {
+		l = loc[i];
+		if (l < 8*len) {
+			data[l/8] ^= 1 << (l % 8);
+		} else {
+			/* ecc bits are MSB first, skip the padding of the last byte */
+			q = l - 8*len;
+			ecc[q/8] ^= 0x80 >> (q % 8);
+			loc[i] = 8*len + (q & ~7) + 7 - (q & 7);
+		}
+	}
+	qsort(loc, k, sizeof(*loc), cmp_uint);
+}
+
+/* same decoding result: error count, and sorted locations */
+static int same_result(int nerr, unsigned int *errloc, int ref_nerr, const unsigned int *ref_loc)
+{
+	if (nerr != ref_nerr)
+		return 0;
+	if (nerr <= 0)
+		return 1;
+	qsort(errloc, nerr, sizeof(*errloc), cmp_uint);
+	return !memcmp(errloc, ref_loc, nerr*sizeof(*errloc));
+}
+
+/*
+ * every decoder on random error patterns of up to t+1 errors
+ */
+static int check_decode(struct bch_control *bch, const struct ref_code *ref)
+{
+	const unsigned int m = bch->m, t = bch->t;
+	const unsigned int max_len = (bch->n - bch->ecc_bits)/8;
+	unsigned char *data, *ecc, calc[CHECK_ECC_MAX];
+	const uint8_t *pdata[CHECK_BATCH], *pecc[CHECK_BATCH];
+	unsigned int *loc, *errloc, *batch_loc, k[CHECK_BATCH];
+	unsigned int r, s, len;
+	int nerr, ref_nerr[CHECK_BATCH], batch_nerr[CHECK_BATCH], err, ret = -1;
+
+	len = 1 + rnd((max_len < 1024) ? max_len : 1024);
+	data = malloc(CHECK_BATCH*len);
+	ecc = calloc(CHECK_BATCH, CHECK_ECC_MAX);
+	loc = malloc(CHECK_BATCH*(t+1)*sizeof(*loc));
+	errloc = malloc((t+1)*sizeof(*errloc));
+	batch_loc = malloc(CHECK_BATCH*t*sizeof(*batch_loc));
+	if (!data || !ecc || !loc || !errloc || !batch_loc) {
+		fprintf(stderr, "%s: Error when malloc buffers.\n", __func__);
+		goto OUT;
+	}
+
+	for (r = 0; r < DIV_ROUND_UP(check_rounds, 4); r++) {
+		for (s = 0; s < CHECK_BATCH; s++) {
+			pdata[s] = data + s*len;
+			pecc[s] = ecc + s*CHECK_ECC_MAX;
+			fill_random(data + s*len, len);
+			memset(ecc + s*CHECK_ECC_MAX, 0, CHECK_ECC_MAX);
+			ref_encode(ref, data + s*len, len, ecc + s*CHECK_ECC_MAX);
+
+			/* mostly correctable, a few t+1 error patterns */
+			k[s] = (rnd(8) == 0) ? t+1 : rnd(t+1);
+			inject(bch, data + s*len, len, ecc + s*CHECK_ECC_MAX, k[s], loc + s*(t+1));
+		}
+
+		for (s = 0; s < CHECK_BATCH; s++) {
+			/* decode_bch() on data is the reference for the others */
+			ref_nerr[s] = decode_bch(bch, pdata[s], len, pecc[s], NULL, NULL, errloc);
+			if (k[s] <= t)
+				CHECK(same_result(ref_nerr[s], errloc, k[s], loc + s*(t+1)),
+				      "decode_bch m=%u t=%u len=%u errors=%u nerr=%d", m, t, len, k[s],
+				      ref_nerr[s]);
+			else
+				CHECK((ref_nerr[s] == -EBADMSG) || (ref_nerr[s] > 0 && ref_nerr[s] <= t),
+				      "decode_bch m=%u t=%u len=%u errors=%u nerr=%d", m, t, len, k[s],
+				      ref_nerr[s]);
+			if (ref_nerr[s] > 0) {
+				qsort(errloc, ref_nerr[s], sizeof(*errloc), cmp_uint);
+				memcpy(loc + s*(t+1), errloc, ref_nerr[s]*sizeof(*errloc));
+			}
+
+			memset(calc, 0, sizeof(calc));
+			ref_encode(ref, pdata[s], len, calc);
+			nerr = decode_bch(bch, NULL, len, pecc[s], calc, NULL, errloc);
+			CHECK(same_result(nerr, errloc, ref_nerr[s], loc + s*(t+1)),
+			      "decode_bch calc_ecc m=%u t=%u len=%u errors=%u nerr=%d/%d", m, t, len,
+			      k[s], nerr, ref_nerr[s]);
+
+			/* BTZ then Chien roots of the same error locator polynomial */
+			err = bch_stage_ecc(bch, pdata[s], len, pecc[s]);
+			nerr = err;
+			if (err > 0) {
+				bch_stage_syndromes(bch);
+				err = bch_stage_elp(bch);
+				nerr = bch_stage_roots(bch, len, err, errloc, 0);
+			}
+			CHECK(same_result(nerr, errloc, ref_nerr[s], loc + s*(t+1)),
+			      "btz roots m=%u t=%u len=%u errors=%u nerr=%d/%d", m, t, len, k[s], nerr,
+			      ref_nerr[s]);
+			if (nerr != 0) {
+				err = bch_stage_elp(bch);
+				nerr = bch_stage_roots(bch, len, err, errloc, 1);
+				CHECK(same_result(nerr, errloc, ref_nerr[s], loc + s*(t+1)),
+				      "chien roots m=%u t=%u len=%u errors=%u nerr=%d/%d", m, t, len,
+				      k[s], nerr, ref_nerr[s]);
+			}
+		}
+
+		CHECK(!decode_bch_batch(bch, CHECK_BATCH, pdata, len, pecc, batch_loc, batch_nerr),
+		      "decode_bch_batch failed m=%u t=%u len=%u", m, t, len);
+		for (s = 0; s < CHECK_BATCH; s++)
+			CHECK(same_result(batch_nerr[s], batch_loc + s*t, ref_nerr[s], loc + s*(t+1)),
+			      "decode_bch_batch m=%u t=%u len=%u errors=%u nerr=%d/%d", m, t, len,
+			      k[s], batch_nerr[s], ref_nerr[s]);
+	}
+	ret = 0;
+
+OUT:
+	free(batch_loc);
+	free(errloc);
+	free(loc);
+	free(ecc);
+	free(data);
+	return ret;
+}
+
+/* random (m, t) pairs of every supported field order */
+static int check_params(void)
+{
+	struct bch_control *bch;
+	struct ref_code ref;
+	unsigned int m, t, max_t;
+	int ret = 0;
+
+	for (m = 5; (m <= 15) && !ret; m++) {
+		max_t = ((1 << m) - 2)/m;
+		if (max_t > 8*CHECK_ECC_MAX/m)
+			max_t = 8*CHECK_ECC_MAX/m;
+		/* data must remain once ecc bits are reserved */
+		do {
+			t = 1 + rnd((max_t < 64) ? max_t : 64);
+		} while (m*t + 8 >= (1u << m) - 1);
+
+		bch = init_bch(m, t, 0, BCH_ENCODER_MOD8);
+		if (bch == NULL) {
+			fprintf(stderr, "%s: Error when init BCH m=%u t=%u.\n", __func__, m, t);
+			return -1;
+		}
+		ref_init(&ref, bch);
+		ret = check_encode(bch, &ref);
+		if (!ret)
+			ret = check_decode(bch, &ref);
+		free_bch(bch);
+	}
+
+	return ret;
+}
+
+static int same_digest(const struct nand_digest *a, const struct nand_digest *b)
+{
+	return (a->size == b->size) && (a->crc32c == b->crc32c) && (a->has_sha256 == b->has_sha256) &&
+	       (!a->has_sha256 || !memcmp(a->sha256, b->sha256, sizeof(a->sha256)));
+}
+
+/*
+ * CRC32C and SHA-256 test vectors, the same digests of random data taken in
+ * random pieces with the portable code and the CPU instructions, and CRCs of
+ * pieces combined
+ */
+static int check_digests(void)
+{
+	static const unsigned char sha_abc[NAND_SHA256_BYTES] = {
+		0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+		0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+	};
+	const unsigned long before = failures;
+	struct nand_digest digest[2], piece;
+	struct nand_digest_ctx ctx;
+	unsigned char *data;
+	unsigned int round, len, pos, n, crc;
+	int accel;
+
+	data = malloc(4096);
+	if (data == NULL)
+		return -1;
+
+	for (accel = 1; accel >= 0; accel--) {
+		nand_digest_accel(accel);
+		CHECK(nand_crc32c(0, (const unsigned char *)"123456789", 9) == 0xe3069283,
+		      "crc32c test vector, accel %d", accel);
+		nand_digest_init(&ctx, 1);
+		nand_digest_update(&ctx, (const unsigned char *)"abc", 3);
+		nand_digest_final(&ctx, &piece);
+		CHECK(!memcmp(piece.sha256, sha_abc, sizeof(sha_abc)), "sha256 test vector, accel %d",
+		      accel);
+	}
+
+	for (round = 0; round < check_rounds; round++) {
+		len = rnd(4096);
+		fill_random(data, len);
+		for (accel = 0; accel < 2; accel++) {
+			nand_digest_accel(accel);
+			nand_digest_init(&ctx, 1);
+			for (pos = 0; pos < len; pos += n) {
+				n = rnd(len - pos + 1);
+				nand_digest_update(&ctx, data + pos, n);
+			}
+			nand_digest_final(&ctx, &digest[accel]);
+		}
+		CHECK(same_digest(&digest[0], &digest[1]),
+		      "digests of %u bytes differ with accel", len);
+		CHECK(digest[0].crc32c == nand_crc32c(0, data, len), "crc32c of %u bytes in pieces", len);
+
+		pos = rnd(len + 1);
+		crc = nand_crc32c_combine(nand_crc32c(0, data, pos), nand_crc32c(0, data + pos, len - pos),
+		                          len - pos);
+		CHECK(crc == digest[0].crc32c, "crc32c combine of %u and %u bytes", pos, len - pos);
+	}
+	nand_digest_accel(1);
+
+	free(data);
+	return (failures == before) ? 0 : -1;
+}
+
+/*
+ * reference raw page layout, byte by byte: data and ecc codes of each sector
+ * in turn, or ecc codes in the OOB regions of the chip, then the other OOB
+ * bytes of the page @built the usual way in order
+ */
+static void layout_page(struct nand_chip *chip, const unsigned char *built, unsigned char *raw)
+{
+	const unsigned int raw_size = chip->page_size + chip->spare_size;
+	const unsigned int ecc_size = chip->page_size/chip->ecc_sector*chip->ecc_bytes;
+	const unsigned int ecc_start = chip->page_size + chip->ecc_offset;
+	const struct nand_oob_region *region;
+	unsigned char taken[CHECK_RAW_MAX];
+	unsigned int i, j, e, pos;
+
+	memset(taken, 0, raw_size);
+	if (chip->layout == NAND_LAYOUT_INTERLEAVED) {
+		for (i = 0, pos = 0; i < chip->page_size/chip->ecc_sector; i++) {
+			for (j = 0; j < chip->ecc_sector; j++, pos++)
+				raw[pos] = built[i*chip->ecc_sector + j];
+			for (j = 0; j < chip->ecc_bytes; j++, pos++)
+				raw[pos] = built[ecc_start + i*chip->ecc_bytes + j];
+		}
+		memset(taken, 1, pos);
+	} else {
+		memcpy(raw, built, chip->page_size);
+		memset(taken, 1, chip->page_size);
+		for (region = chip->ecc_regions, e = 0; region && region->length; region++) {
+			for (j = 0; (j < region->length) && (e < ecc_size); j++, e++) {
+				raw[chip->page_size + region->offset + j] = built[ecc_start + e];
+				taken[chip->page_size + region->offset + j] = 1;
+			}
+		}
+		if (!chip->ecc_regions) {
+			memcpy(raw + ecc_start, built + ecc_start, ecc_size);
+			memset(taken + ecc_start, 1, ecc_size);
+		}
+	}
+
+	for (i = chip->page_size, pos = 0; i < raw_size; i++) {
+		if ((i >= ecc_start) && (i < ecc_start + ecc_size))
+			continue;
+		while (taken[pos])
+			pos++;
+		raw[pos] = built[i];
+		taken[pos] = 1;
+	}
+}
+
+/*
+ * reference Hamming code, from the definition of each line and column parity
+ */
+static void ref_hamming(const unsigned char *data, unsigned int len, int sm_order,
+                        unsigned char *code)
+{
+	unsigned int rp[18] = {0}, cp[6] = {0};
+	unsigned int i, j, k, bit, par, lo = 0, hi = 0;
+
+	for (i = 0; i < len; i++) {
+		for (j = 0, par = 0; j < 8; j++) {
+			bit = (data[i] >> j) & 1;
+			par ^= bit;
+			cp[0 + !!(j & 1)] ^= bit;
+			cp[2 + !!(j & 2)] ^= bit;
+			cp[4 + !!(j & 4)] ^= bit;
+		}
+		for (k = 0; k < 9; k++)
+			rp[2*k + ((i >> k) & 1)] ^= par;
+	}
+
+	for (k = 0; k < 8; k++) {
+		lo |= rp[k] << k;
+		hi |= rp[8 + k] << k;
+	}
+	code[0] = ~(sm_order ? lo : hi);
+	code[1] = ~(sm_order ? hi : lo);
+	code[2] = ~((cp[5] << 7) | (cp[4] << 6) | (cp[3] << 5) | (cp[2] << 4) | (cp[1] << 3) |
+	            (cp[0] << 2) | ((len == 512) ? (rp[17] << 1) | rp[16] : 0));
+}
+
+/*
+ * chip as seen by page @page_no, with the ECC scheme of its partition if any
+ */
+static void page_chip(const struct nand_chip *chip, unsigned long page_no, struct nand_chip *out)
+{
+	const struct nand_partition *part;
+
+	*out = *chip;
+	for (part = chip->partitions; part && part->pages; part++) {
+		if (page_no < part->pages) {
+			out->ecc_mode = part->ecc_mode;
+			out->ecc_sector = part->ecc_sector;
+			out->ecc_bytes = part->ecc_bytes;
+			out->ecc_offset = part->ecc_offset;
+			if (out->ecc_offset == -1)
+				out->ecc_offset = chip->spare_size -
+				                  chip->page_size/part->ecc_sector*part->ecc_bytes;
+			out->ecc_regions = NULL;
+			return;
+		}
+		page_no -= part->pages;
+	}
+}
+
+/*
+ * scramble the data area of page @page_no in place with the keystream of a
+ * randomizer, one LFSR step per bit, unless it is erased and kept so
+ */
+static void ref_scramble(const struct nand_randomizer_params *rp, unsigned long page_no,
+                         unsigned char *page, unsigned int len)
+{
+	const unsigned int mask = ~0U >> __builtin_clz(rp->taps);
+	unsigned int i, j, bit, reg = (rp->seed + page_no % (rp->period ? rp->period : 1)) & mask;
+
+	for (i = 0; (i < len) && (page[i] == 0xff); i++)
+		;
+	if ((i == len) && rp->keep_erased)
+		return;
+
+	for (i = 0; i < len; i++) {
+		for (j = 0; j < 8; j++) {
+			bit = reg & 1;
+			page[i] ^= bit << j;
+			reg >>= 1;
+			if (bit)
+				reg ^= rp->taps;
+		}
+	}
+}
+
+/*
+ * raw page expected from nandbch() for the data area @page of input page
+ * @page_no: scrambled if requested, reference ecc codes, masked, in PMECC
+ * order if requested; @chip is the one seen by the page
+ */
+static void expect_page(struct nand_chip *chip, const struct ref_code *ref,
+                        const unsigned char *mask, unsigned char *page, unsigned long page_no,
+                        unsigned int flag, const struct nand_randomizer_params *rp,
+                        unsigned char *raw)
+{
+	const unsigned int steps = chip->page_size/chip->ecc_sector;
+	unsigned char built[CHECK_RAW_MAX];
+	unsigned char *ecc = built + chip->page_size + chip->ecc_offset;
+	unsigned char sector[4096];
+	unsigned int i, j;
+
+	if (rp)
+		ref_scramble(rp, page_no, page, chip->page_size);
+	memcpy(built, page, chip->page_size);
+	memset(built + chip->page_size, 0xff, chip->spare_size);
+
+	for (i = 0; i < steps; i++, ecc += chip->ecc_bytes) {
+		for (j = 0; j < chip->ecc_sector; j++) {
+			sector[j] = page[i*chip->ecc_sector + j];
+			if (flag & FLAG_PMECC)
+				sector[j] = bit_reverse(sector[j]);
+		}
+		memset(ecc, 0, chip->ecc_bytes);
+		if (chip->ecc_mode != NAND_ECC_BCH) {
+			/* an erased sector has an all 0xff code, no mask */
+			ref_hamming(sector, chip->ecc_sector, chip->ecc_mode == NAND_ECC_HAMMING_SMC, ecc);
+			for (j = 0; j < chip->ecc_bytes; j++)
+				if (flag & FLAG_PMECC)
+					ecc[j] = bit_reverse(ecc[j]);
+			continue;
+		}
+		ref_encode(ref, sector, chip->ecc_sector, ecc);
+		for (j = 0; j < chip->ecc_bytes; j++) {
+			if (!(flag & FLAG_NO_MASK))
+				ecc[j] ^= mask[j];
+			if (flag & FLAG_PMECC)
+				ecc[j] = bit_reverse(ecc[j]);
+		}
+	}
+
+	layout_page(chip, built, raw);
+}
+
+static int write_file(const char *path, const unsigned char *buf, size_t len)
+{
+	FILE *fp = fopen(path, "wb");
+	int ret = -1;
+
+	if (fp == NULL)
+		return -1;
+	if (fwrite(buf, 1, len, fp) == len)
+		ret = 0;
+	if (fclose(fp))
+		ret = -1;
+	return ret;
+}
+
+static unsigned char *read_file(const char *path, size_t *len)
+{
+	FILE *fp = fopen(path, "rb");
+	unsigned char *buf = NULL;
+	long size;
+
+	if (fp == NULL)
+		return NULL;
+	if (!fseek(fp, 0, SEEK_END) && ((size = ftell(fp)) >= 0) && !fseek(fp, 0, SEEK_SET)) {
+		buf = malloc(size + 1);
+		if (buf && (fread(buf, 1, size, fp) != size)) {
+			free(buf);
+			buf = NULL;
+		}
+		*len = size;
+	}
+	fclose(fp);
+	return buf;
+}
+
+/* compare an image made by nandbch() page by page with the expected one */
+static void check_image(struct nand_chip *chip, const struct ref_code *ref,
+                        const unsigned char *mask, const unsigned char *input, size_t in_len,
+                        const char *path, unsigned int flag,
+                        const struct nand_randomizer_params *rp, const char *mode)
+{
+	const size_t raw_size = chip->page_size + chip->spare_size;
+	const size_t pages = DIV_ROUND_UP(in_len, chip->page_size);
+	unsigned char *image, *page, *raw;
+	struct nand_chip part;
+	size_t i, len;
+
+	page = malloc(chip->page_size);
+	raw = malloc(raw_size);
+	image = read_file(path, &len);
+	if (!page || !raw || !image) {
+		CHECK(0, "%s: no image %s for %s", chip->name, path, mode);
+		goto OUT;
+	}
+
+	CHECK(len == pages*raw_size, "%s %s: image size %zu, expected %zu", chip->name, mode, len,
+	      pages*raw_size);
+	for (i = 0; (i < pages) && (len == pages*raw_size); i++) {
+		memset(page, 0xff, chip->page_size);
+		memcpy(page, input + i*chip->page_size,
+		       (in_len - i*chip->page_size < chip->page_size) ?
+		       in_len - i*chip->page_size : chip->page_size);
+		page_chip(chip, i, &part);
+		expect_page(&part, ref, mask, page, i, flag, rp, raw);
+		CHECK(!memcmp(image + i*raw_size, raw, raw_size), "%s %s: page %zu differs",
+		      chip->name, mode, i);
+	}
+
+OUT:
+	free(image);
+	free(raw);
+	free(page);
+}
+
+/* digests of an image taken by nandbch() against those of the whole file */
+static void check_digest(const char *path, const struct nand_digest *digest, const char *name)
+{
+	struct nand_digest_ctx ctx;
+	struct nand_digest expect;
+	unsigned char *image;
+	size_t len;
+
+	image = read_file(path, &len);
+	if (image == NULL) {
+		CHECK(0, "%s: no image %s", name, path);
+		return;
+	}
+	nand_digest_init(&ctx, 1);
+	nand_digest_update(&ctx, image, len);
+	nand_digest_final(&ctx, &expect);
+	CHECK(same_digest(&expect, digest), "%s: digest of %s differs", name, path);
+	free(image);
+}
+
+/*
+ * expected image with the bad blocks of @bp: the pages of @ref marked in
+ * place, or shifted past blocks of marked erased pages; returns its size
+ */
+static size_t bad_block_image(struct nand_chip *chip, const struct nand_bad_block_params *bp,
+                              const unsigned char *ref, size_t ref_len, unsigned char *out)
+{
+	const size_t raw_size = chip->page_size + chip->spare_size;
+	const size_t pages = ref_len/raw_size;
+	const unsigned int marker = chip->free_offset ? chip->free_offset : 1;
+	size_t p, q, len = 0;
+	unsigned long block;
+	int i, bad;
+
+	for (block = 0, p = 0; p < pages; block++) {
+		for (i = 0, bad = 0; i < bp->count; i++)
+			bad |= (bp->blocks[i] == block);
+
+		for (q = 0; (q < bp->block_pages) && (p < pages); q++, len += raw_size) {
+			if (bad && (bp->mode == NAND_BAD_SKIP)) {
+				memset(out + len, 0xff, raw_size);
+			} else {
+				memcpy(out + len, ref + p*raw_size, raw_size);
+				p++;
+			}
+			if (bad)
+				memset(out + len + chip->page_size, 0, marker);
+		}
+	}
+
+	return len;
+}
+
+/*
+ * data of nandbch_extract() of an image of @input, against the input padded
+ * to whole pages, but for the pages of @skip, and with the free OOB region
+ * of mkyaffs2image records all 0xff for @yaffs
+ */
+static void check_extracted(struct nand_chip *chip, const char *path, const unsigned char *input,
+                            size_t in_len, size_t pages, const unsigned char *skip, int yaffs,
+                            const char *mode)
+{
+	const size_t stride = chip->page_size + (yaffs ? chip->spare_size : 0);
+	unsigned char *out, *expect;
+	size_t len, p, q, bad = 0;
+
+	out = read_file(path, &len);
+	expect = malloc(chip->page_size);
+	if (!out || !expect || (len != pages*stride)) {
+		CHECK(0, "%s %s: extracted %zu bytes, not %zu", chip->name, mode, out ? len : 0,
+		      pages*stride);
+		goto OUT;
+	}
+
+	for (p = 0; p < pages; p++) {
+		q = (in_len > p*chip->page_size) ? in_len - p*chip->page_size : 0;
+		q = (q < chip->page_size) ? q : chip->page_size;
+		memcpy(expect, input + p*chip->page_size, q);
+		memset(expect + q, 0xff, chip->page_size - q);
+		if (!skip[p] && memcmp(out + p*stride, expect, chip->page_size))
+			bad++;
+		for (q = chip->page_size; q < stride; q++)
+			bad += (out[p*stride + q] != 0xff);
+	}
+	CHECK(!bad, "%s %s: %zu extracted pages or bytes differ", chip->name, mode, bad);
+
+OUT:
+	free(expect);
+	free(out);
+}
+
+/*
+ * nandbch_read_page() of the pages of an image in random order, each one
+ * read twice, the second time from the cache, then of all of them in order,
+ * against the image nandbch() wrote from the same input
+ */
+static void check_reader(struct nand_chip *chip, const char *in_path, const char *path,
+                         unsigned int flag, const struct nandbch_options *opts, const char *mode)
+{
+	const size_t raw_size = chip->page_size + chip->spare_size;
+	struct nandbch_reader *r;
+	unsigned char *image, *buf;
+	size_t len, pages, page, i;
+	unsigned long hits;
+
+	image = read_file(path, &len);
+	r = nandbch_reader_open(chip, in_path, flag, opts, 1 + rnd(8));
+	buf = malloc(raw_size);
+	if (!image || !r || !buf) {
+		CHECK(0, "%s %s: no reader of %s", chip->name, mode, in_path);
+		goto OUT;
+	}
+	pages = len/raw_size;
+	CHECK(r->pages == pages, "%s %s: reader of %lu pages, not %zu", chip->name, mode, r->pages,
+	      pages);
+
+	for (i = 0; i < pages; i++) {
+		page = rnd(pages);
+		CHECK(!nandbch_read_page(r, page, buf) && !memcmp(buf, image + page*raw_size, raw_size),
+		      "%s %s: page %zu of the reader differs", chip->name, mode, page);
+		hits = r->hits;
+		CHECK(!nandbch_read_page(r, page, buf) && (r->hits == hits + 1) &&
+		      !memcmp(buf, image + page*raw_size, raw_size),
+		      "%s %s: page %zu of the reader cache differs", chip->name, mode, page);
+	}
+	for (page = 0; page < pages; page++)
+		CHECK(!nandbch_read_page(r, page, buf) && !memcmp(buf, image + page*raw_size, raw_size),
+		      "%s %s: page %zu of the reader differs", chip->name, mode, page);
+	CHECK(nandbch_read_page(r, pages, buf) < 0, "%s %s: reader read page %zu past the end",
+	      chip->name, mode, pages);
+
+	/*
+	 * a full cache, its oldest page read again, then a new one evicts the
+	 * second oldest instead, unless the cache has only one page
+	 */
+	if (pages > (size_t)r->cache_pages + 1) {
+		for (page = 0; page <= (size_t)r->cache_pages; page++)
+			nandbch_read_page(r, page, buf);
+		nandbch_read_page(r, 1, buf);
+		nandbch_read_page(r, r->cache_pages + 1, buf);
+		hits = r->hits;
+		nandbch_read_page(r, 1, buf);
+		nandbch_read_page(r, 2, buf);
+		CHECK(r->hits == hits + (r->cache_pages > 1),
+		      "%s %s: reader cache of %d pages is not least recently used", chip->name, mode,
+		      r->cache_pages);
+	}
+
+OUT:
+	nandbch_reader_close(r);
+	free(buf);
+	free(image);
+}
+
+/*
+ * nandbch() with bad blocks marked or skipped, against the image made
+ * without, and nandbch_patch() and --previous on a skip-block image
+ */
+static void check_bad_blocks(struct nand_chip *chip, const char *dir, const char *in_path,
+                             size_t in_len)
+{
+	static const unsigned long blocks[] = { 7, 1, 2, 1, 1000 };
+	struct nand_bad_block_params bp = { NAND_BAD_MARK, 4, blocks, ARRAY_SIZE(blocks) };
+	static const struct {
+		const char   *name;
+		int          mode;
+		unsigned int flag;
+		int          previous;
+	} modes[] = {
+		{ "mark",              NAND_BAD_MARK, 0,             0 },
+		{ "skip",              NAND_BAD_SKIP, 0,             0 },
+		{ "skip-bitslice",     NAND_BAD_SKIP, FLAG_BITSLICE, 0 },
+		{ "skip-previous",     NAND_BAD_SKIP, 0,             1 },
+	};
+	char ref_path[4096], bad_path[4096], prev_path[4096];
+	unsigned char *ref = NULL, *image = NULL, *expect = NULL, patch_data[64];
+	unsigned char *input, *skip;
+	struct nandbch_options opts = {0};
+	struct nandbch_patch patch;
+	struct nand_digest digest;
+	struct nandbch_sample sample = {0};
+	size_t ref_len, len, expect_len;
+	unsigned int i;
+
+	snprintf(ref_path, sizeof(ref_path), "%s/bad-ref", dir);
+	snprintf(bad_path, sizeof(bad_path), "%s/bad", dir);
+	snprintf(prev_path, sizeof(prev_path), "%s/bad-prev", dir);
+
+	CHECK(!nandbch(chip, in_path, ref_path, 0, &opts), "%s: nandbch failed", chip->name);
+	ref = read_file(ref_path, &ref_len);
+	expect = malloc(2*ref_len);
+	if (!ref || !expect) {
+		CHECK(0, "%s: no image %s", chip->name, ref_path);
+		goto OUT;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(modes); i++) {
+		bp.mode = modes[i].mode;
+		opts.bad_blocks = &bp;
+		if (modes[i].previous) {
+			/* every page is copied from a previous skip-block image */
+			CHECK(!nandbch(chip, in_path, prev_path, 0, &opts), "%s: nandbch failed", chip->name);
+			opts.previous_in = in_path;
+			opts.previous_out = prev_path;
+		}
+		opts.digest = &digest;
+		CHECK(!nandbch(chip, in_path, bad_path, modes[i].flag, &opts), "%s %s: nandbch failed",
+		      chip->name, modes[i].name);
+		opts.previous_in = opts.previous_out = NULL;
+		opts.digest = NULL;
+		check_digest(bad_path, &digest, modes[i].name);
+
+		free(image);
+		image = read_file(bad_path, &len);
+		expect_len = bad_block_image(chip, &bp, ref, ref_len, expect);
+		CHECK(image && (len == expect_len) && !memcmp(image, expect, len),
+		      "%s %s: image differs", chip->name, modes[i].name);
+		check_reader(chip, in_path, bad_path, modes[i].flag, &opts, modes[i].name);
+	}
+
+	/* only the good pages of a skip-block image are sampled, in their segments */
+	sample.fraction = 1.0;
+	CHECK(!nandbch_verify_sample(chip, bad_path, 0, &opts, &sample) &&
+	      (sample.sampled == ref_len/(chip->page_size + chip->spare_size)) &&
+	      !sample.bitflips && !sample.uncorrectable,
+	      "%s skip: verify sample of %lu pages, %lu bitflips, %lu uncorrectable", chip->name,
+	      sample.sampled, sample.bitflips, sample.uncorrectable);
+
+	/* and only they are extracted, back to the input */
+	input = read_file(in_path, &len);
+	skip = calloc(sample.sampled + 1, 1);
+	if (input && skip) {
+		CHECK(!nandbch_extract(chip, bad_path, prev_path, 0, &opts, 2),
+		      "%s skip: nandbch_extract failed", chip->name);
+		check_extracted(chip, prev_path, input, in_len, sample.sampled, skip, 0, "skip-extract");
+	}
+	free(input);
+	free(skip);
+
+	/* the same patch on the skip-block image and on the image without */
+	patch.offset = rnd(in_len - sizeof(patch_data));
+	patch.len = 1 + rnd(sizeof(patch_data) - 1);
+	patch.data = patch_data;
+	fill_random(patch_data, patch.len);
+	opts.bad_blocks = NULL;
+	CHECK(!nandbch_patch(chip, ref_path, 0, &patch, 1, &opts), "%s: nandbch_patch failed",
+	      chip->name);
+	opts.bad_blocks = &bp;
+	CHECK(!nandbch_patch(chip, bad_path, 0, &patch, 1, &opts), "%s skip: nandbch_patch failed",
+	      chip->name);
+
+	free(ref);
+	free(image);
+	ref = read_file(ref_path, &ref_len);
+	image = read_file(bad_path, &len);
+	if (ref && image) {
+		expect_len = bad_block_image(chip, &bp, ref, ref_len, expect);
+		CHECK((len == expect_len) && !memcmp(image, expect, len),
+		      "%s skip-patch: image differs", chip->name);
+	}
+
+OUT:
+	unlink(ref_path);
+	unlink(bad_path);
+	unlink(prev_path);
+	free(expect);
+	free(image);
+	free(ref);
+}
+
+/*
+ * nandbch_batch() of images of different sizes and flags on several workers,
+ * one of them shorter than a task and one empty, then of an image of many
+ * tasks done out of order, whose digests must still be taken in page order
+ */
+static void check_batch(struct nand_chip *chip, const char *dir, const struct ref_code *ref,
+                        const unsigned char *mask, const unsigned char *input, size_t in_len,
+                        const char *in_path)
+{
+	static const struct nand_randomizer_params scramble = { 0xb400, 0xace1, 16, 0 };
+	static const struct {
+		const char   *name;
+		unsigned int flag;
+		int          workers;
+		const struct nand_randomizer_params *randomizer;
+	} modes[] = {
+		{ "batch",            0,             3, NULL },
+		{ "batch-bitslice",   FLAG_BITSLICE, 4, NULL },
+		{ "batch-randomizer", 0,             2, &scramble },
+	};
+	static const unsigned int job_flags[] = { 0, FLAG_PMECC, FLAG_NO_MASK, FLAG_PMECC|FLAG_NO_MASK };
+	const size_t lens[] = { in_len, 1 + rnd(3*chip->page_size), in_len - rnd(in_len/2), 0 };
+	char paths[2*ARRAY_SIZE(lens)][4096];
+	struct nandbch_job jobs[ARRAY_SIZE(lens)];
+	struct nand_digest digests[ARRAY_SIZE(lens)];
+	struct nandbch_options opts = { .digest = digests, .self_check = 1 };
+	unsigned int i, j;
+	unsigned char *image;
+	size_t len;
+
+	for (j = 0; j < ARRAY_SIZE(lens); j++) {
+		snprintf(paths[2*j], sizeof(paths[0]), "%s/batch-in%u", dir, j);
+		snprintf(paths[2*j + 1], sizeof(paths[0]), "%s/batch-out%u", dir, j);
+		jobs[j].file_in = j ? paths[2*j] : in_path;
+		jobs[j].file_out = paths[2*j + 1];
+		if (j && write_file(paths[2*j], input, lens[j])) {
+			fprintf(stderr, "%s: Error when write %s.\n", __func__, paths[2*j]);
+			goto OUT;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(modes); i++) {
+		for (j = 0; j < ARRAY_SIZE(lens); j++)
+			jobs[j].flag = job_flags[(i + j) % ARRAY_SIZE(job_flags)];
+		opts.randomizer = modes[i].randomizer;
+		CHECK(!nandbch_batch(chip, jobs, ARRAY_SIZE(lens), modes[i].flag, &opts, modes[i].workers),
+		      "%s %s: nandbch_batch failed", chip->name, modes[i].name);
+
+		for (j = 0; j < ARRAY_SIZE(lens); j++) {
+			check_digest(jobs[j].file_out, &digests[j], modes[i].name);
+			if (lens[j]) {
+				check_image(chip, ref, mask, input, lens[j], jobs[j].file_out, jobs[j].flag,
+				            modes[i].randomizer, modes[i].name);
+				continue;
+			}
+			image = read_file(jobs[j].file_out, &len);
+			CHECK(image && !len, "%s %s: empty input, image of %zu bytes", chip->name,
+			      modes[i].name, len);
+			free(image);
+		}
+	}
+
+	/* more tasks ahead of their turn than parking buffers, some wait for one */
+	len = CHECK_BIG_PAGES*chip->page_size;
+	image = malloc(len);
+	if (image == NULL) {
+		fprintf(stderr, "%s: Error when malloc %zu bytes.\n", __func__, len);
+		goto OUT;
+	}
+	for (j = 0; j < len; j++)
+		image[j] = input[j % in_len] ^ (j/in_len);
+	jobs[0].file_in = paths[0];
+	jobs[0].flag = 0;
+	opts.randomizer = NULL;
+	if (write_file(paths[0], image, len)) {
+		fprintf(stderr, "%s: Error when write %s.\n", __func__, paths[0]);
+	} else {
+		CHECK(!nandbch_batch(chip, jobs, 1, 0, &opts, 6), "%s batch-big: nandbch_batch failed",
+		      chip->name);
+		check_digest(jobs[0].file_out, &digests[0], "batch-big");
+	}
+	free(image);
+
+OUT:
+	for (j = 0; j < ARRAY_SIZE(lens); j++) {
+		unlink(paths[2*j]);
+		unlink(paths[2*j + 1]);
+	}
+}
+
+/*
+ * the self-check on every page of an image made by nandbch(), then on the
+ * same image with one bit of a sector or of its code flipped
+ */
+static void check_self_check(struct nand_chip *chip, const char *path, unsigned int flag,
+                             const char *mode)
+{
+	const size_t raw_size = chip->page_size + chip->spare_size;
+	const long steps = chip->page_size/chip->ecc_sector;
+	struct nand_bch_control *nbc;
+	struct nand_verify *v;
+	unsigned char *image = NULL, *scratch;
+	size_t len, pages, page;
+	unsigned long bad_page;
+	unsigned int bit;
+	long ret;
+
+	nbc = nand_bch_init(chip, flag, NULL);
+	v = nand_verify_init(1, raw_size, 0, 0);
+	scratch = malloc(NAND_VERIFY_SCRATCH(raw_size));
+	if (!nbc || !v || !scratch || nand_verify_code_init(v, 0, chip, nbc) ||
+	    !(image = read_file(path, &len))) {
+		CHECK(0, "%s %s: no self-check", chip->name, mode);
+		goto OUT;
+	}
+
+	pages = len/raw_size;
+	ret = nand_verify_pages(v, 0, image, 0, pages, flag, scratch, &bad_page);
+	CHECK(ret == pages*steps, "%s %s: self-check of %zu pages returned %ld", chip->name, mode,
+	      pages, ret);
+
+	/* the first bytes of a raw page are data or code, whatever the layout */
+	page = rnd(pages);
+	bit = rnd(8*chip->page_size);
+	image[page*raw_size + bit/8] ^= 1 << (bit % 8);
+	ret = nand_verify_pages(v, 0, image + page*raw_size, page, 1, flag, scratch, &bad_page);
+	CHECK((ret < 0) && (bad_page == page), "%s %s: self-check missed bit %u of page %zu", chip->name, mode, bit, page);
+
+OUT:
+	free(image);
+	free(scratch);
+	nand_verify_free(v);
+	nand_bch_free(nbc);
+}
+
+/*
+ * nandbch_verify_sample() and nandbch_extract() of an image, then of it with
+ * up to t bits flipped in the first sector of some pages, and 2 in some
+ * Hamming sectors, which are uncorrectable; the whole sample must count
+ * them all, a smaller one must pick the same pages for the same seed, and
+ * the extraction give the input back but for the uncorrectable pages
+ */
+static void check_read_back(struct nand_chip *chip, const char *path, const char *out_path,
+                            unsigned int flag, const struct nandbch_options *opts,
+                            const unsigned char *input, size_t in_len, const char *mode)
+{
+	const size_t raw_size = chip->page_size + chip->spare_size;
+	struct nandbch_sample all = { 1.0, 0, rnd(1000) }, part, again;
+	struct nand_chip pchip;
+	unsigned char *image = NULL, *skip = NULL;
+	unsigned long flips = 0, bad = 0;
+	size_t len, pages, page;
+	unsigned int i, j, k, t, span, bit;
+	int max = 0, ret;
+
+	image = read_file(path, &len);
+	pages = len/raw_size;
+	skip = calloc(pages + 1, 1);
+	if (!image || !skip) {
+		CHECK(0, "%s %s: no image %s", chip->name, mode, path);
+		goto OUT;
+	}
+	CHECK(!nandbch_verify_sample(chip, path, flag, NULL, &all) && (all.sampled == pages) &&
+	      !all.bitflips && !all.uncorrectable && !all.rate_low,
+	      "%s %s: verify sample of %zu pages: %lu pages, %lu bitflips, %lu uncorrectable",
+	      chip->name, mode, pages, all.sampled, all.bitflips, all.uncorrectable);
+
+	CHECK(!nandbch_extract(chip, path, out_path, flag|FLAG_YAFFS, opts, 1 + rnd(3)),
+	      "%s %s: nandbch_extract failed", chip->name, mode);
+	check_extracted(chip, out_path, input, in_len, pages, skip, 1, mode);
+
+	/* the first bytes of a raw page are data of its first sector, whatever the layout */
+	for (i = 0; i < pages/4; i++) {
+		page = 4*i + rnd(4);
+		page_chip(chip, page, &pchip);
+		t = 1;
+		if (pchip.ecc_mode == NAND_ECC_BCH)
+			t = (pchip.ecc_bytes*8)/fls(1+8*pchip.ecc_sector);
+		k = 1 + rnd(t);
+		if ((pchip.ecc_mode != NAND_ECC_BCH) && !rnd(4))
+			k = 2;
+		span = 8*pchip.ecc_sector/k;
+		for (j = 0; j < k; j++) {
+			bit = j*span + rnd(span);
+			image[page*raw_size + bit/8] ^= 1 << (bit % 8);
+		}
+		if (k > t) {
+			skip[page] = 1;
+			bad++;
+			continue;
+		}
+		flips += k;
+		max = (k > max) ? k : max;
+	}
+	if (write_file(path, image, len)) {
+		CHECK(0, "%s %s: no image %s", chip->name, mode, path);
+		goto OUT;
+	}
+
+	CHECK(!nandbch_verify_sample(chip, path, flag, NULL, &all) && (all.bitflips == flips) &&
+	      (all.max_bitflips == max) && (all.uncorrectable == bad) && (all.bad_pages == bad),
+	      "%s %s: verify sample found %lu bitflips, at most %d, %lu uncorrectable, not %lu, %d, %lu",
+	      chip->name, mode, all.bitflips, all.max_bitflips, all.uncorrectable, flips, max, bad);
+
+	part = (struct nandbch_sample){ 0, 1 + rnd(pages), all.seed };
+	again = part;
+	CHECK(!nandbch_verify_sample(chip, path, flag, NULL, &part) &&
+	      !nandbch_verify_sample(chip, path, flag, NULL, &again) &&
+	      (part.sampled == part.count) && (part.bitflips <= flips) &&
+	      (part.bitflips == again.bitflips) && (part.sectors == again.sectors) &&
+	      (part.rate_low <= part.rate) && (part.rate <= part.rate_high),
+	      "%s %s: verify sample of %lu pages: %lu pages, %lu then %lu bitflips", chip->name, mode,
+	      part.count, part.sampled, part.bitflips, again.bitflips);
+
+	ret = nandbch_extract(chip, path, out_path, flag, opts, 1 + rnd(3));
+	CHECK(ret == (bad ? 1 : 0), "%s %s: nandbch_extract of %lu uncorrectable sectors returned %d",
+	      chip->name, mode, bad, ret);
+	check_extracted(chip, out_path, input, in_len, pages, skip, 0, mode);
+
+OUT:
+	free(skip);
+	free(image);
+}
+
+/*
+ * nandbch() and nandbch_patch() on a random image of a predefined chip
+ */
+static int check_nand(struct nand_chip *chip, const char *dir)
+{
+	static const struct nand_randomizer_params scramble = { 0xb400, 0xace1, 16, 0 };
+	static const struct nand_randomizer_params scramble_keep = { 0x6000, 0x7f, 0, 1 };
+	static const struct {
+		const char   *name;
+		unsigned int flag;
+		unsigned long dedup;
+		const struct nand_randomizer_params *randomizer;
+	} modes[] = {
+		{ "default",         0,                         0,  NULL },
+		{ "no-mask",         FLAG_NO_MASK,              0,  NULL },
+		{ "bitslice",        FLAG_BITSLICE,             0,  NULL },
+		{ "dedup",           0,                         64, NULL },
+		{ "pmecc",           FLAG_PMECC,                0,  NULL },
+		{ "pmecc-bitslice",  FLAG_PMECC|FLAG_BITSLICE,  0,  NULL },
+		{ "pmecc-no-mask",   FLAG_PMECC|FLAG_NO_MASK,   0,  NULL },
+		{ "randomizer",      0,                         0,  &scramble },
+		{ "randomizer-keep", FLAG_PMECC|FLAG_BITSLICE,  0,  &scramble_keep },
+	};
+	static const struct {
+		const char   *patch;
+		const char   *previous;
+		unsigned int flag;
+		const struct nand_randomizer_params *randomizer;
+	} passes[] = {
+		{ "patch",            "previous",            0,          NULL },
+		{ "pmecc-patch",      "pmecc-previous",      FLAG_PMECC, NULL },
+		{ "randomizer-patch", "randomizer-previous", 0,          &scramble },
+	};
+	const unsigned int m = fls(1+8*chip->ecc_sector);
+	const unsigned int t = (chip->ecc_bytes*8)/m;
+	const size_t in_len = CHECK_PAGES*chip->page_size - 1 - rnd(chip->page_size);
+	char in_path[4096], old_path[4096], out_path[4096], prev_path[4096];
+	unsigned char mask[CHECK_ECC_MAX], *input, *erased, *patch_data;
+	struct nandbch_options opts = {0};
+	struct nandbch_patch patch;
+	struct bch_control *bch;
+	struct ref_code ref;
+	unsigned int i, p;
+	int ret = -1;
+
+	snprintf(in_path, sizeof(in_path), "%s/in", dir);
+	snprintf(old_path, sizeof(old_path), "%s/old", dir);
+	snprintf(out_path, sizeof(out_path), "%s/out", dir);
+	snprintf(prev_path, sizeof(prev_path), "%s/prev", dir);
+
+	bch = init_bch(m, t, 0, BCH_ENCODE_ONLY);
+	input = malloc(in_len);
+	erased = malloc(chip->ecc_sector);
+	patch_data = malloc(3*chip->ecc_sector);
+	if (!bch || !input || !erased || !patch_data) {
+		fprintf(stderr, "%s: Error when init %s.\n", __func__, chip->name);
+		goto OUT;
+	}
+	ref_init(&ref, bch);
+
+	/* the mask is the inverted ecc of an erased sector */
+	memset(erased, 0xff, chip->ecc_sector);
+	memset(mask, 0, sizeof(mask));
+	ref_encode(&ref, erased, chip->ecc_sector, mask);
+	for (i = 0; i < chip->ecc_bytes; i++)
+		mask[i] = ~mask[i];
+	if (chip->ecc_mode != NAND_ECC_BCH)
+		memset(mask, 0, sizeof(mask));
+
+	/* random pages, erased pages and sectors, and repeated sectors */
+	fill_random(input, in_len);
+	for (p = 0; p+1 < CHECK_PAGES; p++) {
+		if (p % 7 == 3)
+			memset(input + p*chip->page_size, 0xff, chip->page_size);
+		if (p % 5 == 1)
+			memset(input + p*chip->page_size + chip->ecc_sector, 0xff, chip->ecc_sector);
+		if ((p % 6 == 2) && (p > 0))
+			memcpy(input + p*chip->page_size, input, chip->ecc_sector);
+	}
+
+	if (write_file(in_path, input, in_len)) {
+		fprintf(stderr, "%s: Error when write %s.\n", __func__, in_path);
+		goto OUT;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(modes); i++) {
+		opts.dedup_entries = modes[i].dedup;
+		opts.randomizer = modes[i].randomizer;
+		opts.self_check = 1;
+		CHECK(!nandbch(chip, in_path, out_path, modes[i].flag, &opts), "%s %s: nandbch failed",
+		      chip->name, modes[i].name);
+		check_image(chip, &ref, mask, input, in_len, out_path, modes[i].flag,
+		            modes[i].randomizer, modes[i].name);
+		check_reader(chip, in_path, out_path, modes[i].flag, &opts, modes[i].name);
+		if (!chip->partitions)
+			check_self_check(chip, out_path, modes[i].flag, modes[i].name);
+		check_read_back(chip, out_path, old_path, modes[i].flag, &opts, input, in_len,
+		                modes[i].name);
+	}
+	opts.dedup_entries = 0;
+	opts.randomizer = NULL;
+	opts.self_check = 0;
+
+	/* pages shifted by the boot header, and YAFFS records, read on demand */
+	CHECK(!nandbch(chip, in_path, out_path, FLAG_HEADER, &opts), "%s header: nandbch failed",
+	      chip->name);
+	check_reader(chip, in_path, out_path, FLAG_HEADER, &opts, "header");
+	if (!chip->partitions) {
+		const size_t stride = chip->page_size + chip->spare_size;
+		const size_t yaffs_len = in_len/stride*stride - CHECK_HEADER;
+
+		if (write_file(prev_path, input, yaffs_len)) {
+			fprintf(stderr, "%s: Error when write %s.\n", __func__, prev_path);
+			goto OUT;
+		}
+		CHECK(!nandbch(chip, prev_path, out_path, FLAG_HEADER|FLAG_YAFFS|FLAG_PMECC, &opts),
+		      "%s yaffs: nandbch failed", chip->name);
+		check_reader(chip, prev_path, out_path, FLAG_HEADER|FLAG_YAFFS|FLAG_PMECC, &opts, "yaffs");
+	}
+
+	check_bad_blocks(chip, dir, in_path, in_len);
+	check_batch(chip, dir, &ref, mask, input, in_len, in_path);
+
+	for (i = 0; i < ARRAY_SIZE(passes); i++) {
+		const unsigned int flag = passes[i].flag;
+		const char *mode = passes[i].patch;
+
+		/* patch across sector and page boundaries of the previous image */
+		opts.randomizer = passes[i].randomizer;
+		CHECK(!nandbch(chip, in_path, old_path, flag, &opts), "%s: nandbch failed", chip->name);
+		patch.offset = rnd(in_len - 3*chip->ecc_sector);
+		patch.len = 1 + rnd(3*chip->ecc_sector - 1);
+		patch.data = patch_data;
+		fill_random(patch_data, patch.len);
+		CHECK(!nandbch_patch(chip, old_path, flag, &patch, 1, &opts), "%s %s: nandbch_patch failed",
+		      chip->name, mode);
+		memcpy(input + patch.offset, patch_data, patch.len);
+		check_image(chip, &ref, mask, input, in_len, old_path, flag, opts.randomizer, mode);
+
+		/* incremental rebuild of the patched input from the unpatched run */
+		if (write_file(prev_path, input, in_len)) {
+			fprintf(stderr, "%s: Error when write %s.\n", __func__, prev_path);
+			goto OUT;
+		}
+		CHECK(!nandbch(chip, in_path, out_path, flag, &opts), "%s: nandbch failed", chip->name);
+		opts.previous_in = in_path;
+		opts.previous_out = out_path;
+		CHECK(!nandbch(chip, prev_path, old_path, flag, &opts), "%s %s: nandbch --previous failed",
+		      chip->name, mode);
+		opts.previous_in = opts.previous_out = NULL;
+		check_image(chip, &ref, mask, input, in_len, old_path, flag, opts.randomizer,
+		            passes[i].previous);
+
+		/* back to the original input for the next pass */
+		if (write_file(in_path, input, in_len))
+			goto OUT;
+	}
+	ret = 0;
+
+OUT:
+	unlink(in_path);
+	unlink(old_path);
+	unlink(out_path);
+	unlink(prev_path);
+	free(patch_data);
+	free(erased);
+	free(input);
+	free_bch(bch);
+	return ret;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: nandbch-check [OPTION]\n"
+		"Check every BCH encoder and decoder against a reference, and nandbch()\n"
+		"\n"
+		"Options:\n"
+		"  -r, --rounds=N    Random rounds per (m, t) pair, default 100\n"
+		"  -s, --seed=N      Random seed, default 1\n");
+}
+
+int main(int argc, char **argv)
+{
+	static struct option options[] = {
+		{"rounds", required_argument, NULL, 'r'},
+		{"seed"  , required_argument, NULL, 's'},
+		{"help"  , no_argument      , NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+	char dir[] = "/tmp/nandbch-check.XXXXXX";
+	static const struct nand_partition partitions[] = {
+		{ 3, NAND_ECC_HAMMING,     256, 3, -1 },
+		{ 5, NAND_ECC_HAMMING_SMC, 512, 3, 1 },
+		{ 0 },
+	};
+	struct nand_oob_region regions[5];
+	struct nand_chip chip;
+	unsigned int i, seed = 1;
+	int opt, ret;
+
+	while ((opt = getopt_long(argc, argv, "r:s:h", options, NULL)) >= 0) {
+		switch (opt) {
+		case 'r':
+			check_rounds = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+	srand(seed);
+
+	ret = check_params();
+	if (!ret)
+		ret = check_digests();
+
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "%s: Error when create %s: ", argv[0], dir);
+		perror(NULL);
+		return -1;
+	}
+
+	for (i = 0; (i < CHIP_COUNT) && !ret; i++) {
+		chip = chips[i];
+		if (chip.ecc_offset == -1)
+			chip.ecc_offset = chip.spare_size - (chip.page_size/chip.ecc_sector*chip.ecc_bytes);
+		ret = check_nand(&chip, dir);
+
+		/* ecc codes interleaved with data, then scattered out of order */
+		chip.layout = NAND_LAYOUT_INTERLEAVED;
+		if (!ret)
+			ret = check_nand(&chip, dir);
+		chip.layout = NAND_LAYOUT_OOB;
+		regions[0] = (struct nand_oob_region){ 8, 10 };
+		regions[1] = (struct nand_oob_region){ 30, 4 };
+		regions[2] = (struct nand_oob_region){ 2, 5 };
+		regions[3] = (struct nand_oob_region){ 40, chip.page_size/chip.ecc_sector*chip.ecc_bytes - 19 };
+		regions[4] = (struct nand_oob_region){ 0, 0 };
+		chip.ecc_regions = regions;
+		if (!ret)
+			ret = check_nand(&chip, dir);
+
+		/* Hamming boot partitions, interleaved, then Hamming on the whole chip */
+		chip.ecc_regions = NULL;
+		chip.partitions = partitions;
+		chip.layout = NAND_LAYOUT_INTERLEAVED;
+		if (!ret)
+			ret = check_nand(&chip, dir);
+		chip.partitions = NULL;
+		chip.layout = NAND_LAYOUT_OOB;
+		chip.ecc_mode = NAND_ECC_HAMMING;
+		chip.ecc_sector = 512;
+		chip.ecc_bytes = NAND_HAMMING_BYTES;
+		chip.ecc_offset = chip.spare_size - (chip.page_size/chip.ecc_sector*chip.ecc_bytes);
+		if (!ret)
+			ret = check_nand(&chip, dir);
+	}
+	rmdir(dir);
+
+	printf("%lu checks, %lu failed (seed %u)\n", checks, failures, seed);
+	return (ret || failures) ? -1 : 0;
+}
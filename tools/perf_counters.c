@@ -0,0 +1,200 @@
+/*
+ * Hardware performance counters for the benchmarks, through perf_event_open()
+ *
+ * Each counter is opened on its own, so that those the CPU, the kernel or a
+ * container does not provide are reported as unavailable without disabling
+ * the others.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf_counters.h"
+
+const char *const perf_counter_names[PERF_COUNTERS] = {
+	"cpu_cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses",
+};
+
+static const struct {
+	unsigned int       type;
+	unsigned long long config;
+} perf_events[PERF_COUNTERS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+	                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+/**
+ * perf_counters_open - open the counters of the calling thread, user space only
+ * @pc:        counters
+ *
+ * Returns the number of available counters, 0 when perf events are not
+ * supported or not permitted (see /proc/sys/kernel/perf_event_paranoid).
+ */
+int perf_counters_open(struct perf_counters *pc)
+{
+	struct perf_event_attr attr;
+	int i, n = 0;
+
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = perf_events[i].type;
+		attr.config = perf_events[i].config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED|PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		pc->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		pc->value[i] = -1;
+		if (pc->fd[i] >= 0)
+			n++;
+	}
+
+	return n;
+}
+
+/**
+ * perf_counters_close - close the counters
+ * @pc:        counters opened by perf_counters_open()
+ */
+void perf_counters_close(struct perf_counters *pc)
+{
+	int i;
+
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		if (pc->fd[i] >= 0)
+			close(pc->fd[i]);
+		pc->fd[i] = -1;
+	}
+}
+
+/**
+ * perf_counters_start - reset and enable the counters
+ * @pc:        counters opened by perf_counters_open()
+ */
+void perf_counters_start(struct perf_counters *pc)
+{
+	int i;
+
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		if (pc->fd[i] >= 0) {
+			ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+/**
+ * perf_counters_stop - disable the counters and read their values
+ * @pc:        counters started by perf_counters_start()
+ *
+ * A counter which did not get any time on the PMU, for instance because
+ * there are more counters than hardware registers, is read as -1.
+ */
+void perf_counters_stop(struct perf_counters *pc)
+{
+	unsigned long long buf[3]; /* value, time enabled, time running */
+	int i;
+
+	for (i = 0; i < PERF_COUNTERS; i++)
+		if (pc->fd[i] >= 0)
+			ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		pc->value[i] = -1;
+		if ((pc->fd[i] < 0) || (read(pc->fd[i], buf, sizeof(buf)) != sizeof(buf)) || !buf[2])
+			continue;
+		pc->value[i] = (double)buf[0]*buf[1]/buf[2];
+	}
+}
+
+/**
+ * perf_counters_per_byte - counts of the last measurement per byte
+ * @pc:        counters read by perf_counters_stop()
+ * @bytes:     bytes processed during the measurement
+ * @result:    PERF_COUNTERS counts per byte, -1 for unavailable counters
+ */
+void perf_counters_per_byte(const struct perf_counters *pc, unsigned long long bytes,
+                            double *result)
+{
+	int i;
+
+	for (i = 0; i < PERF_COUNTERS; i++)
+		result[i] = (pc->value[i] < 0) ? -1 : pc->value[i]/bytes;
+}
+
+/**
+ * perf_counters_print_header - print the column names of the counters
+ * @format:    FORMAT_TABLE or FORMAT_CSV, JSON has no header
+ *
+ * Ends the header line.
+ */
+void perf_counters_print_header(enum bench_format format)
+{
+	static const char *const labels[PERF_COUNTERS] = {
+		"cyc/B", "ins/B", "L1Dmiss/B", "LLCmiss/B", "brmiss/B",
+	};
+	unsigned int i;
+
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		if (format == FORMAT_TABLE)
+			printf(" %9s", labels[i]);
+		else
+			printf(",%s_per_byte", perf_counter_names[i]);
+	}
+	printf("\n");
+}
+
+/**
+ * perf_counters_print - print counts per byte at the end of a result
+ * @v:         PERF_COUNTERS counts from perf_counters_per_byte()
+ * @format:    output format
+ *
+ * Unavailable counters are printed as "-", an empty CSV field or null in JSON.
+ */
+void perf_counters_print(const double *v, enum bench_format format)
+{
+	unsigned int i;
+
+	for (i = 0; i < PERF_COUNTERS; i++) {
+		switch (format) {
+		case FORMAT_TABLE:
+			if (v[i] < 0)
+				printf(" %9s", "-");
+			else
+				printf(" %9.4f", v[i]);
+			break;
+		case FORMAT_CSV:
+			if (v[i] < 0)
+				printf(",");
+			else
+				printf(",%.6f", v[i]);
+			break;
+		case FORMAT_JSON:
+			if (v[i] < 0)
+				printf(", \"%s_per_byte\": null", perf_counter_names[i]);
+			else
+				printf(", \"%s_per_byte\": %.6f", perf_counter_names[i], v[i]);
+			break;
+		}
+	}
+}
+
+/* monotonic time in seconds */
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
@@ -0,0 +1,50 @@
+#ifndef _PERF_COUNTERS_H
+#define _PERF_COUNTERS_H
+
+/* output format of the benchmarks */
+enum bench_format {
+	FORMAT_TABLE,
+	FORMAT_CSV,
+	FORMAT_JSON,
+};
+
+enum perf_counter_id {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_L1D_MISSES,
+	PERF_LLC_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_COUNTERS,
+};
+
+/**
+ * struct perf_counters - hardware performance counters of the calling thread
+ * @fd:        perf event file descriptors, -1 for unavailable counters
+ * @value:     counts of the last measurement, scaled when the counters were
+ *             multiplexed, or -1 for unavailable counters
+ */
+struct perf_counters {
+	int    fd[PERF_COUNTERS];
+	double value[PERF_COUNTERS];
+};
+
+extern const char *const perf_counter_names[PERF_COUNTERS];
+
+int perf_counters_open(struct perf_counters *pc);
+
+void perf_counters_close(struct perf_counters *pc);
+
+void perf_counters_start(struct perf_counters *pc);
+
+void perf_counters_stop(struct perf_counters *pc);
+
+void perf_counters_per_byte(const struct perf_counters *pc, unsigned long long bytes,
+                            double *result);
+
+void perf_counters_print_header(enum bench_format format);
+
+void perf_counters_print(const double *v, enum bench_format format);
+
+double now(void);
+
+#endif /* _PERF_COUNTERS_H */
@@ -0,0 +1,206 @@
+/*
+ * Work stealing thread pool
+ *
+ * Tasks are numbered 0..n-1 and known up front. Each worker starts with an
+ * equal range of them and runs it from the front; a worker whose range is
+ * empty takes the back half of the range of another one. Workers keep
+ * running neighbouring tasks, e.g. consecutive chunks of the same file, and
+ * long and short tasks even out without a shared queue. Ranges are dealt
+ * once the threads are created, only to those which started, so that every
+ * task is in the range of a running worker: a task may wait for an earlier
+ * one, see nandbch_batch(), and no range waits for a thread which never came.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "work_pool.h"
+
+/*
+ * range of tasks of a worker, [next, end), padded to a cache line so that
+ * workers do not share one
+ */
+struct work_range {
+	pthread_mutex_t lock;
+	unsigned long   next;
+	unsigned long   end;
+	unsigned long   tasks;
+	unsigned long   steals;
+} __attribute__((aligned(64)));
+
+struct work_pool {
+	struct work_range *ranges;
+	int               workers;
+	work_pool_fn      fn;
+	void              *arg;
+	int               failed;   /* set by any worker, atomic */
+	pthread_mutex_t   lock;     /* the ranges are dealt, under @lock */
+	pthread_cond_t    dealt_cond;
+	int               dealt;
+};
+
+struct work_thread {
+	struct work_pool *pool;
+	int              id;
+};
+
+/* take the next task of a range, returns 0 if it is empty */
+static int work_take(struct work_range *range, unsigned long *task)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&range->lock);
+	if (range->next < range->end) {
+		*task = range->next++;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&range->lock);
+	return ret;
+}
+
+/*
+ * move the back half of the range of another worker to the empty range of
+ * worker @id, returns 0 if there is nothing left to steal
+ */
+static int work_steal(struct work_pool *pool, int id)
+{
+	struct work_range *self = &pool->ranges[id], *victim;
+	unsigned long next, end;
+	int i;
+
+	for (i=1; i<pool->workers; i++) {
+		victim = &pool->ranges[(id + i) % pool->workers];
+
+		pthread_mutex_lock(&victim->lock);
+		next = victim->next;
+		end = victim->end;
+		if (next < end) {
+			next += (end - next)/2;
+			victim->end = next;
+		}
+		pthread_mutex_unlock(&victim->lock);
+
+		if (next < end) {
+			pthread_mutex_lock(&self->lock);
+			self->next = next;
+			self->end = end;
+			self->steals++;
+			pthread_mutex_unlock(&self->lock);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void *work_thread_run(void *data)
+{
+	struct work_thread *thread = data;
+	struct work_pool *pool = thread->pool;
+	struct work_range *range = &pool->ranges[thread->id];
+	unsigned long task;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->dealt)
+		pthread_cond_wait(&pool->dealt_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	while (!__atomic_load_n(&pool->failed, __ATOMIC_RELAXED)) {
+		if (!work_take(range, &task)) {
+			if (!work_steal(pool, thread->id))
+				break;
+			continue;
+		}
+
+		range->tasks++;
+		if (pool->fn(pool->arg, task, thread->id))
+			__atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+/**
+ * work_pool_run - run tasks on a pool of threads
+ * @workers:   number of threads, the calling one included
+ * @tasks:     number of tasks
+ * @fn:        task function, called concurrently
+ * @arg:       argument of @fn
+ * @stats:     output, what the workers did, or NULL
+ *
+ * Returns 0 when every task ran successfully, or -1 if a task failed, after
+ * which the tasks not started yet are not run.
+ */
+int work_pool_run(int workers, unsigned long tasks, work_pool_fn fn, void *arg,
+                  struct work_pool_stats *stats)
+{
+	struct work_pool pool = { NULL, workers, fn, arg, 0 };
+	struct work_thread *threads;
+	pthread_t *tids;
+	int i, started;
+
+	if (workers < 1)
+		workers = pool.workers = 1;
+
+	pool.ranges = aligned_alloc(64, workers*sizeof(*pool.ranges));
+	threads = malloc(workers*sizeof(*threads));
+	tids = malloc(workers*sizeof(*tids));
+	if (!pool.ranges || !threads || !tids) {
+		fprintf(stderr, "%s: Error when malloc %d workers.\n", __func__, workers);
+		free(pool.ranges);
+		free(threads);
+		free(tids);
+		return -1;
+	}
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.dealt_cond, NULL);
+	pool.dealt = 0;
+	for (i=0; i<workers; i++) {
+		pthread_mutex_init(&pool.ranges[i].lock, NULL);
+		threads[i].pool = &pool;
+		threads[i].id = i;
+	}
+
+	/* worker 0 is the calling thread */
+	for (started=1; started<workers; started++) {
+		if (pthread_create(&tids[started], NULL, work_thread_run, &threads[started])) {
+			fprintf(stderr, "%s: Error when create worker %d, going on with %d.\n", __func__,
+			        started, started);
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.workers = started;
+	for (i=0; i<workers; i++) {
+		pool.ranges[i].next = (i < started) ? tasks*i/started : 0;
+		pool.ranges[i].end = (i < started) ? tasks*(i + 1)/started : 0;
+		pool.ranges[i].tasks = 0;
+		pool.ranges[i].steals = 0;
+	}
+	pool.dealt = 1;
+	pthread_cond_broadcast(&pool.dealt_cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	work_thread_run(&threads[0]);
+	for (i=1; i<started; i++)
+		pthread_join(tids[i], NULL);
+
+	if (stats) {
+		stats->tasks = stats->steals = 0;
+		for (i=0; i<workers; i++) {
+			stats->tasks += pool.ranges[i].tasks;
+			stats->steals += pool.ranges[i].steals;
+		}
+	}
+
+	for (i=0; i<workers; i++)
+		pthread_mutex_destroy(&pool.ranges[i].lock);
+	pthread_cond_destroy(&pool.dealt_cond);
+	pthread_mutex_destroy(&pool.lock);
+	free(pool.ranges);
+	free(threads);
+	free(tids);
+	return pool.failed ? -1 : 0;
+}
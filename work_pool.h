@@ -0,0 +1,22 @@
+#ifndef _WORK_POOL_H
+#define _WORK_POOL_H
+
+/*
+ * run task @task on worker @worker; returns 0, or -1 to stop the pool
+ */
+typedef int (*work_pool_fn)(void *arg, unsigned long task, int worker);
+
+/**
+ * struct work_pool_stats - what the workers of a run did
+ * @tasks:     tasks run
+ * @steals:    task ranges taken from another worker
+ */
+struct work_pool_stats {
+	unsigned long tasks;
+	unsigned long steals;
+};
+
+int work_pool_run(int workers, unsigned long tasks, work_pool_fn fn, void *arg,
+                  struct work_pool_stats *stats);
+
+#endif /* _WORK_POOL_H */